@@ -0,0 +1,127 @@
+#include "acSystem.h"
+
+#include <Eigen/OrderingMethods>
+#include <cmath>
+
+AcSystem::AcSystem(const VertexMap& vertices) {
+  nodeIndices.reserve(vertices.size());
+  for (auto& entry : vertices) {
+    Expression voltage = entry.second->getVoltage();
+    if (!voltage.isConstant() || voltage.isSolved()) {
+      nodeIndices[entry.first] = numNodes++;
+    }
+  }
+  rhs.resize(numNodes);
+}
+
+long AcSystem::getNode(const Vertex& v) const {
+  auto it = nodeIndices.find(v.getId());
+  if (it == nodeIndices.end()) {
+    return -1;
+  }
+  return static_cast<long>(it->second);
+}
+
+void AcSystem::addEntry(long row, long col, double conductance,
+                        double capacitance) {
+  if (row < 0 || col < 0) return;
+  // Both matrices get every entry so that they share a sparsity pattern
+  conductances.emplace_back(row, col, conductance);
+  capacitances.emplace_back(row, col, capacitance);
+}
+
+void AcSystem::stampAdmittance(const Vertex& from, const Vertex& to,
+                               double conductance, double capacitance) {
+  long a = getNode(from);
+  long b = getNode(to);
+  addEntry(a, a, conductance, capacitance);
+  addEntry(b, b, conductance, capacitance);
+  addEntry(a, b, -conductance, -capacitance);
+  addEntry(b, a, -conductance, -capacitance);
+  branches.push_back({a, b, conductance, capacitance, 0, -1});
+}
+
+void AcSystem::stampCurrentSource(const Vertex& from, const Vertex& to,
+                                  double current) {
+  long a = getNode(from);
+  long b = getNode(to);
+  if (a >= 0) rhs[a] -= current;
+  if (b >= 0) rhs[b] += current;
+  branches.push_back({a, b, 0, 0, current, -1});
+}
+
+void AcSystem::stampVoltageSource(const Vertex& from, const Vertex& to,
+                                  double voltage, double inductance) {
+  long a = getNode(from);
+  long b = getNode(to);
+  long row = static_cast<long>(rhs.size());
+  rhs.push_back(voltage);
+  // The source current leaves `from` and enters `to`
+  addEntry(a, row, 1, 0);
+  addEntry(b, row, -1, 0);
+  // v(to) - v(from) + jwL i = voltage
+  addEntry(row, b, 1, 0);
+  addEntry(row, a, -1, 0);
+  addEntry(row, row, 0, inductance);
+  branches.push_back({a, b, 0, 0, 0, row});
+}
+
+void AcSystem::analyze() {
+  const Eigen::Index size = static_cast<Eigen::Index>(rhs.size());
+  SparseMatrix G(size, size);
+  G.setFromTriplets(conductances.begin(), conductances.end());
+  SparseMatrix C(size, size);
+  C.setFromTriplets(capacitances.begin(), capacitances.end());
+  Eigen::COLAMDOrdering<int> colamd;
+  Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> permutation;
+  colamd(G, permutation);
+  // Column i moves to permutation(i), as in SparseLU
+  ordering = permutation.inverse();
+  orderedConductances = G * ordering;
+  orderedCapacitances = C * ordering;
+}
+
+void AcSystem::analyzePattern(Solver& solver) const {
+  solver.analyzePattern(orderedConductances.cast<std::complex<double>>());
+}
+
+bool AcSystem::solve(double frequency, Solver& solver,
+                     Eigen::VectorXcd& solution) const {
+  const Eigen::Index size = static_cast<Eigen::Index>(rhs.size());
+  const double omega = 2 * M_PI * frequency;
+  ComplexMatrix Y = orderedConductances.cast<std::complex<double>>();
+  std::complex<double>* values = Y.valuePtr();
+  const double* capacitanceValues = orderedCapacitances.valuePtr();
+  for (Eigen::Index i = 0; i < Y.nonZeros(); i++) {
+    values[i] += std::complex<double>(0, omega * capacitanceValues[i]);
+  }
+  solver.factorize(Y);
+  if (solver.info() != Eigen::Success) {
+    return false;
+  }
+  Eigen::VectorXcd b =
+      Eigen::Map<const Eigen::VectorXd>(rhs.data(), size).cast<
+          std::complex<double>>();
+  solution = ordering * solver.solve(b);
+  return solution.allFinite();
+}
+
+std::complex<double> AcSystem::getVoltage(
+    const Vertex& v, const Eigen::VectorXcd& solution) const {
+  long node = getNode(v);
+  return node < 0 ? 0 : solution[node];
+}
+
+std::complex<double> AcSystem::getBranchCurrent(
+    size_t branch, const Eigen::VectorXcd& solution, double frequency) const {
+  const Branch& b = branches[branch];
+  if (b.row >= 0) {
+    return solution[b.row];
+  }
+  std::complex<double> voltage = 0;
+  if (b.from >= 0) voltage += solution[b.from];
+  if (b.to >= 0) voltage -= solution[b.to];
+  std::complex<double> admittance(b.conductance,
+                                  2 * M_PI * frequency * b.capacitance);
+  return admittance * voltage + b.current;
+}
@@ -0,0 +1,145 @@
+#ifndef AC_SYSTEM_H
+#define AC_SYSTEM_H
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <complex>
+#include <unordered_map>
+#include <vector>
+
+#include "uuid.h"
+#include "vertex.h"
+
+/**
+ * The small-signal model of a circuit about its DC operating point, in
+ * Modified Nodal Analysis form, for solving at many frequencies.
+ *
+ * Branches add their linearisation with exactly one call to a `stamp*`
+ * method each, which numbers them in the order they were stamped. The system
+ * is G + jwC x = b, where G holds the conductances and C the capacitances and
+ * inductances, so every frequency shares one sparsity pattern. `analyze` finds
+ * its fill-reducing ordering once. Each thread then analyses a `Solver` of
+ * its own for the pattern with `analyzePattern`, after which `solve` only
+ * factorises each frequency, and can be called from several threads at once.
+ *
+ * Vertices with a given voltage are held at DC, so they are the small-signal
+ * ground.
+ */
+class AcSystem {
+ public:
+  typedef Eigen::SparseMatrix<std::complex<double>> ComplexMatrix;
+  /**
+   * The LU factorisation of the system at one frequency. Its columns are
+   * already in a fill-reducing order
+   */
+  typedef Eigen::SparseLU<ComplexMatrix, Eigen::NaturalOrdering<int>> Solver;
+
+  /**
+   * Creates an empty system
+   * @param vertices the vertices of the circuit. Those whose voltage was
+   * given rather than solved for are the ground of the system
+   */
+  explicit AcSystem(const VertexMap& vertices);
+
+  /**
+   * Adds a conductance in parallel with a capacitance between two vertices
+   * @param conductance the conductance, in Siemens
+   * @param capacitance the capacitance, in Farads
+   */
+  void stampAdmittance(const Vertex& from, const Vertex& to,
+                       double conductance, double capacitance = 0);
+
+  /**
+   * Adds an independent current flowing from `from` to `to` through a branch
+   * @param current the amplitude of the current, in Amps
+   */
+  void stampCurrentSource(const Vertex& from, const Vertex& to,
+                          double current);
+
+  /**
+   * Adds a voltage source in series with an inductance, such that `to` is
+   * `voltage` higher than `from` less the voltage across the inductance
+   * @param voltage the amplitude of the source, in Volts
+   * @param inductance the inductance, in Henries; 0 for an ideal source
+   */
+  void stampVoltageSource(const Vertex& from, const Vertex& to,
+                          double voltage, double inductance = 0);
+
+  /**
+   * Finds the fill-reducing ordering of the system once every branch has
+   * been stamped
+   */
+  void analyze();
+
+  /**
+   * Analyses the sparsity pattern that the system has at every frequency, so
+   * that `solver` can be reused by `solve` without analysing it again
+   * @pre `analyze` was called
+   */
+  void analyzePattern(Solver& solver) const;
+
+  /**
+   * Solves the system at one frequency
+   * @param frequency the frequency, in Hertz
+   * @param solver a solver from `analyzePattern`, which is refactorised at
+   * `frequency`
+   * @param solution set to the solution of the system
+   * @return false if the system is singular at `frequency`
+   */
+  bool solve(double frequency, Solver& solver,
+             Eigen::VectorXcd& solution) const;
+
+  /**
+   * @return the voltage of `v` in `solution`
+   */
+  std::complex<double> getVoltage(const Vertex& v,
+                                  const Eigen::VectorXcd& solution) const;
+
+  /**
+   * @param branch the number of a branch, in the order they were stamped
+   * @param solution the solution of the system at `frequency`
+   * @return the current flowing from `from` to `to` through the branch
+   */
+  std::complex<double> getBranchCurrent(size_t branch,
+                                        const Eigen::VectorXcd& solution,
+                                        double frequency) const;
+
+ private:
+  /**
+   * The small-signal current through one stamped branch: an admittance, a
+   * fixed current or the current unknown of a voltage source
+   */
+  struct Branch {
+    long from;
+    long to;
+    double conductance;
+    double capacitance;
+    double current;
+    /**
+     * The row of the current through a voltage source, or -1
+     */
+    long row;
+  };
+
+  typedef Eigen::SparseMatrix<double> SparseMatrix;
+
+  long getNode(const Vertex& v) const;
+  void addEntry(long row, long col, double conductance, double capacitance);
+
+  std::unordered_map<uuids::uuid, size_t> nodeIndices;
+  size_t numNodes = 0;
+  std::vector<Branch> branches;
+  std::vector<Eigen::Triplet<double>> conductances;
+  std::vector<Eigen::Triplet<double>> capacitances;
+  std::vector<double> rhs;
+
+  /**
+   * The columns of G and C, multiplied by `ordering`. Both have the sparsity
+   * pattern of G + C, so their values line up entry for entry
+   */
+  SparseMatrix orderedConductances;
+  SparseMatrix orderedCapacitances;
+  Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> ordering;
+};
+
+#endif  // AC_SYSTEM_H
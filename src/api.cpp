@@ -1,15 +1,231 @@
 #include "api.h"
 
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/util/json_util.h>
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "circuitGraph.h"
 #include "proto.h"
+#include "solutionCache.h"
+#include "threadPool.h"
 
-int solveCircuit(proto::CircuitGraph input, proto::CircuitGraph& output) {
+/**
+ * Where the fields after `size` begin
+ */
+static const size_t kOptionsBegin = offsetof(CircuitSolverOptions, engine);
+
+/**
+ * Copies the fields after `size` that are within `size` bytes of the start of
+ * both `from` and `to`
+ */
+static void copyOptions(const CircuitSolverOptions& from,
+                        CircuitSolverOptions& to, size_t size) {
+  size = std::min(size, sizeof(CircuitSolverOptions));
+  if (size > kOptionsBegin) {
+    std::memcpy(reinterpret_cast<char*>(&to) + kOptionsBegin,
+                reinterpret_cast<const char*>(&from) + kOptionsBegin,
+                size - kOptionsBegin);
+  }
+}
+
+void getDefaultSolverOptions(CircuitSolverOptions* options) {
+  SolverConfig config;
+  CircuitSolverOptions defaults;
+  defaults.size = sizeof(defaults);
+  defaults.engine = CIRCUITSOLVER_ENGINE_AUTO;
+  defaults.linearSolver = CIRCUITSOLVER_LINEAR_SOLVER_AUTO;
+  defaults.numThreads = config.numThreads;
+  defaults.partitionThreads = config.partitionThreads;
+  defaults.functionTolerance = config.functionTolerance;
+  defaults.gradientTolerance = config.gradientTolerance;
+  defaults.parameterTolerance = config.parameterTolerance;
+  defaults.maxIterations = config.maxIterations;
+  defaults.maxNewtonIterations = config.maxNewtonIterations;
+  defaults.newtonTolerance = config.newtonTolerance;
+  defaults.maxSolveAttempts = config.maxSolveAttempts;
+  defaults.maxSolveSeconds = config.maxSolveSeconds;
+  defaults.seed = config.seed;
+  defaults.batchThreads = 0;
+  defaults.reduceTopology = config.reduceTopology;
+  defaults.homotopy = CIRCUITSOLVER_HOMOTOPY_SOURCE_STEPPING;
+  defaults.homotopySteps = config.homotopySteps;
+  defaults.nativeCode = config.nativeCode;
+  copyOptions(defaults, *options, options->size);
+}
+
+/**
+ * Reads the options of a caller that may have been built against another
+ * version of `CircuitSolverOptions`
+ *
+ * @param read set to `options`, with the defaults for the fields beyond its
+ * size, or to the defaults if `options` is null
+ * @return false if the size of `options` leaves out the size itself
+ */
+static bool readOptions(const CircuitSolverOptions* options,
+                        CircuitSolverOptions& read) {
+  read.size = sizeof(read);
+  getDefaultSolverOptions(&read);
+  if (options == nullptr) {
+    return true;
+  }
+  if (options->size < sizeof(options->size)) {
+    return false;
+  }
+  copyOptions(*options, read, options->size);
+  return true;
+}
+
+/**
+ * Converts the C options to a `SolverConfig`
+ * @return false if one of the options or their size is out of range
+ */
+static bool toSolverConfig(const CircuitSolverOptions* options,
+                           SolverConfig& config) {
+  if (options == nullptr) {
+    return true;
+  }
+  CircuitSolverOptions read;
+  if (!readOptions(options, read)) {
+    return false;
+  }
+  options = &read;
+  switch (options->engine) {
+    case CIRCUITSOLVER_ENGINE_AUTO:
+      config.engine = SolverEngine::AUTO;
+      break;
+    case CIRCUITSOLVER_ENGINE_NEWTON:
+      config.engine = SolverEngine::NEWTON;
+      break;
+    case CIRCUITSOLVER_ENGINE_CERES:
+      config.engine = SolverEngine::CERES;
+      break;
+    default:
+      return false;
+  }
+  switch (options->linearSolver) {
+    case CIRCUITSOLVER_LINEAR_SOLVER_AUTO:
+      config.linearSolver = LinearSolver::AUTO;
+      break;
+    case CIRCUITSOLVER_LINEAR_SOLVER_DENSE_QR:
+      config.linearSolver = LinearSolver::DENSE_QR;
+      break;
+    case CIRCUITSOLVER_LINEAR_SOLVER_SPARSE_NORMAL_CHOLESKY:
+      config.linearSolver = LinearSolver::SPARSE_NORMAL_CHOLESKY;
+      break;
+    case CIRCUITSOLVER_LINEAR_SOLVER_ITERATIVE_SCHUR:
+      config.linearSolver = LinearSolver::ITERATIVE_SCHUR;
+      break;
+    case CIRCUITSOLVER_LINEAR_SOLVER_CGNR:
+      config.linearSolver = LinearSolver::CGNR;
+      break;
+    default:
+      return false;
+  }
+  switch (options->homotopy) {
+    case CIRCUITSOLVER_HOMOTOPY_NONE:
+      config.homotopy = Homotopy::NONE;
+      break;
+    case CIRCUITSOLVER_HOMOTOPY_SOURCE_STEPPING:
+      config.homotopy = Homotopy::SOURCE_STEPPING;
+      break;
+    case CIRCUITSOLVER_HOMOTOPY_GMIN_STEPPING:
+      config.homotopy = Homotopy::GMIN_STEPPING;
+      break;
+    default:
+      return false;
+  }
+  if (options->functionTolerance < 0 || options->gradientTolerance < 0 ||
+      options->parameterTolerance < 0 || options->newtonTolerance <= 0 ||
+      options->maxIterations == 0 || options->maxNewtonIterations == 0 ||
+      options->maxSolveAttempts == 0 || options->maxSolveSeconds < 0 ||
+      options->homotopySteps == 0) {
+    return false;
+  }
+  config.numThreads = options->numThreads;
+  config.partitionThreads = options->partitionThreads;
+  config.functionTolerance = options->functionTolerance;
+  config.gradientTolerance = options->gradientTolerance;
+  config.parameterTolerance = options->parameterTolerance;
+  config.maxIterations = options->maxIterations;
+  config.maxNewtonIterations = options->maxNewtonIterations;
+  config.newtonTolerance = options->newtonTolerance;
+  config.maxSolveAttempts = options->maxSolveAttempts;
+  config.maxSolveSeconds = options->maxSolveSeconds;
+  config.seed = options->seed;
+  config.reduceTopology = options->reduceTopology != 0;
+  config.homotopySteps = options->homotopySteps;
+  config.nativeCode = options->nativeCode != 0;
+  return true;
+}
+
+/**
+ * @return the error code for the structural errors of `circuitGraph`, or 0 if
+ * it has none
+ */
+static int checkStructure(const CircuitGraph& circuitGraph) {
+  switch (circuitGraph.checkStructure()) {
+    case StructuralError::NONE:
+      break;
+    case StructuralError::FLOATING_VERTEX:
+      return CIRCUITSOLVER_ERROR_FLOATING_VERTEX;
+    case StructuralError::VOLTAGE_SOURCE_LOOP:
+      return CIRCUITSOLVER_ERROR_VOLTAGE_SOURCE_LOOP;
+    case StructuralError::CURRENT_SOURCE_CUTSET:
+      return CIRCUITSOLVER_ERROR_CURRENT_SOURCE_CUTSET;
+  }
+  return 0;
+}
+
+/**
+ * The solutions of every circuit solved through the API
+ */
+static SolutionCache& getSolutionCache() {
+  static SolutionCache cache(256);
+  return cache;
+}
+
+/**
+ * @return `message` with the id of every vertex and edge replaced by its value
+ * in `vertexIds` or `edgeIds`, including the ids the edges refer to their
+ * vertices by
+ */
+static proto::CircuitGraph renameIds(
+    const proto::CircuitGraph& message,
+    const std::unordered_map<std::string, std::string>& vertexIds,
+    const std::unordered_map<std::string, std::string>& edgeIds) {
+  proto::CircuitGraph renamed;
+  for (auto& entry : message.vertices()) {
+    const std::string& id = vertexIds.at(entry.first);
+    proto::Vertex& vertex = (*renamed.mutable_vertices())[id];
+    vertex = entry.second;
+    vertex.set_id(id);
+  }
+  for (auto& entry : message.edges()) {
+    const std::string& id = edgeIds.at(entry.first);
+    proto::Edge& edge = (*renamed.mutable_edges())[id];
+    edge = entry.second;
+    edge.set_id(id);
+    edge.set_from_id(vertexIds.at(edge.from_id()));
+    edge.set_to_id(vertexIds.at(edge.to_id()));
+  }
+  return renamed;
+}
+
+int solveCircuit(const proto::CircuitGraph& input, proto::CircuitGraph& output,
+                 const SolverConfig& config) {
   std::optional<std::unique_ptr<CircuitGraph>> optionalCircuitGraph =
       CircuitGraph::fromProto(input);
   if (!optionalCircuitGraph.has_value()) {
@@ -17,23 +233,84 @@ int solveCircuit(proto::CircuitGraph input, proto::CircuitGraph& output) {
   }
   std::unique_ptr<CircuitGraph> circuitGraph =
       std::move(optionalCircuitGraph.value());
-  bool solved = circuitGraph->solveCircuit();
+  if (int error = checkStructure(*circuitGraph); error != 0) {
+    return error;
+  }
+  SolutionCache& cache = getSolutionCache();
+  std::string key;
+  uint64_t hash = 0;
+  // Solutions are cached with the labels of the canonical form as their ids,
+  // so that circuits that only differ in their ids share them
+  std::unordered_map<std::string, std::string> vertexLabels, vertexIds;
+  std::unordered_map<std::string, std::string> edgeLabels, edgeIds;
+  if (cache.getCapacity() > 0) {
+    std::vector<uuids::uuid> vertexOrder, edgeOrder;
+    key = circuitGraph->getCanonicalForm(vertexOrder, edgeOrder) +
+          getCanonicalForm(config);
+    hash = CircuitGraph::hashCanonicalForm(key);
+    for (size_t i = 0; i < vertexOrder.size(); i++) {
+      std::string label = std::to_string(i);
+      vertexLabels[uuids::to_string(vertexOrder[i])] = label;
+      vertexIds[label] = uuids::to_string(vertexOrder[i]);
+    }
+    for (size_t i = 0; i < edgeOrder.size(); i++) {
+      std::string label = std::to_string(i);
+      edgeLabels[uuids::to_string(edgeOrder[i])] = label;
+      edgeIds[label] = uuids::to_string(edgeOrder[i]);
+    }
+    proto::CircuitGraph cached;
+    if (std::optional<std::string> solution = cache.find(hash, key);
+        solution.has_value() && cached.ParseFromString(*solution)) {
+      output = renameIds(cached, vertexIds, edgeIds);
+      return 0;
+    }
+  }
+  bool solved = circuitGraph->solveCircuit(config);
   if (!solved) {
     return CIRCUITSOLVER_ERROR_NO_SOLUTION;
   }
   output = circuitGraph->toProto();
+  if (cache.getCapacity() > 0) {
+    std::string solution =
+        renameIds(output, vertexLabels, edgeLabels).SerializeAsString();
+    cache.insert(hash, std::move(key), std::move(solution));
+  }
   return 0;
 }
 
+void setSolutionCacheCapacity(size_t capacity) {
+  getSolutionCache().setCapacity(capacity);
+}
+
+void clearSolutionCache(void) { getSolutionCache().clear(); }
+
+void getSolutionCacheStats(unsigned long long* hits,
+                           unsigned long long* misses) {
+  SolutionCache& cache = getSolutionCache();
+  if (hits != nullptr) *hits = cache.getHits();
+  if (misses != nullptr) *misses = cache.getMisses();
+}
+
 int solveGraphFromBuffer(void* inputBuffer, size_t inputLength,
                          void** outputBuffer, size_t* outputLength) {
+  return solveGraphFromBufferWithOptions(inputBuffer, inputLength,
+                                         outputBuffer, outputLength, nullptr);
+}
+
+int solveGraphFromBufferWithOptions(void* inputBuffer, size_t inputLength,
+                                    void** outputBuffer, size_t* outputLength,
+                                    const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
   proto::CircuitGraph message;
   bool success = message.ParseFromArray(inputBuffer, inputLength);
   if (!success) {
     return CIRCUITSOLVER_ERROR_INVALID_INPUT;
   }
   proto::CircuitGraph output;
-  int error = solveCircuit(message, output);
+  int error = solveCircuit(message, output, config);
   if (error) {
     return error;
   }
@@ -46,7 +323,260 @@ int solveGraphFromBuffer(void* inputBuffer, size_t inputLength,
   return 0;
 }
 
+/**
+ * Pools that earlier batches have finished with, so that their workers are
+ * started once rather than by every batch
+ */
+static std::mutex idlePoolsMutex;
+static std::vector<std::unique_ptr<ThreadPool>> idlePools;
+
+/**
+ * The most idle pools that are kept
+ */
+static const size_t kMaxIdlePools = 4;
+
+/**
+ * @return a pool of `numThreads` threads for one batch to use on its own, so
+ * that batches from different threads do not wait for each other
+ */
+static std::unique_ptr<ThreadPool> takeBatchPool(unsigned numThreads) {
+  {
+    std::lock_guard<std::mutex> lock(idlePoolsMutex);
+    auto it = std::find_if(idlePools.begin(), idlePools.end(),
+                           [&](const std::unique_ptr<ThreadPool>& pool) {
+                             return pool->size() == numThreads;
+                           });
+    if (it != idlePools.end()) {
+      std::unique_ptr<ThreadPool> pool = std::move(*it);
+      idlePools.erase(it);
+      return pool;
+    }
+  }
+  return std::make_unique<ThreadPool>(numThreads);
+}
+
+/**
+ * Keeps `pool` for a later batch, unless enough pools are kept already
+ */
+static void returnBatchPool(std::unique_ptr<ThreadPool> pool) {
+  std::lock_guard<std::mutex> lock(idlePoolsMutex);
+  if (idlePools.size() < kMaxIdlePools) {
+    idlePools.push_back(std::move(pool));
+  }
+}
+
+int solveGraphBatchFromBuffer(void* inputBuffer, size_t inputLength,
+                              void** outputBuffer, size_t* outputLength,
+                              const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  // Every message of the batch shares one arena, so parsing does one large
+  // allocation instead of one per field
+  google::protobuf::Arena arena;
+  std::vector<proto::CircuitGraph*> inputs;
+  std::vector<int> statuses;
+  google::protobuf::io::CodedInputStream input(
+      static_cast<const uint8_t*>(inputBuffer), static_cast<int>(inputLength));
+  while (!input.ExpectAtEnd()) {
+    uint32_t size;
+    if (!input.ReadVarint32(&size) ||
+        size > inputLength - static_cast<size_t>(input.CurrentPosition())) {
+      return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+    }
+    auto limit = input.PushLimit(static_cast<int>(size));
+    auto message = google::protobuf::Arena::Create<proto::CircuitGraph>(&arena);
+    bool parsed =
+        message->ParseFromCodedStream(&input) && input.ConsumedEntireMessage();
+    // Skip whatever is left of a message that failed to parse
+    if (input.BytesUntilLimit() > 0 && !input.Skip(input.BytesUntilLimit())) {
+      return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+    }
+    input.PopLimit(limit);
+    inputs.push_back(message);
+    statuses.push_back(parsed ? 0 : CIRCUITSOLVER_ERROR_INVALID_INPUT);
+  }
+
+  std::vector<std::string> results(inputs.size());
+  auto solveItem = [&](size_t i) {
+    proto::SolveResult result;
+    if (statuses[i] == 0) {
+      statuses[i] = solveCircuit(*inputs[i], *result.mutable_graph(), config);
+    }
+    result.set_status(statuses[i]);
+    if (statuses[i] != 0) {
+      result.clear_graph();
+    }
+    if (!result.SerializeToString(&results[i])) {
+      result.Clear();
+      result.set_status(CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION);
+      result.SerializeToString(&results[i]);
+    }
+  };
+  CircuitSolverOptions read;
+  readOptions(options, read);
+  unsigned numThreads = read.batchThreads;
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::unique_ptr<ThreadPool> pool = takeBatchPool(numThreads);
+  pool->parallelFor(inputs.size(), solveItem);
+  returnBatchPool(std::move(pool));
+
+  std::string output;
+  {
+    google::protobuf::io::StringOutputStream stream(&output);
+    google::protobuf::io::CodedOutputStream coded(&stream);
+    for (auto& result : results) {
+      coded.WriteVarint32(static_cast<uint32_t>(result.size()));
+      coded.WriteString(result);
+    }
+  }
+  *outputLength = output.size();
+  *outputBuffer = operator new(*outputLength);
+  memcpy(*outputBuffer, output.data(), output.size());
+  return 0;
+}
+
+int sweepGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                         const char* edgeId, const char* parameter,
+                         double start, double stop, size_t numPoints,
+                         void** outputBuffer, size_t* outputLength,
+                         const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  std::optional<uuids::uuid> id = uuids::uuid::from_string(edgeId);
+  proto::CircuitGraph message;
+  if (!id.has_value() || !message.ParseFromArray(inputBuffer, inputLength)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  std::optional<std::unique_ptr<CircuitGraph>> circuitGraph =
+      CircuitGraph::fromProto(message);
+  if (!circuitGraph.has_value()) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  SweepResult result;
+  if (!circuitGraph.value()->dcSweep(id.value(), parameter, start, stop,
+                                     numPoints, result, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  proto::DcSweep output = result.toProto();
+  *outputLength = output.ByteSizeLong();
+  *outputBuffer = operator new(*outputLength);
+  if (!output.SerializeToArray(*outputBuffer, *outputLength)) {
+    return CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION;
+  }
+  return 0;
+}
+
+int acSweepGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                           const char* edgeId, double startFrequency,
+                           double stopFrequency, size_t numPoints,
+                           void** outputBuffer, size_t* outputLength,
+                           const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  std::optional<uuids::uuid> id = uuids::uuid::from_string(edgeId);
+  proto::CircuitGraph message;
+  if (!id.has_value() || !message.ParseFromArray(inputBuffer, inputLength)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  std::optional<std::unique_ptr<CircuitGraph>> circuitGraph =
+      CircuitGraph::fromProto(message);
+  if (!circuitGraph.has_value()) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  AcSweepResult result;
+  if (!circuitGraph.value()->acSweep(id.value(), startFrequency,
+                                     stopFrequency, numPoints, result,
+                                     config)) {
+    return CIRCUITSOLVER_ERROR_NO_SOLUTION;
+  }
+  proto::AcSweep output = result.toProto();
+  *outputLength = output.ByteSizeLong();
+  *outputBuffer = operator new(*outputLength);
+  if (!output.SerializeToArray(*outputBuffer, *outputLength)) {
+    return CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION;
+  }
+  return 0;
+}
+
+int simulateGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                            double stopTime, double maxStep, int integration,
+                            CircuitSolverTransientCallback callback,
+                            void* userData,
+                            const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config) || callback == nullptr ||
+      !(stopTime > 0) || maxStep < 0) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  TransientConfig transientConfig;
+  transientConfig.stopTime = stopTime;
+  transientConfig.maxStep = maxStep;
+  switch (integration) {
+    case CIRCUITSOLVER_INTEGRATION_BACKWARD_EULER:
+      transientConfig.method = IntegrationMethod::BACKWARD_EULER;
+      break;
+    case CIRCUITSOLVER_INTEGRATION_TRAPEZOIDAL:
+      transientConfig.method = IntegrationMethod::TRAPEZOIDAL;
+      break;
+    default:
+      return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  proto::CircuitGraph message;
+  if (!message.ParseFromArray(inputBuffer, inputLength)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  std::optional<std::unique_ptr<CircuitGraph>> circuitGraph =
+      CircuitGraph::fromProto(message);
+  if (!circuitGraph.has_value()) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
+  if (int error = checkStructure(*circuitGraph.value()); error != 0) {
+    return error;
+  }
+  std::vector<Vertex> vertices = circuitGraph.value()->getVertices();
+  std::sort(vertices.begin(), vertices.end(),
+            [](const Vertex& a, const Vertex& b) {
+              return a.getId() < b.getId();
+            });
+  std::vector<Edge> edges = circuitGraph.value()->getEdges();
+  std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+    return a.getId() < b.getId();
+  });
+  std::vector<double> voltages(vertices.size());
+  std::vector<double> currents(edges.size());
+  auto onStep = [&](double time) {
+    for (size_t i = 0; i < vertices.size(); i++) {
+      voltages[i] = vertices[i].getVoltage().evaluate();
+    }
+    for (size_t i = 0; i < edges.size(); i++) {
+      currents[i] = edges[i].getCurrent().evaluate();
+    }
+    return callback(time, voltages.data(), currents.data(), userData) == 0;
+  };
+  if (!circuitGraph.value()->transient(transientConfig, onStep, config)) {
+    return CIRCUITSOLVER_ERROR_NO_SOLUTION;
+  }
+  return 0;
+}
+
 int solveGraphFromJson(char* inputJson, char** outputJson) {
+  return solveGraphFromJsonWithOptions(inputJson, outputJson, nullptr);
+}
+
+int solveGraphFromJsonWithOptions(char* inputJson, char** outputJson,
+                                  const CircuitSolverOptions* options) {
+  SolverConfig config;
+  if (!toSolverConfig(options, config)) {
+    return CIRCUITSOLVER_ERROR_INVALID_INPUT;
+  }
   proto::CircuitGraph message;
   auto status =
       google::protobuf::json::JsonStringToMessage(inputJson, &message);
@@ -54,7 +584,7 @@ int solveGraphFromJson(char* inputJson, char** outputJson) {
     return CIRCUITSOLVER_ERROR_INVALID_INPUT;
   }
   proto::CircuitGraph output;
-  int error = solveCircuit(message, output);
+  int error = solveCircuit(message, output, config);
   if (error) {
     return error;
   }
@@ -64,9 +594,9 @@ int solveGraphFromJson(char* inputJson, char** outputJson) {
     return CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION;
   }
   // std::string makes no guarantees about heap allocation so we need to copy to
-  // our own heap-allocated char buffer
-  *outputJson = new char[outputString.size()];
-  memcpy(*outputJson, outputString.c_str(), outputString.size());
+  // our own heap-allocated char buffer, including the terminating null
+  *outputJson = new char[outputString.size() + 1];
+  memcpy(*outputJson, outputString.c_str(), outputString.size() + 1);
   return 0;
 }
 
@@ -78,6 +608,13 @@ const char* getErrorMessage(int errorNumber) {
       {CIRCUITSOLVER_ERROR_INVALID_INPUT, "Invalid input"},
       {CIRCUITSOLVER_ERROR_NO_SOLUTION, "No solution"},
       {CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION, "Failed serialization"},
+      {CIRCUITSOLVER_ERROR_FLOATING_VERTEX,
+       "A vertex is not connected to any vertex with a known voltage"},
+      {CIRCUITSOLVER_ERROR_VOLTAGE_SOURCE_LOOP,
+       "Voltage sources and inductors form a loop"},
+      {CIRCUITSOLVER_ERROR_CURRENT_SOURCE_CUTSET,
+       "Current sources and capacitors are the only connection between some "
+       "vertices and the vertices with known voltages"},
   };
   auto it = errorMessages.find(errorNumber);
   if (it != errorMessages.end()) {
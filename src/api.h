@@ -1,11 +1,141 @@
 #include <cstddef>
 #define EXPORT extern "C"
 
+#define CIRCUITSOLVER_ENGINE_AUTO 0
+#define CIRCUITSOLVER_ENGINE_NEWTON 1
+#define CIRCUITSOLVER_ENGINE_CERES 2
+
+#define CIRCUITSOLVER_LINEAR_SOLVER_AUTO 0
+#define CIRCUITSOLVER_LINEAR_SOLVER_DENSE_QR 1
+#define CIRCUITSOLVER_LINEAR_SOLVER_SPARSE_NORMAL_CHOLESKY 2
+#define CIRCUITSOLVER_LINEAR_SOLVER_ITERATIVE_SCHUR 3
+#define CIRCUITSOLVER_LINEAR_SOLVER_CGNR 4
+
+#define CIRCUITSOLVER_HOMOTOPY_NONE 0
+#define CIRCUITSOLVER_HOMOTOPY_SOURCE_STEPPING 1
+#define CIRCUITSOLVER_HOMOTOPY_GMIN_STEPPING 2
+
+#define CIRCUITSOLVER_INTEGRATION_BACKWARD_EULER 0
+#define CIRCUITSOLVER_INTEGRATION_TRAPEZOIDAL 1
+
+// Options for the *WithOptions functions. Set `size` and fill in the
+// defaults with getDefaultSolverOptions before changing individual fields
+typedef struct CircuitSolverOptions {
+  // sizeof(CircuitSolverOptions) as the caller was built. Fields that a
+  // caller built against an older version of this struct lacks take their
+  // defaults, and fields it has that this version lacks are ignored
+  size_t size;
+  // One of CIRCUITSOLVER_ENGINE_*
+  int engine;
+  // One of CIRCUITSOLVER_LINEAR_SOLVER_*
+  int linearSolver;
+  // Threads used by ceres for each partition; 0 uses one per core
+  unsigned numThreads;
+  // Threads used to solve the ideal diode partitions; 0 uses one per core
+  unsigned partitionThreads;
+  double functionTolerance;
+  double gradientTolerance;
+  double parameterTolerance;
+  unsigned maxIterations;
+  unsigned maxNewtonIterations;
+  double newtonTolerance;
+  // Bounds on the random restarts of CIRCUITSOLVER_ENGINE_CERES; a time of
+  // 0 seconds means no time limit
+  unsigned maxSolveAttempts;
+  double maxSolveSeconds;
+  // Seed for the random restarts, so that results can be reproduced
+  unsigned long seed;
+  // Threads used to solve the circuits of a batch; 0 uses one per core
+  unsigned batchThreads;
+  // Non-zero merges series and parallel branches before solving with
+  // CIRCUITSOLVER_ENGINE_CERES
+  int reduceTopology;
+  // One of CIRCUITSOLVER_HOMOTOPY_*, tried by CIRCUITSOLVER_ENGINE_CERES
+  // before random restarts, and the number of circuits it steps through
+  int homotopy;
+  unsigned homotopySteps;
+  // Non-zero evaluates the residuals of CIRCUITSOLVER_ENGINE_CERES with code
+  // compiled for the circuit by the system compiler and cached in the user's
+  // cache directory, for circuits that are solved many times
+  int nativeCode;
+} CircuitSolverOptions;
+
+// Sets the fields of `options` within its `size` to their defaults
+EXPORT
+void getDefaultSolverOptions(CircuitSolverOptions* options);
+
 // Blocking call for now
 EXPORT
 int solveGraphFromBuffer(void* inputBuffer, size_t inputLength,
                          void** outputBuffer, size_t* outputLength);
 
+// As solveGraphFromBuffer. A null `options` uses the defaults
+EXPORT
+int solveGraphFromBufferWithOptions(void* inputBuffer, size_t inputLength,
+                                    void** outputBuffer, size_t* outputLength,
+                                    const CircuitSolverOptions* options);
+
+// Solves a batch of circuits. `inputBuffer` holds a sequence of
+// CircuitGraphMessages, each preceded by its size as a varint (the
+// length-delimited format of protobuf's SerializeDelimitedTo). The circuits
+// are solved concurrently and the output holds one length-delimited
+// SolveResultMessage per circuit, in the same order, with the status of that
+// circuit. Free the output with destroyGraphBuffer. The return value is only
+// an error if the batch itself cannot be read. Batches from different threads
+// are solved concurrently. A null `options` uses the defaults
+EXPORT
+int solveGraphBatchFromBuffer(void* inputBuffer, size_t inputLength,
+                              void** outputBuffer, size_t* outputLength,
+                              const CircuitSolverOptions* options);
+
+// Solves the circuit in `inputBuffer` at `numPoints` evenly spaced values of
+// the parameter `parameter` (e.g. "resistance") of the edge `edgeId`, from
+// `start` to `stop`. Each point starts from the solution of the previous one.
+// The output is a serialized DcSweepMessage, to be freed with
+// destroyGraphBuffer. A null `options` uses the defaults
+EXPORT
+int sweepGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                         const char* edgeId, const char* parameter,
+                         double start, double stop, size_t numPoints,
+                         void** outputBuffer, size_t* outputLength,
+                         const CircuitSolverOptions* options);
+
+// Solves the circuit in `inputBuffer` for its DC operating point, then for its
+// small-signal response to the voltage or current source `edgeId` at
+// `numPoints` logarithmically spaced frequencies from `startFrequency` to
+// `stopFrequency` Hertz. The frequencies are solved concurrently on
+// `partitionThreads` threads. The output is a serialized AcSweepMessage of
+// magnitudes and phases, to be freed with destroyGraphBuffer. A null `options`
+// uses the defaults
+EXPORT
+int acSweepGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                           const char* edgeId, double startFrequency,
+                           double stopFrequency, size_t numPoints,
+                           void** outputBuffer, size_t* outputLength,
+                           const CircuitSolverOptions* options);
+
+// Called by simulateGraphFromBuffer after each time step. Returning non-zero
+// ends the simulation
+typedef int (*CircuitSolverTransientCallback)(double time,
+                                              const double* voltages,
+                                              const double* currents,
+                                              void* userData);
+
+// Simulates the circuit in `inputBuffer` from time 0 to `stopTime` seconds,
+// starting with every capacitor uncharged and no current through any
+// inductor. `integration` is one of CIRCUITSOLVER_INTEGRATION_* and a
+// `maxStep` of 0 uses a fiftieth of `stopTime`. After each time step
+// `callback` is called with the voltage of every vertex and the current
+// through every edge, each in ascending order of their ids, and `userData`.
+// The arrays are only valid during the call; nothing is kept between steps.
+// A null `options` uses the defaults
+EXPORT
+int simulateGraphFromBuffer(void* inputBuffer, size_t inputLength,
+                            double stopTime, double maxStep, int integration,
+                            CircuitSolverTransientCallback callback,
+                            void* userData,
+                            const CircuitSolverOptions* options);
+
 EXPORT
 void destroyGraphBuffer(void* graphBuffer);
 
@@ -15,9 +145,36 @@ void destroyGraphJson(char* graphJson);
 EXPORT
 int solveGraphFromJson(char* inputJson, char** outputJson);
 
+// As solveGraphFromJson. A null `options` uses the defaults
+EXPORT
+int solveGraphFromJsonWithOptions(char* inputJson, char** outputJson,
+                                  const CircuitSolverOptions* options);
+
+// Solutions are kept in a cache shared by every call, keyed on the circuit
+// and the options that change its solution, so solving the same circuit again
+// returns the stored solution. `capacity` is the most circuits the cache
+// holds; 0 turns it off. It holds 256 circuits by default
+EXPORT
+void setSolutionCacheCapacity(size_t capacity);
+
+// Empties the solution cache and resets its counters
+EXPORT
+void clearSolutionCache(void);
+
+// The number of solves that were answered from the solution cache and the
+// number that were not, since the cache was last cleared
+EXPORT
+void getSolutionCacheStats(unsigned long long* hits,
+                           unsigned long long* misses);
+
 EXPORT
 const char* getErrorMessage(int errorNumber);
 
 #define CIRCUITSOLVER_ERROR_INVALID_INPUT 1
 #define CIRCUITSOLVER_ERROR_NO_SOLUTION 2
 #define CIRCUITSOLVER_ERROR_FAILED_SERIALIZATION 3
+// The circuit is rejected before solving because its structure rules out a
+// unique solution
+#define CIRCUITSOLVER_ERROR_FLOATING_VERTEX 4
+#define CIRCUITSOLVER_ERROR_VOLTAGE_SOURCE_LOOP 5
+#define CIRCUITSOLVER_ERROR_CURRENT_SOURCE_CUTSET 6
@@ -1,13 +1,27 @@
 #include "branch.h"
 
+#include <cmath>
+
 #include "proto.h"
 #include "src/vertex.h"
 #include "uuid.h"
 
+// Conductance in parallel with every exponential junction, as in SPICE
+static constexpr double junctionGmin = 1e-12;
+
 Branch::Branch(const Vertex& from, const Vertex& to) : from(from), to(to) {}
 Vertex Branch::getFrom() { return from; }
 Vertex Branch::getTo() { return to; }
 Expression Branch::getConstraint() const { return 0; }
+Expression Branch::getSourceCurrent() const { return 0; }
+bool Branch::setParameter(const std::string&, double) { return false; }
+std::vector<Expression> Branch::getParameters() const { return {}; }
+std::vector<Expression> Branch::getValues() const { return getParameters(); }
+bool Branch::setKnownParameter(Expression& parameter, double value) {
+  if (!parameter.isConstant() || parameter.isSolved()) return false;
+  parameter = value;
+  return true;
+}
 
 void Branch::toProto(proto::Edge* proto) const {
   std::string fromId = uuids::to_string(from.getId());
@@ -23,17 +37,86 @@ void Branch::toProto(proto::Edge* proto, const double* parameters) const {
   proto->set_to_id(toId);
   proto->set_current(this->getCurrent().evaluate(parameters));
 }
+bool Branch::stamp(MnaSystem& system) {
+  (void)system;
+  return false;
+}
+void Branch::loadSolution(const MnaSystem& system) { (void)system; }
+bool Branch::stampSmallSignal(AcSystem&, double) const { return false; }
+
+std::unique_ptr<Branch> Capacitor::copy() const {
+  return std::make_unique<Capacitor>(*this);
+}
+Capacitor::Capacitor(const Vertex& from, const Vertex& to,
+                     const Expression& capacitance)
+    : Branch(from, to), capacitance(capacitance) {}
+Expression Capacitor::getCurrent() const { return current; }
+Expression Capacitor::getConstraint() const { return current; }
+void Capacitor::toProto(proto::Edge* proto) const {
+  Branch::toProto(proto);
+  proto->mutable_capacitor()->set_capacitance(capacitance.evaluate());
+}
+void Capacitor::toProto(proto::Edge* proto, const double* parameters) const {
+  Branch::toProto(proto, parameters);
+  proto->mutable_capacitor()->set_capacitance(
+      capacitance.evaluate(parameters));
+}
+bool Capacitor::setParameter(const std::string& name, double value) {
+  if (name == "capacitance") return setKnownParameter(capacitance, value);
+  return false;
+}
+std::vector<Expression> Capacitor::getParameters() const {
+  return {capacitance};
+}
+std::vector<Expression> Capacitor::getValues() const {
+  return {capacitance, current};
+}
+bool Capacitor::stampSmallSignal(AcSystem& system, double) const {
+  if (!capacitance.isConstant()) return false;
+  system.stampAdmittance(from, to, 0, capacitance.evaluate());
+  return true;
+}
+bool Capacitor::stamp(MnaSystem& system) {
+  if (!capacitance.isConstant()) return false;
+  double step = system.getTimeStep();
+  if (step == 0) {
+    stepConductance = 0;
+    stepCurrent = 0;
+    return true;
+  }
+  // i = C dv/dt over the step
+  if (system.getIntegrationMethod() == IntegrationMethod::BACKWARD_EULER) {
+    stepConductance = capacitance.evaluate() / step;
+    stepCurrent = -stepConductance * lastVoltage;
+  } else {
+    stepConductance = 2 * capacitance.evaluate() / step;
+    stepCurrent = -stepConductance * lastVoltage - lastCurrent;
+  }
+  system.stampConductance(from, to, stepConductance);
+  system.stampCurrent(from, to, stepCurrent);
+  return true;
+}
+void Capacitor::loadSolution(const MnaSystem& system) {
+  lastVoltage = system.getVoltage(from) - system.getVoltage(to);
+  lastCurrent = stepConductance * lastVoltage + stepCurrent;
+  current.setSolution(lastCurrent);
+}
 
 std::unique_ptr<Branch> CurrentSource::copy() const {
   return std::make_unique<CurrentSource>(*this);
 }
 CurrentSource::CurrentSource(const Vertex& from, const Vertex& to,
-                             const Expression& current)
-    : Branch(from, to), current(current) {}
+                             const Expression& current,
+                             const Expression& voltage)
+    : Branch(from, to), voltage(voltage), current(current) {}
 Expression CurrentSource::getCurrent() const { return current; };
+Expression CurrentSource::getVoltage() const { return voltage; }
 Expression CurrentSource::getConstraint() const {
   return from.getVoltage() + voltage - to.getVoltage();
 }
+Expression CurrentSource::getSourceCurrent() const {
+  return current.getUnknowns().empty() ? current : 0;
+}
 void CurrentSource::toProto(proto::Edge* proto) const {
   Branch::toProto(proto);
   proto->mutable_current_source()->set_voltage(voltage.evaluate());
@@ -43,6 +126,31 @@ void CurrentSource::toProto(proto::Edge* proto,
   Branch::toProto(proto, parameters);
   proto->mutable_current_source()->set_voltage(voltage.evaluate(parameters));
 }
+bool CurrentSource::setParameter(const std::string& name, double value) {
+  if (name == "current") return setKnownParameter(current, value);
+  return false;
+}
+std::vector<Expression> CurrentSource::getParameters() const {
+  return {current};
+}
+std::vector<Expression> CurrentSource::getValues() const {
+  return {current, voltage};
+}
+bool CurrentSource::stampSmallSignal(AcSystem& system,
+                                     double amplitude) const {
+  system.stampCurrentSource(from, to, amplitude);
+  return true;
+}
+bool CurrentSource::stamp(MnaSystem& system) {
+  if (!current.isConstant()) return false;
+  system.stampCurrent(from, to, current.evaluate());
+  return true;
+}
+void CurrentSource::loadSolution(const MnaSystem& system) {
+  if (!voltage.isConstant()) {
+    voltage.setSolution(system.getVoltage(to) - system.getVoltage(from));
+  }
+}
 
 std::unique_ptr<Branch> IdealDiode::copy() const {
   return std::make_unique<IdealDiode>(*this);
@@ -68,6 +176,105 @@ void IdealDiode::toProto(proto::Edge* proto, const double* parameters) const {
   Branch::toProto(proto, parameters);
   proto->mutable_ideal_diode()->set_voltage(voltage.evaluate(parameters));
 }
+bool IdealDiode::setParameter(const std::string& name, double value) {
+  if (name == "voltage") return setKnownParameter(voltage, value);
+  return false;
+}
+std::vector<Expression> IdealDiode::getParameters() const {
+  return {voltage};
+}
+std::vector<Expression> IdealDiode::getValues() const {
+  return {voltage, current};
+}
+bool IdealDiode::stampSmallSignal(AcSystem& system, double) const {
+  // A conducting diode is a short and a blocking one is open, apart from a
+  // leakage conductance that keeps the vertices on either side connected
+  if (conditionalCurrent.evaluate() > 0) {
+    system.stampVoltageSource(from, to, 0);
+  } else {
+    system.stampAdmittance(from, to, junctionGmin);
+  }
+  return true;
+}
+bool IdealDiode::stamp(MnaSystem& system) {
+  // A known current would turn the diode into a current source
+  if (current.isConstant()) return false;
+  mnaIndex = system.stampIdealDiode(from, to);
+  return true;
+}
+void IdealDiode::loadSolution(const MnaSystem& system) {
+  current.setSolution(system.getDiodeCurrent(mnaIndex));
+  // The voltage is the reverse bias across the diode when it is not
+  // conducting. If it was given, it is only used by the enumeration path
+  if (!voltage.isConstant()) {
+    voltage.setSolution(system.getVoltage(to) - system.getVoltage(from));
+  }
+  // The state of the diode is now decided too
+  constraint.markSolved();
+  conditionalCurrent.markSolved();
+}
+
+std::unique_ptr<Branch> Inductor::copy() const {
+  return std::make_unique<Inductor>(*this);
+}
+Inductor::Inductor(const Vertex& from, const Vertex& to,
+                   const Expression& inductance)
+    : Branch(from, to), inductance(inductance) {}
+Expression Inductor::getCurrent() const { return current; }
+Expression Inductor::getConstraint() const {
+  return from.getVoltage() - to.getVoltage();
+}
+void Inductor::toProto(proto::Edge* proto) const {
+  Branch::toProto(proto);
+  proto->mutable_inductor()->set_inductance(inductance.evaluate());
+}
+void Inductor::toProto(proto::Edge* proto, const double* parameters) const {
+  Branch::toProto(proto, parameters);
+  proto->mutable_inductor()->set_inductance(inductance.evaluate(parameters));
+}
+bool Inductor::setParameter(const std::string& name, double value) {
+  if (name == "inductance") return setKnownParameter(inductance, value);
+  return false;
+}
+std::vector<Expression> Inductor::getParameters() const {
+  return {inductance};
+}
+std::vector<Expression> Inductor::getValues() const {
+  return {inductance, current};
+}
+bool Inductor::stampSmallSignal(AcSystem& system, double) const {
+  if (!inductance.isConstant()) return false;
+  system.stampVoltageSource(from, to, 0, inductance.evaluate());
+  return true;
+}
+bool Inductor::stamp(MnaSystem& system) {
+  if (!inductance.isConstant() || current.isConstant()) return false;
+  double step = system.getTimeStep();
+  if (step == 0) {
+    mnaIndex = system.stampVoltageSource(from, to, 0);
+    return true;
+  }
+  // v = L di/dt over the step
+  if (system.getIntegrationMethod() == IntegrationMethod::BACKWARD_EULER) {
+    stepConductance = step / inductance.evaluate();
+    stepCurrent = lastCurrent;
+  } else {
+    stepConductance = step / (2 * inductance.evaluate());
+    stepCurrent = lastCurrent + stepConductance * lastVoltage;
+  }
+  system.stampConductance(from, to, stepConductance);
+  system.stampCurrent(from, to, stepCurrent);
+  return true;
+}
+void Inductor::loadSolution(const MnaSystem& system) {
+  lastVoltage = system.getVoltage(from) - system.getVoltage(to);
+  if (system.getTimeStep() == 0) {
+    lastCurrent = system.getBranchCurrent(mnaIndex);
+  } else {
+    lastCurrent = stepConductance * lastVoltage + stepCurrent;
+  }
+  current.setSolution(lastCurrent);
+}
 
 // TODO: change
 
@@ -80,6 +287,50 @@ RealDiode::RealDiode(const Vertex& from, const Vertex& to, Expression i0,
 Expression RealDiode::getCurrent() const {
   return i0 * std::exp((from.getVoltage() - to.getVoltage()) / (n * vt));
 }
+Expression RealDiode::getSourceCurrent() const {
+  // The model has no -1 term, so the diode passes i0 with no bias
+  return i0.getUnknowns().empty() ? i0 : 0;
+}
+bool RealDiode::stamp(MnaSystem& system) {
+  if (!i0.isConstant() || !n.isConstant() || !vt.isConstant()) {
+    return false;
+  }
+  double saturationCurrent = i0.evaluate();
+  double thermalVoltage = n.evaluate() * vt.evaluate();
+  // The voltage at which the current grows fastest relative to the voltage
+  double criticalVoltage =
+      thermalVoltage *
+      std::log(thermalVoltage / (std::sqrt(2.0) * saturationCurrent));
+  double voltage = criticalVoltage;
+  bool limited = false;
+  if (system.hasEstimate()) {
+    voltage = system.getVoltage(from) - system.getVoltage(to);
+  }
+  // pnjlim: step logarithmically in the forward region rather than along
+  // the tangent, which would overshoot by many volts. An initial guess is
+  // taken as it is
+  if (system.getIteration() > 0 && voltage > criticalVoltage &&
+      std::abs(voltage - junctionVoltage) > 2 * thermalVoltage) {
+    if (junctionVoltage > 0) {
+      double arg = 1 + (voltage - junctionVoltage) / thermalVoltage;
+      voltage = arg > 0 ? junctionVoltage + thermalVoltage * std::log(arg)
+                        : criticalVoltage;
+    } else {
+      voltage = thermalVoltage * std::log(voltage / thermalVoltage);
+    }
+    limited = true;
+  }
+  junctionVoltage = voltage;
+
+  double current = saturationCurrent * std::exp(voltage / thermalVoltage);
+  double conductance = current / thermalVoltage;
+  // A small conductance in parallel with the junction keeps the system
+  // non-singular when the diode is strongly reverse biased
+  system.stampConductance(from, to, conductance + junctionGmin);
+  system.stampCurrent(from, to, current - conductance * voltage);
+  system.markNonlinear(limited);
+  return true;
+}
 void RealDiode::toProto(proto::Edge* proto) const {
   Branch::toProto(proto);
   auto protoRealDiode = proto->mutable_real_diode();
@@ -94,6 +345,27 @@ void RealDiode::toProto(proto::Edge* proto, const double* parameters) const {
   protoRealDiode->set_vt(vt.evaluate(parameters));
   protoRealDiode->set_n(n.evaluate(parameters));
 }
+bool RealDiode::setParameter(const std::string& name, double value) {
+  if (name == "i0") return setKnownParameter(i0, value);
+  if (name == "n") return setKnownParameter(n, value);
+  if (name == "vt") return setKnownParameter(vt, value);
+  return false;
+}
+std::vector<Expression> RealDiode::getParameters() const {
+  return {i0, vt, n};
+}
+bool RealDiode::stampSmallSignal(AcSystem& system, double) const {
+  if (!i0.isConstant() || !n.isConstant() || !vt.isConstant()) {
+    return false;
+  }
+  // The slope of the exponential at the operating point
+  double thermalVoltage = n.evaluate() * vt.evaluate();
+  double voltage = from.getVoltage().evaluate() - to.getVoltage().evaluate();
+  double conductance =
+      i0.evaluate() * std::exp(voltage / thermalVoltage) / thermalVoltage;
+  system.stampAdmittance(from, to, conductance + junctionGmin);
+  return true;
+}
 
 std::unique_ptr<Branch> Resistor::copy() const {
   return std::make_unique<Resistor>(*this);
@@ -114,6 +386,23 @@ void Resistor::toProto(proto::Edge* proto, const double* parameters) const {
   Branch::toProto(proto, parameters);
   proto->mutable_resistor()->set_resistance(resistance.evaluate(parameters));
 }
+bool Resistor::setParameter(const std::string& name, double value) {
+  if (name == "resistance") return setKnownParameter(resistance, value);
+  return false;
+}
+std::vector<Expression> Resistor::getParameters() const {
+  return {resistance};
+}
+bool Resistor::stampSmallSignal(AcSystem& system, double) const {
+  if (!resistance.isConstant()) return false;
+  system.stampAdmittance(from, to, 1 / resistance.evaluate());
+  return true;
+}
+bool Resistor::stamp(MnaSystem& system) {
+  if (!resistance.isConstant()) return false;
+  system.stampConductance(from, to, 1 / resistance.evaluate());
+  return true;
+}
 
 std::unique_ptr<Branch> VoltageSource::copy() const {
   return std::make_unique<VoltageSource>(*this);
@@ -135,6 +424,29 @@ void VoltageSource::toProto(proto::Edge* proto,
   Branch::toProto(proto, parameters);
   proto->mutable_voltage_source()->set_voltage(voltage.evaluate(parameters));
 }
+bool VoltageSource::setParameter(const std::string& name, double value) {
+  if (name == "voltage") return setKnownParameter(voltage, value);
+  return false;
+}
+std::vector<Expression> VoltageSource::getParameters() const {
+  return {voltage};
+}
+std::vector<Expression> VoltageSource::getValues() const {
+  return {voltage, current};
+}
+bool VoltageSource::stampSmallSignal(AcSystem& system,
+                                     double amplitude) const {
+  system.stampVoltageSource(from, to, amplitude);
+  return true;
+}
+bool VoltageSource::stamp(MnaSystem& system) {
+  if (!voltage.isConstant() || current.isConstant()) return false;
+  mnaIndex = system.stampVoltageSource(from, to, voltage.evaluate());
+  return true;
+}
+void VoltageSource::loadSolution(const MnaSystem& system) {
+  current.setSolution(system.getBranchCurrent(mnaIndex));
+}
 std::unique_ptr<Branch> ZenerDiode::copy() const {
   return std::make_unique<ZenerDiode>(*this);
 }
@@ -146,6 +458,13 @@ ZenerDiode::ZenerDiode(const Vertex& from, const Vertex& to,
 Expression ZenerDiode::getCurrent() const {
   return (from.getVoltage() - to.getVoltage() + vzt - rzt * izt) / rzt;
 }
+Expression ZenerDiode::getSourceCurrent() const {
+  if (!izt.getUnknowns().empty() || !rzt.getUnknowns().empty() ||
+      !vzt.getUnknowns().empty()) {
+    return 0;
+  }
+  return (vzt - rzt * izt) / rzt;
+}
 
 void ZenerDiode::toProto(proto::Edge* proto) const {
   Branch::toProto(proto);
@@ -161,3 +480,27 @@ void ZenerDiode::toProto(proto::Edge* proto, const double* parameters) const {
   protoZenerDiode->set_rzt(rzt.evaluate(parameters));
   protoZenerDiode->set_vzt(vzt.evaluate(parameters));
 }
+bool ZenerDiode::setParameter(const std::string& name, double value) {
+  if (name == "izt") return setKnownParameter(izt, value);
+  if (name == "rzt") return setKnownParameter(rzt, value);
+  if (name == "vzt") return setKnownParameter(vzt, value);
+  return false;
+}
+std::vector<Expression> ZenerDiode::getParameters() const {
+  return {vzt, rzt, izt};
+}
+bool ZenerDiode::stampSmallSignal(AcSystem& system, double) const {
+  if (!rzt.isConstant()) return false;
+  system.stampAdmittance(from, to, 1 / rzt.evaluate());
+  return true;
+}
+bool ZenerDiode::stamp(MnaSystem& system) {
+  if (!izt.isConstant() || !rzt.isConstant() || !vzt.isConstant()) {
+    return false;
+  }
+  // i = (v + vzt) / rzt - izt, a conductance in parallel with a source
+  double resistance = rzt.evaluate();
+  system.stampConductance(from, to, 1 / resistance);
+  system.stampCurrent(from, to, vzt.evaluate() / resistance - izt.evaluate());
+  return true;
+}
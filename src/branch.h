@@ -2,8 +2,12 @@
 #define BRANCH_H
 
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "acSystem.h"
 #include "expression.h"
+#include "mnaSystem.h"
 #include "proto.h"
 #include "vertex.h"
 // TODO: move the definitions to the source file not the header!!
@@ -16,26 +20,149 @@ class Branch {
   Vertex getTo();
   virtual Expression getCurrent() const = 0;
   virtual Expression getConstraint() const;
+
+  /**
+   * @return the current from `from` to `to` with both vertices at 0V, which
+   * is that of an independent current source folded into the branch, or 0
+   */
+  virtual Expression getSourceCurrent() const;
   virtual void toProto(proto::Edge* proto) const;
   virtual void toProto(proto::Edge* proto, const double* parameters) const;
 
+  /**
+   * Adds this branch to a Modified Nodal Analysis system
+   *
+   * @param system the system to add this branch to
+   * @return false if the branch cannot be represented in `system`, e.g.
+   * because it is non-linear or one of its parameters is unknown
+   */
+  virtual bool stamp(MnaSystem& system);
+
+  /**
+   * Stores the solution of `system` in the unknowns of this branch
+   *
+   * @param system a solved system that this branch was stamped into
+   */
+  virtual void loadSolution(const MnaSystem& system);
+
+  /**
+   * Adds the linearisation of this branch about the solution it holds to a
+   * small-signal system, with one call to a `stamp*` method of `system`
+   *
+   * @param system the system to add this branch to
+   * @param amplitude the small-signal value of the branch if it is an
+   * independent source: 1 for the input of the analysis and 0 for every other
+   * source, which holds its value
+   * @return false if the branch has no linearisation, e.g. because one of its
+   * parameters is unknown
+   */
+  virtual bool stampSmallSignal(AcSystem& system, double amplitude) const;
+
+  /**
+   * Changes a known parameter of the branch in place. Every copy of the
+   * branch shares its parameters, so graphs containing it see the change.
+   *
+   * @param name the name of the parameter, as in the protobuf message of the
+   * branch, e.g. "resistance"
+   * @param value the new value of the parameter
+   * @return false if the branch has no known parameter called `name`
+   */
+  virtual bool setParameter(const std::string& name, double value);
+
+  /**
+   * @return the parameters of the branch, in the order of the fields of its
+   * protobuf message
+   */
+  virtual std::vector<Expression> getParameters() const;
+
+  /**
+   * @return every value of the branch that can be given, whether it is or
+   * not: its parameters, then the current through it and the voltage across
+   * it if the branch holds them itself
+   */
+  virtual std::vector<Expression> getValues() const;
+
  protected:
+  /**
+   * Sets `parameter` to `value` if it is known
+   * @return false if `parameter` is an unknown, even one that has been solved
+   * for
+   */
+  static bool setKnownParameter(Expression& parameter, double value);
+
   const Vertex& from;
   const Vertex& to;
+
+  /**
+   * The index returned by the `MnaSystem` this branch was last stamped into
+   */
+  size_t mnaIndex = 0;
+};
+
+/**
+ * An open circuit at DC. Over a time step it is a conductance in parallel
+ * with a current source that carries the charge from the end of the last
+ * step, its companion model.
+ */
+class Capacitor : public Branch {
+ public:
+  std::unique_ptr<Branch> copy() const override;
+  Capacitor(const Vertex& from, const Vertex& to,
+            const Expression& capacitance = {});
+  Expression getCurrent() const override;
+  /**
+   * Holds the current at 0, as at DC
+   */
+  Expression getConstraint() const override;
+  void toProto(proto::Edge* proto) const override;
+  void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  std::vector<Expression> getValues() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
+  void loadSolution(const MnaSystem& system) override;
+
+  // The capacitance, in Farads
+  Expression capacitance;
+  Expression current;
+
+ private:
+  /**
+   * The voltage from `from` to `to` and the current through the capacitor in
+   * the last solution it loaded; uncharged until then
+   */
+  double lastVoltage = 0;
+  double lastCurrent = 0;
+
+  /**
+   * The companion model stamped for the current time step
+   */
+  double stepConductance = 0;
+  double stepCurrent = 0;
 };
 
 class CurrentSource : public Branch {
  public:
   std::unique_ptr<Branch> copy() const override;
   CurrentSource(const Vertex& from, const Vertex& to,
-                const Expression& current = {});
+                const Expression& current = {},
+                const Expression& voltage = {});
   Expression getCurrent() const override;
+  // The voltage gain from the from to to, in Volts
+  Expression getVoltage() const;
   Expression getConstraint() const override;
+  Expression getSourceCurrent() const override;
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  std::vector<Expression> getValues() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
+  void loadSolution(const MnaSystem& system) override;
 
  private:
-  // The voltage gain from the from to to, in Volts
   Expression voltage;
   Expression current;
 };
@@ -49,6 +176,12 @@ class IdealDiode : public Branch {
   Expression getConstraint() const override;
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  std::vector<Expression> getValues() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
+  void loadSolution(const MnaSystem& system) override;
 
  private:
   Expression voltage;
@@ -57,19 +190,78 @@ class IdealDiode : public Branch {
   Expression conditionalCurrent;
 };
 
+/**
+ * A short circuit at DC. Over a time step it is a conductance in parallel with
+ * a current source that carries the current from the end of the last step,
+ * its companion model.
+ */
+class Inductor : public Branch {
+ public:
+  std::unique_ptr<Branch> copy() const override;
+  Inductor(const Vertex& from, const Vertex& to,
+           const Expression& inductance = {});
+  Expression getCurrent() const override;
+  /**
+   * Holds the voltage across the inductor at 0, as at DC
+   */
+  Expression getConstraint() const override;
+  void toProto(proto::Edge* proto) const override;
+  void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  std::vector<Expression> getValues() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
+  void loadSolution(const MnaSystem& system) override;
+
+  // The inductance, in Henries
+  Expression inductance;
+  Expression current;
+
+ private:
+  /**
+   * The voltage from `from` to `to` and the current through the inductor in
+   * the last solution it loaded; no current flows until then
+   */
+  double lastVoltage = 0;
+  double lastCurrent = 0;
+
+  /**
+   * The companion model stamped for the current time step
+   */
+  double stepConductance = 0;
+  double stepCurrent = 0;
+};
+
 class RealDiode : public Branch {
  public:
   std::unique_ptr<Branch> copy() const override;
   RealDiode(const Vertex& from, const Vertex& to, Expression i0 = {},
             Expression n = {}, Expression vt = {});
   Expression getCurrent() const override;
+  Expression getSourceCurrent() const override;
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+
+  /**
+   * Stamps the companion model of the diode: its conductance and the
+   * remaining current at the previous iterate of `system`, with the junction
+   * voltage limited as in SPICE so that the exponential cannot overflow
+   */
+  bool stamp(MnaSystem& system) override;
 
  private:
   Expression i0;
   Expression vt;
   Expression n;
+
+  /**
+   * The junction voltage the diode was last linearised about
+   */
+  double junctionVoltage = 0;
 };
 
 class Resistor : public Branch {
@@ -83,6 +275,10 @@ class Resistor : public Branch {
 
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
 };
 
 class VoltageSource : public Branch {
@@ -97,6 +293,12 @@ class VoltageSource : public Branch {
   Expression getConstraint() const override;
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  std::vector<Expression> getValues() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
+  void loadSolution(const MnaSystem& system) override;
 };
 
 class ZenerDiode : public Branch {
@@ -106,9 +308,14 @@ class ZenerDiode : public Branch {
              const Expression& rzt = {}, const Expression& vzt = {});
 
   Expression getCurrent() const override;
+  Expression getSourceCurrent() const override;
 
   void toProto(proto::Edge* proto) const override;
   void toProto(proto::Edge* proto, const double* parameters) const override;
+  bool setParameter(const std::string& name, double value) override;
+  std::vector<Expression> getParameters() const override;
+  bool stampSmallSignal(AcSystem& system, double amplitude) const override;
+  bool stamp(MnaSystem& system) override;
 
  private:
   Expression izt, rzt, vzt;
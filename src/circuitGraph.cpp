@@ -2,67 +2,162 @@
 
 #include <google/protobuf/util/json_util.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <complex>
 #include <cstdio>
+#include <deque>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <random>
+#include <thread>
+#include <tuple>
 #include <unordered_set>
 #include <vector>
 
+#include "acSystem.h"
 #include "edge.h"
 #include "expression.h"
+#include "nativeCode.h"
 #include "proto.h"
 #include "uuid.h"
 #include "vertex.h"
 
 // TODO: reorganize this file
 
+/**
+ * The most residuals compiled into one residual block. Ceres stores the
+ * Jacobian of a block densely, so larger partitions are split into several
+ * blocks, each sharing the subexpressions of its own residuals
+ */
+static constexpr size_t maxBlockResiduals = 64;
+
+/**
+ * Collects the unknowns of all of `expressions`, without duplicates
+ */
+static std::vector<double*> collectUnknowns(
+    const std::vector<Expression>& expressions) {
+  std::unordered_set<double*> seen;
+  std::vector<double*> unknowns;
+  for (Expression expression : expressions) {
+    for (auto unknown : expression.getMutableUnknowns()) {
+      if (seen.insert(unknown).second) {
+        unknowns.push_back(unknown);
+      }
+    }
+  }
+  return unknowns;
+}
+
+namespace {
+/**
+ * Union-find over the integers [0, size)
+ */
+class DisjointSets {
+ public:
+  explicit DisjointSets(size_t size) : parents(size) {
+    for (size_t i = 0; i < size; i++) {
+      parents[i] = i;
+    }
+  }
+
+  size_t find(size_t i) {
+    while (parents[i] != i) {
+      parents[i] = parents[parents[i]];
+      i = parents[i];
+    }
+    return i;
+  }
+
+  /**
+   * @return false if `i` and `j` were already in the same set
+   */
+  bool unite(size_t i, size_t j) {
+    i = find(i);
+    j = find(j);
+    if (i == j) return false;
+    parents[i] = j;
+    return true;
+  }
+
+ private:
+  std::vector<size_t> parents;
+};
+}  // namespace
+
 // TODO: ensure that ternaryOpNodes will always add an expression that equates
 // the basis with a valid expression as its constraint method
 partitionSolution CircuitGraph::solvePartition(
-    const std::vector<double*>& basis, const std::vector<bool>& isHigh) {
-  // std::cout << "Starting state:";
-  // print(std::cout, *this, getUnknowns());
-  ceres::Problem problem;
-  std::vector<Expression> expressions = getExpressions();
+    const std::vector<Expression>& expressions,
+    const std::vector<double*>& basis, const std::vector<bool>& isHigh,
+    const SolverConfig& config) const {
+  // The problem works on its own copy of the unknowns so that the values in
+  // the expression trees are never written while partitions are being solved
+  std::vector<double*> unknowns = collectUnknowns(expressions);
+  std::vector<double> parameters(unknowns.size());
+  ParameterBlockMap blocks;
+  for (size_t i = 0; i < unknowns.size(); i++) {
+    parameters[i] = *unknowns[i];
+    blocks[unknowns[i]] = &parameters[i];
+  }
+
+  std::vector<Expression> residuals;
   for (auto expression : expressions) {
-    expression.addToProblem(problem);
+    expression.getResiduals(residuals);
+  }
+  // Each block of residuals is compiled into one tape, so that the
+  // subexpressions they share are evaluated once. They are simplified against
+  // the known values of this solve, with one simplifier so that shared
+  // subexpressions stay shared
+  std::vector<ExpressionTape> tapes;
+  std::vector<ExpressionCostFunction::Derivatives> derivatives;
+  std::vector<size_t> numResiduals;
+  size_t jacobianNonZeros = 0;
+  ExpressionSimplifier simplifier;
+  for (size_t begin = 0; begin < residuals.size();
+       begin += maxBlockResiduals) {
+    size_t end = std::min(begin + maxBlockResiduals, residuals.size());
+    derivatives.emplace_back();
+    tapes.push_back(Expression::compileWithDerivatives(
+        std::vector<Expression>(residuals.begin() + begin,
+                                residuals.begin() + end),
+        derivatives.back(), &simplifier));
+    numResiduals.push_back(end - begin);
+    jacobianNonZeros += (end - begin) * tapes.back().getUnknowns().size();
+  }
+  std::shared_ptr<const NativeCode> code;
+  if (config.nativeCode) {
+    // Null if there is no compiler, in which case the tapes are interpreted
+    code = NativeCode::load(tapes, config.nativeCompiler,
+                            config.nativeCodeDirectory);
+  }
+  ceres::Problem problem;
+  for (size_t i = 0; i < tapes.size(); i++) {
+    Expression::addResiduals(problem, std::move(tapes[i]), numResiduals[i],
+                             std::move(derivatives[i]), blocks, code, i);
   }
   assert(basis.size() == isHigh.size());
   for (size_t i = 0; i < basis.size(); i++) {
+    double* block = blocks.at(basis[i]);
     if (isHigh[i]) {
-      // std::cout << "Setting lower limit on " << basis[i] << " to 0"
-      //           << std::endl;
-      problem.SetParameterLowerBound(basis[i], 0, 0);
+      problem.SetParameterLowerBound(block, 0, 0);
     } else {
-      // std::cout << "Setting upper limit on " << basis[i] << " to 0"
-      //           << std::endl;
-      problem.SetParameterUpperBound(basis[i], 0, 0);
+      problem.SetParameterUpperBound(block, 0, 0);
     }
   }
-  // std::cout << std::endl;
-  ceres::Solver::Options options = getDefaultOptions();
+  ceres::Solver::Options options =
+      getCeresOptions(config, unknowns.size(),
+                      static_cast<size_t>(problem.NumResiduals()),
+                      jacobianNonZeros);
   ceres::Solver::Summary summary;
   ceres::Solve(options, &problem, &summary);
-  std::vector<std::vector<double>> allParameters;
-  std::unordered_set<const double*> allUnknowns;
-  for (auto& expression : expressions) {
-    auto unknowns = expression.getMutableUnknowns();
-    std::vector<double> parameters;
-    for (auto unknown : unknowns) {
-      parameters.push_back(*unknown);
-    }
-    allParameters.push_back(parameters);
-    auto constUnknowns = expression.getUnknowns();
-    allUnknowns.merge(constUnknowns);
-  }
-  // std::cout << "Cost: " << summary.final_cost << summary.message <<
-  // std::endl; print(std::cout, *this, allUnknowns);
-  partitionSolution solution{summary, expressions, allParameters};
-  return solution;
+  return partitionSolution{summary, unknowns, parameters};
 }
 
 /**
@@ -75,83 +170,1065 @@ partitionSolution CircuitGraph::solvePartition(
  */
 
 // TODO: fix case of no discontinuities
-bool CircuitGraph::solveCircuit() {
-  std::vector<double*> basis = getDiscontinuities();
-  size_t basisSize = basis.size();
-  int numPartitions;
-  if (basisSize > 0) {
-    numPartitions = 1 << basisSize;
+bool CircuitGraph::solveCircuit(const SolverConfig& config) {
+  solveAttempts = 0;
+  if (checkStructure() != StructuralError::NONE) {
+    return false;
+  }
+  // Try the direct solve first so that large linear circuits never build
+  // their expression trees
+  if (config.engine == SolverEngine::NEWTON) {
+    return solveModifiedNodal(config);
+  }
+  if (config.engine == SolverEngine::AUTO && solveModifiedNodal(config)) {
+    return true;
+  }
+  std::vector<std::pair<const Vertex*, const Edge*>> pinned;
+  std::vector<std::pair<const Vertex*, const Edge*>> bridged;
+  if (!pinVoltageSources(pinned, bridged)) {
+    return false;
+  }
+  std::optional<ReducedGraph> reduced;
+  if (config.reduceTopology) {
+    reduced = reduce();
+  }
+  bool solved;
+  if (reduced.has_value()) {
+    // Lend the workers to the reduced graph rather than starting new ones
+    reduced->graph->partitionPool = std::move(partitionPool);
+    solved = reduced->graph->solveWithCeres(config);
+    solveAttempts = reduced->graph->solveAttempts;
+    partitionPool = std::move(reduced->graph->partitionPool);
+    if (solved) {
+      reduced->expand();
+    }
   } else {
-    numPartitions = 1;
+    solved = solveWithCeres(config);
   }
-  std::vector<partitionSolution> solutions(numPartitions);
-  std::vector<std::vector<bool>> isHigh;
-  for (int i = 0; i < numPartitions; i++) {
-    isHigh.push_back(std::vector<bool>(basisSize));
-    for (int j = 0; j < basisSize; j++) {
-      isHigh[i][j] = (i >> j) & 1;
+  if (solved) {
+    loadPinnedCurrents(pinned);
+    // Known vertices can have pinned sources of their own
+    loadPinnedCurrents(bridged);
+  } else {
+    for (auto& entry : pinned) {
+      entry.first->getVoltage().markUnsolved();
     }
-    solutions[i] = solvePartition(basis, isHigh[i]);
-    resetUnknowns();
   }
-  double minError = std::numeric_limits<double>::max();
-  int bestIndex = -1;
-  for (size_t i = 0; i < solutions.size(); i++) {
-    if (!solutions[i].summary.IsSolutionUsable()) {
+  return solved;
+}
+
+bool CircuitGraph::pinVoltageSources(
+    std::vector<std::pair<const Vertex*, const Edge*>>& pinned,
+    std::vector<std::pair<const Vertex*, const Edge*>>& bridged) {
+  std::deque<uuids::uuid> queue;
+  std::unordered_set<uuids::uuid> fixed;
+  for (auto& entry : vertices) {
+    if (entry.second->getVoltage().isConstant()) {
+      queue.push_back(entry.first);
+      fixed.insert(entry.first);
+    }
+  }
+  std::unordered_set<uuids::uuid> known = fixed;
+  while (!queue.empty()) {
+    uuids::uuid id = queue.front();
+    queue.pop_front();
+    for (auto& edgeId : adjacencyList.at(id)) {
+      const Edge& edge = *edges.at(edgeId);
+      auto source = dynamic_cast<const VoltageSource*>(&edge.getBranch());
+      if (source == nullptr || !source->voltage.isConstant() ||
+          source->current.isConstant()) {
+        continue;
+      }
+      uuids::uuid from = edge.getFrom().getId();
+      uuids::uuid to = edge.getTo().getId();
+      uuids::uuid other = from == id ? to : from;
+      double voltage = source->voltage.evaluate();
+      if (fixed.count(other) != 0) {
+        // A source between two fixed vertices must agree with both of them
+        double fromVoltage = edge.getFrom().getVoltage().evaluate();
+        double toVoltage = edge.getTo().getVoltage().evaluate();
+        if (std::abs(fromVoltage + voltage - toVoltage) >
+            1e-9 * (1 + std::abs(fromVoltage) + std::abs(toVoltage))) {
+          for (auto& entry : pinned) {
+            entry.first->getVoltage().markUnsolved();
+          }
+          pinned.clear();
+          return false;
+        }
+        continue;
+      }
+      // The source holds its to vertex `voltage` above its from vertex
+      double known = vertices.at(id)->getVoltage().evaluate();
+      const Vertex* vertex = vertices.at(other).get();
+      vertex->getVoltage().setSolution(from == id ? known + voltage
+                                                  : known - voltage);
+      fixed.insert(other);
+      queue.push_back(other);
+      pinned.emplace_back(vertex, &edge);
+    }
+  }
+
+  // The sources directly between known vertices, which agree with them by
+  // now, form trees. Each is ordered outwards from its first vertex, so that
+  // its current can be found at the vertex further out like a pinned source
+  std::unordered_set<uuids::uuid> reached;
+  for (auto& root : known) {
+    if (!reached.insert(root).second) continue;
+    queue.push_back(root);
+    while (!queue.empty()) {
+      uuids::uuid id = queue.front();
+      queue.pop_front();
+      for (auto& edgeId : adjacencyList.at(id)) {
+        const Edge& edge = *edges.at(edgeId);
+        auto source = dynamic_cast<const VoltageSource*>(&edge.getBranch());
+        if (source == nullptr || !source->voltage.isConstant() ||
+            source->current.isConstant()) {
+          continue;
+        }
+        uuids::uuid from = edge.getFrom().getId();
+        uuids::uuid other = from == id ? edge.getTo().getId() : from;
+        if (known.count(other) == 0 || !reached.insert(other).second) {
+          continue;
+        }
+        queue.push_back(other);
+        bridged.emplace_back(vertices.at(other).get(), &edge);
+      }
+    }
+  }
+  return true;
+}
+
+void CircuitGraph::loadPinnedCurrents(
+    const std::vector<std::pair<const Vertex*, const Edge*>>& pinned) {
+  // Sources further from the known vertices come later, so their currents
+  // are known by the time the vertices nearer to the known ones need them
+  for (auto it = pinned.rbegin(); it != pinned.rend(); it++) {
+    uuids::uuid id = it->first->getId();
+    const Edge& source = *it->second;
+    double netCurrent = 0;
+    for (auto& edgeId : adjacencyList.at(id)) {
+      const Edge& edge = *edges.at(edgeId);
+      uuids::uuid from = edge.getFrom().getId();
+      uuids::uuid to = edge.getTo().getId();
+      if (edgeId == source.getId() || from == to) continue;
+      if (to == id) {
+        netCurrent += edge.getCurrent().evaluate();
+      } else {
+        netCurrent -= edge.getCurrent().evaluate();
+      }
+    }
+    // The current through the source balances the rest at its vertex
+    source.getCurrent().setSolution(source.getTo().getId() == id
+                                        ? -netCurrent
+                                        : netCurrent);
+  }
+}
+
+bool CircuitGraph::solveWithCeres(const SolverConfig& config) {
+  // Each subcircuit is solved and restarted on its own, so that one that
+  // needs many attempts does not restart the rest of the circuit
+  std::vector<Subcircuit> subcircuits = getSubcircuits();
+  std::vector<std::optional<partitionSolution>> accepted(subcircuits.size());
+  std::vector<bool> solved(subcircuits.size(), false);
+  std::mt19937_64 rng(config.seed);
+  auto start = std::chrono::steady_clock::now();
+  for (solveAttempts = 1;; solveAttempts++) {
+    std::vector<std::optional<partitionSolution>> solutions =
+        solvePartitions(subcircuits, solved, config);
+    bool allSolved = true;
+    for (size_t i = 0; i < subcircuits.size(); i++) {
+      if (solved[i]) continue;
+      if (!solutions[i].has_value()) {
+        // None of the solutions were usable
+        return false;
+      }
+      if (solutions[i]->summary.message.find("Gradient tolerance") !=
+              std::string::npos ||
+          solutions[i]->summary.final_cost <= 1e-15) {
+        accepted[i] = std::move(solutions[i]);
+        solved[i] = true;
+      } else {
+        allSolved = false;
+      }
+    }
+    if (allSolved) break;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (solveAttempts >= config.maxSolveAttempts ||
+        (config.maxSolveSeconds > 0 &&
+         elapsed.count() >= config.maxSolveSeconds)) {
+      // Exceeded the restart budget
+      return false;
+    }
+    if (solveAttempts == 1 && config.homotopy != Homotopy::NONE) {
+      // Work up to the circuit from an easier one before resorting to random
+      // starting points; the next attempt starts from where this ends
+      continueFromEasierCircuits(subcircuits, solved, config);
       continue;
     }
-    if (solutions[i].summary.final_cost < minError) {
-      minError = solutions[i].summary.final_cost;
-      bestIndex = i;
+    for (size_t i = 0; i < subcircuits.size(); i++) {
+      if (!solved[i]) {
+        resetUnknowns(subcircuits[i], rng);
+      }
     }
   }
-  if (bestIndex == -1) {
-    // None of the solutions were usable
-    return false;
+  // Only store the solution once every subcircuit is solved so that a failed
+  // solve does not leave part of the circuit marked as solved
+  for (size_t i = 0; i < subcircuits.size(); i++) {
+    assert(accepted[i]->unknowns.size() == accepted[i]->parameters.size());
+    for (size_t j = 0; j < accepted[i]->unknowns.size(); j++) {
+      *accepted[i]->unknowns[j] = accepted[i]->parameters[j];
+    }
+    for (auto& expression : subcircuits[i].expressions) {
+      expression.markSolved();
+    }
+  }
+  return true;
+}
+
+void CircuitGraph::continueFromEasierCircuits(
+    const std::vector<Subcircuit>& subcircuits, const std::vector<bool>& skip,
+    const SolverConfig& config) {
+  // The given vertex voltages, with their values
+  std::vector<std::pair<double*, double>> sources;
+  std::vector<Subcircuit> steps = subcircuits;
+  // The conductance from every unknown vertex to 0V
+  Expression shunt = 1e-2;
+  // The fraction of each branch source that is turned off
+  Expression off = 1.0;
+  if (config.homotopy == Homotopy::SOURCE_STEPPING) {
+    for (auto& entry : vertices) {
+      Expression voltage = entry.second->getVoltage();
+      if (voltage.isConstant()) {
+        sources.emplace_back(voltage.getPtrToUnknown(), voltage.evaluate());
+      }
+    }
+    // The sources of the branches are taken off their residuals rather than
+    // scaled in place, so that sources computed from other values, currents
+    // folded into diodes and values shared with other branches all work
+    for (auto& step : steps) {
+      std::unordered_map<const double*, size_t> rows;
+      for (size_t i = 0; i < step.voltages.size(); i++) {
+        rows[step.voltages[i].getPtrToUnknown()] = i;
+      }
+      for (size_t i = 0; i < step.edges.size(); i++) {
+        const Edge& edge = *step.edges[i];
+        const Branch& branch = edge.getBranch();
+        Expression current = branch.getSourceCurrent();
+        auto from = rows.find(edge.getFrom().getVoltage().getPtrToUnknown());
+        auto to = rows.find(edge.getTo().getVoltage().getPtrToUnknown());
+        if (current != 0 && from != rows.end()) {
+          step.expressions[from->second] +=
+              Expression::makeProduct(off, current);
+        }
+        if (current != 0 && to != rows.end()) {
+          step.expressions[to->second] -=
+              Expression::makeProduct(off, current);
+        }
+        auto source = dynamic_cast<const VoltageSource*>(&branch);
+        if (source != nullptr && source->voltage.getUnknowns().empty()) {
+          step.expressions[step.voltages.size() + i] -=
+              Expression::makeProduct(off, source->voltage);
+        }
+      }
+    }
+    // Every source off leaves a circuit that 0V and 0A solve, apart from the
+    // voltage an ideal diode takes while it blocks, so the chain starts there
+    for (size_t i = 0; i < subcircuits.size(); i++) {
+      if (skip[i]) continue;
+      for (auto unknown : collectUnknowns(subcircuits[i].expressions)) {
+        *unknown = 0;
+      }
+    }
+  } else {
+    for (auto& step : steps) {
+      for (size_t i = 0; i < step.voltages.size(); i++) {
+        step.expressions[i] = step.expressions[i] - shunt * step.voltages[i];
+      }
+    }
   }
-  partitionSolution solution = solutions[bestIndex];
-  if (solution.summary.message.find("Gradient tolerance") ==
-          std::string::npos &&
-      solution.summary.final_cost > 1e-15) {
-    if (solveAttempts < maxSolveAttempts) {
-      solveAttempts++;
-      resetUnknowns();
-      return solveCircuit();
+
+  for (unsigned k = 1; k < config.homotopySteps; k++) {
+    if (config.homotopy == Homotopy::SOURCE_STEPPING) {
+      double scale = static_cast<double>(k) / config.homotopySteps;
+      for (auto& source : sources) {
+        *source.first = source.second * scale;
+      }
+      off = 1 - scale;
     } else {
-      // Exceeded max solve attempts
-      return false;
+      shunt = 1e-2 * std::pow(10.0, 1.0 - k);
+    }
+    std::vector<std::optional<partitionSolution>> solutions =
+        solvePartitions(steps, skip, config);
+    // Each step starts from the solution of the one before it
+    for (auto& solution : solutions) {
+      if (!solution.has_value()) continue;
+      for (size_t j = 0; j < solution->unknowns.size(); j++) {
+        *solution->unknowns[j] = solution->parameters[j];
+      }
+    }
+  }
+  for (auto& source : sources) {
+    *source.first = source.second;
+  }
+}
+
+void ReducedGraph::expand() const {
+  for (auto it = eliminated.rbegin(); it != eliminated.rend(); it++) {
+    Expression unknown = it->first;
+    unknown.setSolution(it->second.evaluate());
+  }
+}
+
+namespace {
+/**
+ * The kinds of branch `CircuitGraph::reduce` can merge
+ */
+enum class ReducibleBranch { NONE, RESISTOR, VOLTAGE_SOURCE, CURRENT_SOURCE };
+
+/**
+ * A branch of the graph being reduced, either an edge of the original graph or
+ * one that replaces several of them
+ */
+struct ReducingEdge {
+  uuids::uuid id;
+  uuids::uuid from;
+  uuids::uuid to;
+  ReducibleBranch kind;
+  /**
+   * The resistance, voltage or current of the branch
+   */
+  double value;
+  /**
+   * The current through a voltage source or the voltage across a current
+   * source
+   */
+  Expression unknown;
+  /**
+   * The edge of the original graph, or null if the branch replaces several
+   */
+  const Edge* original;
+  bool removed = false;
+
+  const uuids::uuid& opposite(const uuids::uuid& vertex) const {
+    return from == vertex ? to : from;
+  }
+};
+
+ReducingEdge classify(const Edge& edge) {
+  ReducingEdge result{edge.getId(),
+                      edge.getFrom().getId(),
+                      edge.getTo().getId(),
+                      ReducibleBranch::NONE,
+                      0,
+                      Expression(0),
+                      &edge};
+  const Branch& branch = edge.getBranch();
+  if (auto resistor = dynamic_cast<const Resistor*>(&branch)) {
+    if (resistor->resistance.isConstant() &&
+        resistor->resistance.evaluate() != 0) {
+      result.kind = ReducibleBranch::RESISTOR;
+      result.value = resistor->resistance.evaluate();
+    }
+  } else if (auto source = dynamic_cast<const VoltageSource*>(&branch)) {
+    if (source->voltage.isConstant() && !source->current.isConstant()) {
+      result.kind = ReducibleBranch::VOLTAGE_SOURCE;
+      result.value = source->voltage.evaluate();
+      result.unknown = source->current;
+    }
+  } else if (auto source = dynamic_cast<const CurrentSource*>(&branch)) {
+    if (source->getCurrent().isConstant() &&
+        !source->getVoltage().isConstant()) {
+      result.kind = ReducibleBranch::CURRENT_SOURCE;
+      result.value = source->getCurrent().evaluate();
+      result.unknown = source->getVoltage();
+    }
+  }
+  return result;
+}
+}  // namespace
+
+std::optional<ReducedGraph> CircuitGraph::reduce() const {
+  std::vector<ReducingEdge> reducing;
+  reducing.reserve(edges.size());
+  std::unordered_map<uuids::uuid, std::vector<size_t>> incident;
+  for (auto& entry : vertices) {
+    incident[entry.first];
+  }
+  auto add = [&](ReducingEdge edge) {
+    incident[edge.from].push_back(reducing.size());
+    incident[edge.to].push_back(reducing.size());
+    reducing.push_back(std::move(edge));
+  };
+  for (auto& entry : edges) {
+    add(classify(*entry.second));
+  }
+  // A merged branch takes the id of one of the edges it replaces, which is no
+  // longer part of the reduced graph
+  auto merged = [](const ReducingEdge& edge, uuids::uuid from, uuids::uuid to,
+                   double value) {
+    return ReducingEdge{edge.id, from, to, edge.kind, value, Expression(),
+                        nullptr};
+  };
+  auto voltageOf = [&](const uuids::uuid& id) {
+    return vertices.at(id)->getVoltage();
+  };
+
+  ReducedGraph reduced;
+  std::unordered_set<uuids::uuid> eliminatedVertices;
+  bool reducedAny = false;
+  // Each pass merges every parallel group and eliminates every vertex between
+  // two mergeable branches; merging can expose more of both
+  for (bool changed = true; changed; reducedAny |= changed) {
+    changed = false;
+
+    // Parallel resistors and current sources
+    std::map<std::pair<uuids::uuid, uuids::uuid>, size_t> parallel[2];
+    for (size_t i = 0; i < reducing.size(); i++) {
+      ReducingEdge& edge = reducing[i];
+      if (edge.removed || edge.from == edge.to ||
+          (edge.kind != ReducibleBranch::RESISTOR &&
+           edge.kind != ReducibleBranch::CURRENT_SOURCE)) {
+        continue;
+      }
+      auto key = std::minmax(edge.from, edge.to);
+      auto& groups = parallel[edge.kind == ReducibleBranch::RESISTOR];
+      auto [it, inserted] = groups.emplace(key, i);
+      // Merged branches are visited too, after they replace their group
+      if (inserted || it->second == i) continue;
+      ReducingEdge& other = reducing[it->second];
+      ReducingEdge combined;
+      if (edge.kind == ReducibleBranch::RESISTOR) {
+        double value = other.value * edge.value / (other.value + edge.value);
+        combined = merged(other, other.from, other.to, value);
+      } else {
+        double sign = edge.from == other.from ? 1 : -1;
+        double value = other.value + sign * edge.value;
+        combined = merged(other, other.from, other.to, value);
+        // A current source has the voltage of the vertices it is between
+        for (ReducingEdge* source : {&other, &edge}) {
+          reduced.eliminated.emplace_back(
+              source->unknown, voltageOf(source->to) - voltageOf(source->from));
+        }
+      }
+      other.removed = true;
+      edge.removed = true;
+      it->second = reducing.size();
+      add(std::move(combined));
+      changed = true;
+    }
+
+    // Vertices in series
+    for (auto& entry : vertices) {
+      const uuids::uuid& middle = entry.first;
+      if (entry.second->getVoltage().isConstant()) continue;
+      std::vector<size_t>& branches = incident[middle];
+      auto isRemoved = [&](size_t i) { return reducing[i].removed; };
+      branches.erase(
+          std::remove_if(branches.begin(), branches.end(), isRemoved),
+          branches.end());
+      if (branches.size() != 2) continue;
+      // Copies, since `add` may move the branches
+      const ReducingEdge first = reducing[branches[0]];
+      const ReducingEdge second = reducing[branches[1]];
+      const uuids::uuid start = first.opposite(middle);
+      const uuids::uuid end = second.opposite(middle);
+      if (start == middle || end == middle || start == end) continue;
+      Expression startVoltage = voltageOf(start);
+      Expression endVoltage = voltageOf(end);
+      Expression middleVoltage = voltageOf(middle);
+
+      if (first.kind == ReducibleBranch::RESISTOR &&
+          second.kind == ReducibleBranch::RESISTOR) {
+        double total = first.value + second.value;
+        reduced.eliminated.emplace_back(
+            middleVoltage, startVoltage + (endVoltage - startVoltage) *
+                                              (first.value / total));
+        add(merged(first, start, end, total));
+      } else if (first.kind == ReducibleBranch::VOLTAGE_SOURCE &&
+                 second.kind == ReducibleBranch::VOLTAGE_SOURCE) {
+        // The voltage gained from start to middle and from middle to end
+        double firstGain = first.from == start ? first.value : -first.value;
+        double secondGain =
+            second.from == middle ? second.value : -second.value;
+        ReducingEdge combined =
+            merged(first, start, end, firstGain + secondGain);
+        // The same current flows from start to end through both sources
+        reduced.eliminated.emplace_back(
+            first.unknown,
+            first.from == start ? combined.unknown : -combined.unknown);
+        reduced.eliminated.emplace_back(
+            second.unknown,
+            second.from == middle ? combined.unknown : -combined.unknown);
+        reduced.eliminated.emplace_back(middleVoltage,
+                                        startVoltage + firstGain);
+        add(std::move(combined));
+      } else if ((first.kind == ReducibleBranch::VOLTAGE_SOURCE &&
+                  second.kind == ReducibleBranch::RESISTOR) ||
+                 (first.kind == ReducibleBranch::RESISTOR &&
+                  second.kind == ReducibleBranch::VOLTAGE_SOURCE)) {
+        // Source transformation: a voltage source in series with a resistor
+        // is a current source in parallel with the resistor
+        bool sourceFirst = first.kind == ReducibleBranch::VOLTAGE_SOURCE;
+        const ReducingEdge& source = sourceFirst ? first : second;
+        const ReducingEdge& resistor = sourceFirst ? second : first;
+        const uuids::uuid& sourceEnd = sourceFirst ? start : end;
+        const uuids::uuid& resistorEnd = sourceFirst ? end : start;
+        Expression sourceEndVoltage = voltageOf(sourceEnd);
+        Expression resistorEndVoltage = voltageOf(resistorEnd);
+        double gain = source.from == sourceEnd ? source.value : -source.value;
+        // The current from the source through the resistor
+        Expression current =
+            (middleVoltage - resistorEndVoltage) / resistor.value;
+        reduced.eliminated.emplace_back(
+            source.unknown, source.from == sourceEnd ? current : -current);
+        reduced.eliminated.emplace_back(middleVoltage,
+                                        sourceEndVoltage + gain);
+        add(merged(resistor, sourceEnd, resistorEnd, resistor.value));
+        ReducingEdge norton =
+            merged(source, sourceEnd, resistorEnd, gain / resistor.value);
+        norton.kind = ReducibleBranch::CURRENT_SOURCE;
+        add(std::move(norton));
+      } else {
+        continue;
+      }
+      reducing[branches[0]].removed = true;
+      reducing[branches[1]].removed = true;
+      eliminatedVertices.insert(middle);
+      changed = true;
     }
   }
-  assert(solution.expressions.size() == solution.parameters.size());
-  for (size_t i = 0; i < solution.expressions.size(); i++) {
-    auto unknowns = solution.expressions[i].getMutableUnknowns();
-    auto parameters = solution.parameters[i];
-    for (size_t j = 0; j < unknowns.size(); j++) {
-      *(unknowns[j]) = parameters[j];
+
+  if (!reducedAny) {
+    return std::nullopt;
+  }
+  reduced.graph = std::make_unique<CircuitGraph>();
+  for (auto& entry : vertices) {
+    if (eliminatedVertices.count(entry.first) == 0) {
+      reduced.graph->addVertex(*entry.second);
     }
-    solution.expressions[i].markKnown();
   }
+  for (auto& edge : reducing) {
+    if (edge.removed) continue;
+    if (edge.original != nullptr) {
+      reduced.graph->addEdge(*edge.original);
+      continue;
+    }
+    const Vertex& from = *vertices.at(edge.from);
+    const Vertex& to = *vertices.at(edge.to);
+    switch (edge.kind) {
+      case ReducibleBranch::RESISTOR:
+        reduced.graph->addEdge(Edge(edge.id, Resistor(from, to, edge.value)));
+        break;
+      case ReducibleBranch::VOLTAGE_SOURCE: {
+        VoltageSource source(from, to, edge.value);
+        source.current = edge.unknown;
+        reduced.graph->addEdge(Edge(edge.id, source));
+        break;
+      }
+      case ReducibleBranch::CURRENT_SOURCE:
+        reduced.graph->addEdge(
+            Edge(edge.id, CurrentSource(from, to, edge.value, edge.unknown)));
+        break;
+      case ReducibleBranch::NONE:
+        assert(false);
+        break;
+    }
+  }
+  return reduced;
+}
+
+void CircuitGraph::runJobs(size_t count,
+                           const std::function<void(size_t)>& body,
+                           unsigned numThreads) {
+  if (numThreads == 1 || count <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      body(i);
+    }
+    return;
+  }
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  numThreads = static_cast<unsigned>(std::min<size_t>(numThreads, count));
+  if (!partitionPool || partitionPool->size() != numThreads) {
+    partitionPool = std::make_unique<ThreadPool>(numThreads);
+  }
+  partitionPool->parallelFor(count, body);
+}
+
+std::vector<std::optional<partitionSolution>> CircuitGraph::solvePartitions(
+    const std::vector<Subcircuit>& subcircuits, const std::vector<bool>& skip,
+    const SolverConfig& config) {
+  // Every partition of every subcircuit is an independent job, so one list of
+  // jobs keeps the workers busy even when the subcircuits differ in size
+  struct Job {
+    size_t subcircuit;
+    size_t partition;
+  };
+  std::vector<Job> jobs;
+  for (size_t i = 0; i < subcircuits.size(); i++) {
+    if (skip[i]) continue;
+    size_t numPartitions = size_t(1) << subcircuits[i].basis.size();
+    for (size_t j = 0; j < numPartitions; j++) {
+      jobs.push_back({i, j});
+    }
+  }
+  std::vector<partitionSolution> solutions(jobs.size());
+  auto solveNthJob = [&](size_t i) {
+    const Subcircuit& subcircuit = subcircuits[jobs[i].subcircuit];
+    size_t basisSize = subcircuit.basis.size();
+    std::vector<bool> isHigh(basisSize);
+    for (size_t j = 0; j < basisSize; j++) {
+      isHigh[j] = (jobs[i].partition >> j) & 1;
+    }
+    solutions[i] = solvePartition(subcircuit.expressions, subcircuit.basis,
+                                  isHigh, config);
+  };
+  runJobs(jobs.size(), solveNthJob, config.partitionThreads);
+
+  std::vector<std::optional<partitionSolution>> best(subcircuits.size());
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (!solutions[i].summary.IsSolutionUsable()) {
+      continue;
+    }
+    auto& current = best[jobs[i].subcircuit];
+    if (!current.has_value() ||
+        solutions[i].summary.final_cost < current->summary.final_cost) {
+      current = std::move(solutions[i]);
+    }
+  }
+  return best;
+}
+
+bool CircuitGraph::solveModifiedNodal(const SolverConfig& config) {
+  // Values solved for earlier, e.g. by ceres, are unknowns of this solve and
+  // are loaded from its solution
+  markUnsolved();
+  if (!mnaSystem) {
+    mnaSystem = std::make_unique<MnaSystem>(vertices);
+  }
+  mnaSystem->setTimeStep(0);
+  mnaSystem->restart();
+  if (hasInitialGuess) {
+    // Otherwise the iteration starts from the last solution, or from 0
+    for (auto& entry : vertices) {
+      Expression voltage = entry.second->getVoltage();
+      if (!voltage.isConstant()) {
+        mnaSystem->setInitialGuess(*entry.second, *voltage.getPtrToUnknown());
+      }
+    }
+    hasInitialGuess = false;
+  }
+  if (!iterateModifiedNodal(config)) {
+    return false;
+  }
+  loadSolution(*mnaSystem);
   return true;
 }
 
-void CircuitGraph::resetUnknowns() {
-  std::random_device rd;
-  std::default_random_engine rng(rd());
+bool CircuitGraph::iterateModifiedNodal(const SolverConfig& config) {
+  MnaSystem& system = *mnaSystem;
+  for (unsigned i = 0; i < config.maxNewtonIterations; i++) {
+    system.clear();
+    for (auto& entry : edges) {
+      if (!entry.second->stamp(system)) {
+        return false;
+      }
+    }
+    if (!system.solve()) {
+      return false;
+    }
+    if (system.hasConverged(config.newtonTolerance)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CircuitGraph::loadSolution(const MnaSystem& system) {
+  for (auto& entry : vertices) {
+    Expression voltage = entry.second->getVoltage();
+    voltage.setSolution(system.getVoltage(*entry.second));
+  }
+  for (auto& entry : edges) {
+    entry.second->loadSolution(system);
+  }
+}
+
+void CircuitGraph::resetUnknowns(const Subcircuit& subcircuit,
+                                 std::mt19937_64& rng) {
   std::normal_distribution<> distrib(0.0, 2.0);
 
-  auto expressions = getExpressions();
-  for (auto expression : expressions) {
+  for (auto expression : subcircuit.expressions) {
     auto unknowns = expression.getMutableUnknowns();
     for (auto unknown : unknowns) {
       *unknown = distrib(rng);
     }
   }
-  auto discontinuities = getDiscontinuities();
-  for (auto discontinuity : discontinuities) {
+  for (auto discontinuity : subcircuit.basis) {
     *discontinuity = distrib(rng);
   }
 }
 
+bool CircuitGraph::setBranchParameter(const uuids::uuid& edgeId,
+                                      const std::string& name, double value) {
+  auto it = edges.find(edgeId);
+  if (it == edges.end() || !it->second->setParameter(name, value)) {
+    return false;
+  }
+  markUnsolved();
+  return true;
+}
+
+bool CircuitGraph::dcSweep(const uuids::uuid& edgeId, const std::string& name,
+                           double start, double stop, size_t numPoints,
+                           SweepResult& result, const SolverConfig& config) {
+  if (numPoints == 0 || !setBranchParameter(edgeId, name, start)) {
+    return false;
+  }
+  result = SweepResult();
+  std::vector<Expression> voltages;
+  for (auto& entry : vertices) {
+    result.vertexIds.push_back(entry.first);
+    voltages.push_back(entry.second->getVoltage());
+  }
+  // The current of a branch is rebuilt from its parameters, which may have
+  // been folded into it, so it is fetched again at every point
+  std::vector<const Edge*> sweptEdges;
+  for (auto& entry : edges) {
+    result.edgeIds.push_back(entry.first);
+    sweptEdges.push_back(entry.second.get());
+  }
+  const double notSolved = std::numeric_limits<double>::quiet_NaN();
+  result.voltages.reserve(numPoints * voltages.size());
+  result.currents.reserve(numPoints * sweptEdges.size());
+  for (size_t i = 0; i < numPoints; i++) {
+    double value = start;
+    if (numPoints > 1) {
+      value += (stop - start) * static_cast<double>(i) / (numPoints - 1);
+    }
+    // Changing the parameter keeps the previous point as the starting point
+    setBranchParameter(edgeId, name, value);
+    bool solved = solveCircuit(config);
+    result.values.push_back(value);
+    result.solved.push_back(solved);
+    for (auto& voltage : voltages) {
+      result.voltages.push_back(solved ? voltage.evaluate() : notSolved);
+    }
+    for (auto edge : sweptEdges) {
+      result.currents.push_back(solved ? edge->getCurrent().evaluate()
+                                       : notSolved);
+    }
+  }
+  return true;
+}
+
+proto::DcSweep SweepResult::toProto() const {
+  proto::DcSweep proto;
+  for (auto& id : vertexIds) {
+    proto.add_vertex_ids(uuids::to_string(id));
+  }
+  for (auto& id : edgeIds) {
+    proto.add_edge_ids(uuids::to_string(id));
+  }
+  proto.mutable_values()->Add(values.begin(), values.end());
+  for (bool point : solved) {
+    proto.add_solved(point);
+  }
+  proto.mutable_voltages()->Add(voltages.begin(), voltages.end());
+  proto.mutable_currents()->Add(currents.begin(), currents.end());
+  return proto;
+}
+
+namespace {
+/**
+ * The voltages of the unknown vertices at one time of a transient
+ */
+struct TimePoint {
+  double time;
+  std::vector<double> voltages;
+};
+
+/**
+ * Estimates the local truncation error of the step to `candidate` from the
+ * divided differences of the voltages at it and the points before it
+ *
+ * @param history the accepted points, oldest first
+ * @return the largest error of a voltage relative to its tolerance, so the
+ * step is accurate enough if it is at most 1, or nothing if there are too few
+ * points to tell
+ */
+std::optional<double> estimateStepError(const std::deque<TimePoint>& history,
+                                        const TimePoint& candidate,
+                                        IntegrationMethod method,
+                                        const TransientConfig& config) {
+  // The error of a method of order p is C h^(p+1) x^(p+1), and the
+  // derivative is (p+1)! times the divided difference over p+2 points
+  bool euler = method == IntegrationMethod::BACKWARD_EULER;
+  size_t order = euler ? 1 : 2;
+  double coefficient = euler ? 1.0 / 2 : 1.0 / 12;
+  double factorial = euler ? 2 : 6;
+  if (history.size() < order + 1) {
+    return std::nullopt;
+  }
+  std::vector<const TimePoint*> points;
+  for (size_t i = history.size() - order - 1; i < history.size(); i++) {
+    points.push_back(&history[i]);
+  }
+  points.push_back(&candidate);
+  double step = candidate.time - history.back().time;
+  double scale = coefficient * factorial * std::pow(step, order + 1);
+  double error = 0;
+  std::vector<double> differences(points.size());
+  for (size_t node = 0; node < candidate.voltages.size(); node++) {
+    for (size_t i = 0; i < points.size(); i++) {
+      differences[i] = points[i]->voltages[node];
+    }
+    for (size_t k = 1; k < points.size(); k++) {
+      for (size_t i = points.size() - 1; i >= k; i--) {
+        differences[i] = (differences[i] - differences[i - 1]) /
+                         (points[i]->time - points[i - k]->time);
+      }
+    }
+    double tolerance =
+        config.absoluteTolerance +
+        config.relativeTolerance * std::abs(candidate.voltages[node]);
+    error = std::max(error, scale * std::abs(differences.back()) / tolerance);
+  }
+  return error;
+}
+}  // namespace
+
+bool CircuitGraph::transient(const TransientConfig& transientConfig,
+                             const std::function<bool(double time)>& onStep,
+                             const SolverConfig& config) {
+  const double stopTime = transientConfig.stopTime;
+  const double maxStep = transientConfig.maxStep > 0 ? transientConfig.maxStep
+                                                     : stopTime / 50;
+  const double minStep =
+      transientConfig.minStep > 0 ? transientConfig.minStep : maxStep * 1e-9;
+  // Values solved for earlier are unknowns of each step
+  markUnsolved();
+  if (!mnaSystem) {
+    mnaSystem = std::make_unique<MnaSystem>(vertices);
+  }
+  MnaSystem& system = *mnaSystem;
+  system.restart();
+  std::vector<const Vertex*> nodes;
+  for (auto& entry : vertices) {
+    if (!entry.second->getVoltage().isConstant()) {
+      nodes.push_back(entry.second.get());
+    }
+  }
+
+  // The oldest point needed by the error estimate of the trapezoidal rule is
+  // three steps back
+  std::deque<TimePoint> history;
+  double time = 0;
+  // Short first steps, since the first ones cannot be checked
+  double step = maxStep / 1024;
+  bool solved = true;
+  while (time < stopTime) {
+    bool last = stopTime - time <= step;
+    TimePoint candidate{last ? stopTime : time + step, {}};
+    IntegrationMethod method = history.empty()
+                                   ? IntegrationMethod::BACKWARD_EULER
+                                   : transientConfig.method;
+    system.setTimeStep(candidate.time - time, method);
+    markUnsolved();
+    std::optional<double> error;
+    bool converged = iterateModifiedNodal(config);
+    if (converged) {
+      candidate.voltages.reserve(nodes.size());
+      for (auto node : nodes) {
+        candidate.voltages.push_back(system.getVoltage(*node));
+      }
+      error = estimateStepError(history, candidate, method, transientConfig);
+    }
+    if (!converged || error.value_or(0) > 1) {
+      step = (candidate.time - time) / 2;
+      if (step < minStep) {
+        solved = false;
+        break;
+      }
+      continue;
+    }
+    // Loading the solution moves the capacitors and inductors to the end of
+    // the step
+    loadSolution(system);
+    time = candidate.time;
+    history.push_back(std::move(candidate));
+    if (history.size() > 3) {
+      history.pop_front();
+    }
+    if (!onStep(time)) {
+      break;
+    }
+    // Doubling the step multiplies the error by 2^(p+1)
+    double growth = method == IntegrationMethod::BACKWARD_EULER ? 4 : 8;
+    if (error.has_value() && *error * growth < 0.5) {
+      step = std::min(2 * step, maxStep);
+    }
+  }
+  system.setTimeStep(0);
+  return solved;
+}
+
+bool CircuitGraph::acSweep(const uuids::uuid& inputId, double startFrequency,
+                           double stopFrequency, size_t numPoints,
+                           AcSweepResult& result, const SolverConfig& config) {
+  auto input = edges.find(inputId);
+  if (input == edges.end() || numPoints == 0 || !(startFrequency > 0) ||
+      !(stopFrequency > 0)) {
+    return false;
+  }
+  const Branch& inputBranch = input->second->getBranch();
+  if (dynamic_cast<const VoltageSource*>(&inputBranch) == nullptr &&
+      dynamic_cast<const CurrentSource*>(&inputBranch) == nullptr) {
+    return false;
+  }
+  markUnsolved();
+  if (!solveCircuit(config)) {
+    return false;
+  }
+  AcSystem system(vertices);
+  result = AcSweepResult();
+  for (auto& entry : edges) {
+    double amplitude = entry.first == inputId ? 1 : 0;
+    if (!entry.second->stampSmallSignal(system, amplitude)) {
+      return false;
+    }
+    result.edgeIds.push_back(entry.first);
+  }
+  system.analyze();
+  std::vector<const Vertex*> nodes;
+  for (auto& entry : vertices) {
+    result.vertexIds.push_back(entry.first);
+    nodes.push_back(entry.second.get());
+  }
+
+  const size_t numVertices = nodes.size();
+  const size_t numEdges = result.edgeIds.size();
+  const double notSolved = std::numeric_limits<double>::quiet_NaN();
+  result.voltageMagnitudes.assign(numPoints * numVertices, notSolved);
+  result.voltagePhases.assign(numPoints * numVertices, notSolved);
+  result.currentMagnitudes.assign(numPoints * numEdges, notSolved);
+  result.currentPhases.assign(numPoints * numEdges, notSolved);
+  for (size_t i = 0; i < numPoints; i++) {
+    double fraction = numPoints > 1 ? static_cast<double>(i) / (numPoints - 1)
+                                    : 0;
+    result.frequencies.push_back(
+        startFrequency * std::pow(stopFrequency / startFrequency, fraction));
+  }
+  // Each point only writes its own rows
+  std::vector<char> solved(numPoints, false);
+  auto solveNthPoint = [&](size_t i, AcSystem::Solver& solver) {
+    double frequency = result.frequencies[i];
+    Eigen::VectorXcd solution;
+    if (!system.solve(frequency, solver, solution)) {
+      return;
+    }
+    solved[i] = true;
+    for (size_t j = 0; j < numVertices; j++) {
+      std::complex<double> voltage = system.getVoltage(*nodes[j], solution);
+      result.voltageMagnitudes[i * numVertices + j] = std::abs(voltage);
+      result.voltagePhases[i * numVertices + j] = std::arg(voltage);
+    }
+    for (size_t j = 0; j < numEdges; j++) {
+      std::complex<double> current =
+          system.getBranchCurrent(j, solution, frequency);
+      result.currentMagnitudes[i * numEdges + j] = std::abs(current);
+      result.currentPhases[i * numEdges + j] = std::arg(current);
+    }
+  };
+  // Eigen's solvers cannot be copied, so the points are split into one block
+  // per thread, each analysing one solver and refactorising it at every point
+  unsigned numThreads = config.partitionThreads;
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const size_t numBlocks = std::min<size_t>(numThreads, numPoints);
+  auto solveNthBlock = [&](size_t block) {
+    AcSystem::Solver solver;
+    system.analyzePattern(solver);
+    for (size_t i = block * numPoints / numBlocks;
+         i < (block + 1) * numPoints / numBlocks; i++) {
+      solveNthPoint(i, solver);
+    }
+  };
+  runJobs(numBlocks, solveNthBlock, config.partitionThreads);
+  result.solved.assign(solved.begin(), solved.end());
+  return true;
+}
+
+proto::AcSweep AcSweepResult::toProto() const {
+  proto::AcSweep proto;
+  for (auto& id : vertexIds) {
+    proto.add_vertex_ids(uuids::to_string(id));
+  }
+  for (auto& id : edgeIds) {
+    proto.add_edge_ids(uuids::to_string(id));
+  }
+  proto.mutable_frequencies()->Add(frequencies.begin(), frequencies.end());
+  for (bool point : solved) {
+    proto.add_solved(point);
+  }
+  proto.mutable_voltage_magnitudes()->Add(voltageMagnitudes.begin(),
+                                          voltageMagnitudes.end());
+  proto.mutable_voltage_phases()->Add(voltagePhases.begin(),
+                                      voltagePhases.end());
+  proto.mutable_current_magnitudes()->Add(currentMagnitudes.begin(),
+                                          currentMagnitudes.end());
+  proto.mutable_current_phases()->Add(currentPhases.begin(),
+                                      currentPhases.end());
+  return proto;
+}
+
+void CircuitGraph::markUnsolved() {
+  for (auto& entry : vertices) {
+    entry.second->getVoltage().markUnsolved();
+  }
+  for (auto& entry : edges) {
+    entry.second->getCurrent().markUnsolved();
+    entry.second->getConstraint().markUnsolved();
+  }
+}
+
+bool CircuitGraph::setInitialGuess(const Vertex& v, double voltage) {
+  auto it = vertices.find(v.getId());
+  if (it == vertices.end()) {
+    return false;
+  }
+  Expression expression = it->second->getVoltage();
+  if (expression.isConstant()) {
+    return false;
+  }
+  *expression.getPtrToUnknown() = voltage;
+  hasInitialGuess = true;
+  return true;
+}
+
+void CircuitGraph::warmStart(const CircuitGraph& previous) {
+  for (auto& entry : vertices) {
+    Expression voltage = entry.second->getVoltage();
+    auto it = previous.vertices.find(entry.first);
+    if (voltage.isConstant() || it == previous.vertices.end()) continue;
+    *voltage.getPtrToUnknown() = it->second->getVoltage().evaluate();
+    hasInitialGuess = true;
+  }
+  // Branch currents that are unknowns of their own, e.g. through voltage
+  // sources, start from the previous current too
+  for (auto& entry : edges) {
+    Expression current = entry.second->getCurrent();
+    auto it = previous.edges.find(entry.first);
+    if (current.isConstant() || it == previous.edges.end()) continue;
+    if (double* unknown = current.getPtrToUnknown()) {
+      *unknown = it->second->getCurrent().evaluate();
+    }
+  }
+}
+
 std::unordered_set<const double*> CircuitGraph::getUnknowns() {
   std::unordered_set<const double*> unknowns;
   auto expressions = getExpressions();
@@ -175,6 +1252,122 @@ std::vector<Expression> CircuitGraph::getExpressions() {
   return expressions;
 }
 
+StructuralError CircuitGraph::checkStructure() const {
+  // Every vertex with a given voltage is joined to the reference, 0
+  std::unordered_map<uuids::uuid, size_t> indices;
+  // Every vertex by itself, for the sources between given voltages
+  std::unordered_map<uuids::uuid, size_t> positions;
+  for (auto& entry : vertices) {
+    Expression voltage = entry.second->getVoltage();
+    bool known = voltage.isConstant() && !voltage.isSolved();
+    indices[entry.first] = known ? 0 : indices.size() + 1;
+    positions[entry.first] = positions.size();
+  }
+  size_t numIndices = indices.size() + 1;
+  DisjointSets connected(numIndices);
+  DisjointSets withoutCurrentSources(numIndices);
+  DisjointSets voltageSources(numIndices);
+  DisjointSets givenSources(positions.size());
+  for (auto& entry : edges) {
+    uuids::uuid fromId = entry.second->getFrom().getId();
+    uuids::uuid toId = entry.second->getTo().getId();
+    size_t from = indices.at(fromId);
+    size_t to = indices.at(toId);
+    const Branch& branch = entry.second->getBranch();
+    connected.unite(from, to);
+    // At DC a capacitor is an open circuit and an inductor a short
+    if (dynamic_cast<const CurrentSource*>(&branch) == nullptr &&
+        dynamic_cast<const Capacitor*>(&branch) == nullptr) {
+      withoutCurrentSources.unite(from, to);
+    }
+    auto source = dynamic_cast<const VoltageSource*>(&branch);
+    if (source != nullptr && from == 0 && to == 0 &&
+        source->voltage.isConstant()) {
+      // A given source between two given voltages only has to agree with
+      // them, which is checked when solving. Its current is whatever the
+      // rest of the circuit draws from its vertices, so it cannot be part of
+      // a loop of such sources
+      if (!givenSources.unite(positions.at(fromId), positions.at(toId))) {
+        return StructuralError::VOLTAGE_SOURCE_LOOP;
+      }
+      continue;
+    }
+    if ((source != nullptr ||
+         dynamic_cast<const Inductor*>(&branch) != nullptr) &&
+        !voltageSources.unite(from, to)) {
+      return StructuralError::VOLTAGE_SOURCE_LOOP;
+    }
+  }
+  for (auto& entry : indices) {
+    if (connected.find(entry.second) != connected.find(0)) {
+      return StructuralError::FLOATING_VERTEX;
+    }
+  }
+  for (auto& entry : indices) {
+    if (withoutCurrentSources.find(entry.second) !=
+        withoutCurrentSources.find(0)) {
+      return StructuralError::CURRENT_SOURCE_CUTSET;
+    }
+  }
+  return StructuralError::NONE;
+}
+
+std::vector<Subcircuit> CircuitGraph::getSubcircuits() {
+  // Union-find over the edges, joining the edges incident on each vertex with
+  // an unknown voltage
+  std::vector<Edge*> edgeList;
+  std::unordered_map<uuids::uuid, size_t> edgeIndices;
+  for (auto& entry : edges) {
+    edgeIndices[entry.first] = edgeList.size();
+    edgeList.push_back(entry.second.get());
+  }
+  DisjointSets components(edgeList.size());
+  for (auto& entry : vertices) {
+    if (entry.second->getVoltage().isConstant()) continue;
+    const auto& incident = adjacencyList[entry.first];
+    for (size_t i = 1; i < incident.size(); i++) {
+      components.unite(edgeIndices[incident[i]], edgeIndices[incident[0]]);
+    }
+  }
+
+  std::vector<Subcircuit> subcircuits;
+  std::unordered_map<size_t, size_t> subcircuitIndices;
+  auto subcircuitOf = [&](size_t edgeIndex) -> Subcircuit& {
+    auto [it, inserted] =
+        subcircuitIndices.emplace(components.find(edgeIndex),
+                                  subcircuits.size());
+    if (inserted) {
+      subcircuits.emplace_back();
+    }
+    return subcircuits[it->second];
+  };
+  for (auto& entry : vertices) {
+    const auto& incident = adjacencyList[entry.first];
+    // A vertex without branches has no equation to solve
+    if (entry.second->getVoltage().isConstant() || incident.empty()) continue;
+    Subcircuit& subcircuit = subcircuitOf(edgeIndices[incident[0]]);
+    subcircuit.expressions.push_back(getNodeCurrents(*entry.second));
+    subcircuit.voltages.push_back(entry.second->getVoltage());
+  }
+  for (size_t i = 0; i < edgeList.size(); i++) {
+    Subcircuit& subcircuit = subcircuitOf(i);
+    subcircuit.expressions.push_back(edgeList[i]->getConstraint());
+    subcircuit.edges.push_back(edgeList[i]);
+  }
+
+  std::vector<Subcircuit> result;
+  for (auto& subcircuit : subcircuits) {
+    if (collectUnknowns(subcircuit.expressions).empty()) continue;
+    std::unordered_set<double*> discontinuities;
+    for (auto expression : subcircuit.expressions) {
+      discontinuities.merge(expression.getDiscontinuities());
+    }
+    subcircuit.basis.assign(discontinuities.begin(), discontinuities.end());
+    result.push_back(std::move(subcircuit));
+  }
+  return result;
+}
+
 Expression CircuitGraph::getNodeCurrents(Vertex node) {
   Expression nodeCurrents = 0;
   for (Edge& branch : getIncident(node)) {
@@ -203,6 +1396,7 @@ bool CircuitGraph::addVertex(const Vertex& v) {
   if (!hasVertex(v)) {
     adjacencyList[v.getId()] = std::vector<uuids::uuid>();
     vertices[v.getId()] = std::make_unique<Vertex>(v);
+    mnaSystem.reset();
     return true;
   }
   return false;
@@ -230,6 +1424,7 @@ bool CircuitGraph::addEdge(std::unique_ptr<Edge> e) {
   adjacencyList[from.getId()].push_back(e->getId());
   adjacencyList[to.getId()].push_back(e->getId());
   edges[e->getId()] = std::move(e);
+  mnaSystem.reset();
   return true;
 }
 
@@ -355,6 +1550,7 @@ proto::CircuitGraph CircuitGraph::toProto(const double* parameters) const {
 std::optional<std::unique_ptr<CircuitGraph>> CircuitGraph::fromProto(
     const proto::CircuitGraph& proto) {
   auto cg = std::make_unique<CircuitGraph>();
+  ExpressionArena::Scope scope(cg->arena);
   for (auto protoVertex : proto.vertices()) {
     if (auto vertex = Vertex::fromProto(protoVertex.second);
         vertex.has_value()) {
@@ -386,6 +1582,194 @@ std::vector<double*> CircuitGraph::getDiscontinuities() {
   return discontinuitiesVector;
 }
 
+/**
+ * Appends the bytes of `number` to `out`
+ */
+static void appendCanonicalForm(std::string& out, uint64_t number) {
+  out.append(reinterpret_cast<const char*>(&number), sizeof(number));
+}
+
+/**
+ * Appends whether `value` is known and, if it is, its value to `out`
+ */
+static void appendCanonicalForm(std::string& out, const Expression& value) {
+  bool known = value.isConstant() && !value.isSolved();
+  out.push_back(known ? 1 : 0);
+  if (known) {
+    double number = value.evaluate();
+    out.append(reinterpret_cast<const char*>(&number), sizeof(number));
+  }
+}
+
+/**
+ * The most rounds of colour refinement in a canonical form. Each round takes
+ * O((V + E) log V), and a chain can need a round for every vertex along it.
+ * Vertices that stop short of their final colours are only ordered by id,
+ * which costs cache hits but never gives two circuits the same form
+ */
+static constexpr size_t maxRefinementRounds = 16;
+
+/**
+ * @return the rank of each of `keys` among their distinct values, in
+ * ascending order, so that equal keys have equal ranks
+ */
+template <typename Key>
+static std::vector<size_t> rankKeys(const std::vector<Key>& keys) {
+  std::vector<size_t> order(keys.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+  std::vector<size_t> ranks(keys.size());
+  size_t rank = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (i > 0 && keys[order[i - 1]] < keys[order[i]]) {
+      rank++;
+    }
+    ranks[order[i]] = rank;
+  }
+  return ranks;
+}
+
+std::string CircuitGraph::getCanonicalForm() const {
+  std::vector<uuids::uuid> vertexIds;
+  std::vector<uuids::uuid> edgeIds;
+  return getCanonicalForm(vertexIds, edgeIds);
+}
+
+std::string CircuitGraph::getCanonicalForm(
+    std::vector<uuids::uuid>& vertexIds,
+    std::vector<uuids::uuid>& edgeIds) const {
+  std::vector<uuids::uuid> vertexList;
+  std::unordered_map<uuids::uuid, size_t> vertexIndices;
+  std::vector<std::string> vertexForms;
+  for (auto& entry : vertices) {
+    vertexIndices[entry.first] = vertexList.size();
+    vertexList.push_back(entry.first);
+    std::string form;
+    appendCanonicalForm(form, entry.second->getVoltage());
+    vertexForms.push_back(std::move(form));
+  }
+  std::vector<uuids::uuid> edgeList;
+  std::vector<std::pair<size_t, size_t>> ends;
+  std::vector<std::string> edgeForms;
+  for (auto& entry : edges) {
+    const Branch& branch = entry.second->getBranch();
+    edgeList.push_back(entry.first);
+    ends.emplace_back(vertexIndices.at(entry.second->getFrom().getId()),
+                      vertexIndices.at(entry.second->getTo().getId()));
+    std::string form;
+    // The type of branch is the field number of its protobuf message
+    proto::Edge message;
+    branch.toProto(&message);
+    form.push_back(static_cast<char>(message.specific_branch_case()));
+    for (auto& value : branch.getValues()) {
+      appendCanonicalForm(form, value);
+    }
+    edgeForms.push_back(std::move(form));
+  }
+
+  // Colour refinement: the vertices start out coloured by their voltages and
+  // are split by the colours of their neighbours and the branches to them
+  // until no colour splits any further, or for at most `maxRefinementRounds`
+  // rounds. The colours only depend on the circuit, not on its ids or the
+  // order it was built in
+  std::vector<size_t> edgeKinds = rankKeys(edgeForms);
+  std::vector<size_t> colors = rankKeys(vertexForms);
+  auto countColors = [&]() {
+    return colors.empty()
+               ? 0
+               : *std::max_element(colors.begin(), colors.end()) + 1;
+  };
+  size_t numColors = countColors();
+  typedef std::vector<std::tuple<size_t, bool, size_t>> Neighbourhood;
+  for (size_t round = 0; round < maxRefinementRounds; round++) {
+    std::vector<std::pair<size_t, Neighbourhood>> keys(vertexList.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      keys[i].first = colors[i];
+    }
+    for (size_t i = 0; i < ends.size(); i++) {
+      auto [from, to] = ends[i];
+      keys[from].second.emplace_back(edgeKinds[i], true, colors[to]);
+      keys[to].second.emplace_back(edgeKinds[i], false, colors[from]);
+    }
+    for (auto& key : keys) {
+      std::sort(key.second.begin(), key.second.end());
+    }
+    // Each colour is split in place, so a colour that does not split keeps
+    // its rank relative to the others
+    colors = rankKeys(keys);
+    size_t refined = countColors();
+    if (refined == numColors) break;
+    numColors = refined;
+  }
+
+  // Vertices with the same colour after refinement are mostly symmetric.
+  // Ordering them by id keeps the form deterministic, and only costs cache
+  // hits between circuits that differ in those ids
+  std::vector<size_t> vertexOrder(vertexList.size());
+  for (size_t i = 0; i < vertexOrder.size(); i++) {
+    vertexOrder[i] = i;
+  }
+  std::sort(vertexOrder.begin(), vertexOrder.end(), [&](size_t a, size_t b) {
+    return std::tie(colors[a], vertexList[a]) <
+           std::tie(colors[b], vertexList[b]);
+  });
+  std::vector<uint64_t> labels(vertexList.size());
+  vertexIds.clear();
+  for (size_t i = 0; i < vertexOrder.size(); i++) {
+    labels[vertexOrder[i]] = i;
+    vertexIds.push_back(vertexList[vertexOrder[i]]);
+  }
+  std::vector<std::string> labelledEdgeForms;
+  for (size_t i = 0; i < edgeList.size(); i++) {
+    std::string form;
+    appendCanonicalForm(form, labels[ends[i].first]);
+    appendCanonicalForm(form, labels[ends[i].second]);
+    labelledEdgeForms.push_back(std::move(form) + edgeForms[i]);
+  }
+  // Edges with the same form are interchangeable
+  std::vector<size_t> edgeOrder(edgeList.size());
+  for (size_t i = 0; i < edgeOrder.size(); i++) {
+    edgeOrder[i] = i;
+  }
+  std::sort(edgeOrder.begin(), edgeOrder.end(), [&](size_t a, size_t b) {
+    return std::tie(labelledEdgeForms[a], edgeList[a]) <
+           std::tie(labelledEdgeForms[b], edgeList[b]);
+  });
+  edgeIds.clear();
+  for (size_t i : edgeOrder) {
+    edgeIds.push_back(edgeList[i]);
+  }
+
+  std::string canonicalForm;
+  appendCanonicalForm(canonicalForm, static_cast<uint64_t>(vertexIds.size()));
+  for (size_t i : vertexOrder) {
+    canonicalForm += vertexForms[i];
+  }
+  appendCanonicalForm(canonicalForm, static_cast<uint64_t>(edgeIds.size()));
+  for (size_t i : edgeOrder) {
+    // Edge forms differ in length, so each is preceded by its length
+    canonicalForm.push_back(static_cast<char>(labelledEdgeForms[i].size()));
+    canonicalForm += labelledEdgeForms[i];
+  }
+  return canonicalForm;
+}
+
+uint64_t CircuitGraph::getCanonicalHash() const {
+  return hashCanonicalForm(getCanonicalForm());
+}
+
+uint64_t CircuitGraph::hashCanonicalForm(const std::string& form) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : form) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
 std::ostream& operator<<(std::ostream& out, const CircuitGraph& cg) {
   std::string output;
   (void)google::protobuf::json::MessageToJsonString(cg.toProto(), &output);
@@ -1,13 +1,23 @@
 #ifndef CIRCUIT_GRAPH_H
 #define CIRCUIT_GRAPH_H
 
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <ostream>
+#include <random>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "edge.h"
 #include "expression.h"
+#include "mnaSystem.h"
 #include "proto.h"
+#include "solverConfig.h"
+#include "threadPool.h"
 #include "vertex.h"
 
 // TODO: add error handling for:
@@ -15,15 +25,278 @@
 //  - Cases where there is no solution (e.g. no possible intersection)
 //  - Maybe include the relative tolerance in the printed results
 
+struct ReducedGraph;
+
+/**
+ * The ways in which the structure of a circuit alone can rule out a unique
+ * solution, whatever the values of its branches
+ */
+enum class StructuralError {
+  NONE,
+  /**
+   * A vertex has no path through any branches to a vertex with a given
+   * voltage, so nothing fixes its voltage
+   */
+  FLOATING_VERTEX,
+  /**
+   * Voltage sources and inductors form a loop, possibly through vertices with
+   * given voltages, so nothing fixes the current around it at DC. A source
+   * with a given voltage directly between two given voltages only closes a
+   * loop with other such sources
+   */
+  VOLTAGE_SOURCE_LOOP,
+  /**
+   * Current sources and capacitors are the only branches between some
+   * vertices and the vertices with given voltages, so nothing fixes the
+   * voltage between them at DC
+   */
+  CURRENT_SOURCE_CUTSET,
+};
+
 struct partitionSolution {
   ceres::Solver::Summary summary;
+  /**
+   * The unknowns that were solved for
+   */
+  std::vector<double*> unknowns;
+  /**
+   * The solved value of each entry of `unknowns`
+   */
+  std::vector<double> parameters;
+};
+
+/**
+ * The equations of part of a circuit that shares no unknowns with the rest of
+ * it, so that it can be solved on its own
+ */
+struct Subcircuit {
+  /**
+   * The net current into each unknown vertex and the constraint of each
+   * branch of the subcircuit
+   */
   std::vector<Expression> expressions;
-  std::vector<std::vector<double>> parameters;
+  /**
+   * The discontinuities of `expressions`
+   */
+  std::vector<double*> basis;
+  /**
+   * The voltage of each unknown vertex, in the order of their net currents at
+   * the start of `expressions`
+   */
+  std::vector<Expression> voltages;
+  /**
+   * The edge of each constraint, in the order of their constraints after the
+   * net currents in `expressions`
+   */
+  std::vector<const Edge*> edges;
+};
+
+/**
+ * The node voltages and branch currents at each point of a DC sweep
+ */
+struct SweepResult {
+  std::vector<uuids::uuid> vertexIds;
+  std::vector<uuids::uuid> edgeIds;
+  /**
+   * The value of the swept parameter at each point
+   */
+  std::vector<double> values;
+  /**
+   * Whether each point was solved. The rows of points that were not are NaN
+   */
+  std::vector<bool> solved;
+  /**
+   * One row of `vertexIds.size()` voltages per point
+   */
+  std::vector<double> voltages;
+  /**
+   * One row of `edgeIds.size()` currents per point
+   */
+  std::vector<double> currents;
+
+  proto::DcSweep toProto() const;
+};
+
+/**
+ * The small-signal voltages and currents at each frequency of an AC sweep,
+ * per Volt or Amp of the input source
+ */
+struct AcSweepResult {
+  std::vector<uuids::uuid> vertexIds;
+  std::vector<uuids::uuid> edgeIds;
+  /**
+   * The frequency of each point, in Hertz
+   */
+  std::vector<double> frequencies;
+  /**
+   * Whether each point was solved. The rows of points that were not are NaN
+   */
+  std::vector<bool> solved;
+  /**
+   * One row of `vertexIds.size()` magnitudes and phases per point. Phases are
+   * in radians
+   */
+  std::vector<double> voltageMagnitudes;
+  std::vector<double> voltagePhases;
+  /**
+   * One row of `edgeIds.size()` magnitudes and phases per point
+   */
+  std::vector<double> currentMagnitudes;
+  std::vector<double> currentPhases;
+
+  proto::AcSweep toProto() const;
 };
 
 class CircuitGraph {
  public:
-  bool solveCircuit();
+  /**
+   * Solves for every unknown of the circuit. Circuits that fail
+   * `checkStructure` are rejected before any solve.
+   *
+   * @param config the options used to solve the circuit
+   * @return true if the circuit was solved
+   */
+  bool solveCircuit(const SolverConfig& config = SolverConfig());
+
+  /**
+   * Checks that the circuit can have a unique solution from its structure
+   * alone, in time linear in the size of the graph. Vertices whose voltage was
+   * solved for count as unknown.
+   *
+   * @return the first problem found, or `StructuralError::NONE`
+   */
+  StructuralError checkStructure() const;
+
+  /**
+   * Changes a known parameter of a branch in place, e.g. the resistance of a
+   * resistor, and makes everything that was solved for unknown again. The
+   * next `solveCircuit` starts from the previous solution and reuses the
+   * structure of the previous solve instead of rebuilding the graph.
+   *
+   * @param edgeId the id of the edge of the branch
+   * @param name the name of the parameter, as in the protobuf message of the
+   * branch
+   * @param value the new value of the parameter
+   * @return false if there is no such edge or known parameter
+   */
+  bool setBranchParameter(const uuids::uuid& edgeId, const std::string& name,
+                          double value);
+
+  /**
+   * Solves the circuit at evenly spaced values of a branch parameter, starting
+   * each point from the solution of the previous one. The graph is left at the
+   * last point.
+   *
+   * @param edgeId the id of the edge of the branch
+   * @param name the name of the parameter, as in `setBranchParameter`
+   * @param start the value of the parameter at the first point
+   * @param stop the value of the parameter at the last point
+   * @param numPoints the number of points, including both ends
+   * @param result set to the solution at every point
+   * @param config the options used to solve each point
+   * @return false if there is no such parameter or `numPoints` is 0
+   */
+  bool dcSweep(const uuids::uuid& edgeId, const std::string& name,
+               double start, double stop, size_t numPoints,
+               SweepResult& result,
+               const SolverConfig& config = SolverConfig());
+
+  /**
+   * Solves for the DC operating point of the circuit, linearises every branch
+   * about it and solves the small-signal circuit at logarithmically spaced
+   * frequencies, with a source as the input. Every other source holds its
+   * value. The frequencies are independent, so they are solved concurrently
+   * on `config.partitionThreads` threads, all with the same fill-reducing
+   * ordering. The graph is left at the operating point.
+   *
+   * @param inputId the id of the edge of the voltage or current source whose
+   * amplitude is 1
+   * @param startFrequency the first frequency, in Hertz
+   * @param stopFrequency the last frequency, in Hertz
+   * @param numPoints the number of frequencies, including both ends
+   * @param result set to the response at every frequency
+   * @param config the options used to find the operating point
+   * @return false if there is no such source, the frequencies are not
+   * positive, `numPoints` is 0, there is no operating point or a branch has
+   * no linearisation
+   */
+  bool acSweep(const uuids::uuid& inputId, double startFrequency,
+               double stopFrequency, size_t numPoints, AcSweepResult& result,
+               const SolverConfig& config = SolverConfig());
+
+  /**
+   * Simulates the circuit from time 0, with each capacitor and inductor
+   * starting from where the last Modified Nodal Analysis solve or transient
+   * left it, or uncharged and without current if there was none. E.g. solve
+   * the circuit, change a source with `setBranchParameter` and simulate its
+   * step response.
+   *
+   * The time step adapts to the estimated local truncation error: it halves
+   * when a step is rejected and doubles when the error is well within
+   * tolerance, so that a linear circuit keeps the same matrix, and its
+   * factorisation, for runs of steps. Points are not stored: after each step
+   * the vertices and edges hold its solution and `onStep` is called, so
+   * memory does not grow with the length of the simulation. The graph is left
+   * at the last point.
+   *
+   * @param transientConfig the length of the simulation and the step control
+   * @param onStep called after each step with the time of the solution the
+   * graph holds; returning false ends the simulation there
+   * @param config the iteration limit and tolerance of the Newton-Raphson
+   * iteration of each step
+   * @return false if a branch cannot be represented in Modified Nodal
+   * Analysis form or a step did not converge even at `minStep`
+   */
+  bool transient(const TransientConfig& transientConfig,
+                 const std::function<bool(double time)>& onStep,
+                 const SolverConfig& config = SolverConfig());
+
+  /**
+   * Makes every value that was solved for unknown again, keeping the values as
+   * the starting point for the next solve
+   */
+  void markUnsolved();
+
+  /**
+   * Sets the voltage that solving starts from for an unknown vertex
+   * @param v the vertex to set the guess for
+   * @param voltage the guess, in Volts
+   * @return false if `v` is not in the graph or its voltage is known
+   */
+  bool setInitialGuess(const Vertex& v, double voltage);
+
+  /**
+   * Starts solving from the solution of a similar graph, e.g. the same circuit
+   * before one of its parameters changed. Each unknown vertex voltage and
+   * unknown branch current starts from the value of the vertex or edge with
+   * the same id in `previous`; the rest are left alone.
+   *
+   * @param previous a solved graph
+   */
+  void warmStart(const CircuitGraph& previous);
+
+  /**
+   * @return the number of times the last `solveCircuit` solved the circuit
+   * with ceres from a new starting point; 0 if it did not need ceres
+   */
+  unsigned getSolveAttempts() const { return solveAttempts; }
+
+  /**
+   * @return the number of times the Modified Nodal Analysis form of the graph
+   * has been factorised since a vertex or edge was last added
+   */
+  size_t getFactorizations() const {
+    return mnaSystem ? mnaSystem->getFactorizations() : 0;
+  }
+
+  /**
+   * @return the number of Newton-Raphson iterations of the Modified Nodal
+   * Analysis form of the graph in the last solve, or over every step of the
+   * last transient simulation
+   */
+  size_t getNewtonIterations() const {
+    return mnaSystem ? mnaSystem->getIteration() : 0;
+  }
 
   /**
    * Creates a new graph instance
@@ -92,8 +365,20 @@ class CircuitGraph {
   // pre: the circuit is solved
   proto::CircuitGraph toProto() const;
   proto::CircuitGraph toProto(const double* parameters) const;
+  /**
+   * Builds a graph from its message. The expressions of its vertices and edges
+   * are allocated from the arena of the graph
+   * @return the graph, or nullopt if the message is not a valid circuit
+   */
   static std::optional<std::unique_ptr<CircuitGraph>> fromProto(
       const proto::CircuitGraph& proto);
+
+  /**
+   * @return the arena that holds the expressions of this graph. Open an
+   * `ExpressionArena::Scope` on it to build vertices and edges for the graph
+   * in it as well
+   */
+  const std::shared_ptr<ExpressionArena>& getArena() const { return arena; }
   /**
    * Compares two CircuitGraphs for equality.
    *
@@ -106,14 +391,186 @@ class CircuitGraph {
    */
   bool operator==(const CircuitGraph& other) const;
 
-  partitionSolution solvePartition(const std::vector<double*>& basis,
-                                   const std::vector<bool>& isHigh);
+  /**
+   * Encodes the circuit the graph represents: the voltage of each vertex if it
+   * is known, and for each edge its vertices, its type of branch and every
+   * value of the branch that is given. Vertices and edges are labelled in an
+   * order that depends on the circuit rather than on their ids, so circuits
+   * that only differ in their ids mostly have the same form. The form does not
+   * depend on the order the graph was built in, and values that were solved
+   * for are left out.
+   */
+  std::string getCanonicalForm() const;
+
+  /**
+   * `getCanonicalForm()`, with the labelling it uses
+   *
+   * @param vertexIds set to the id of the vertex with each label
+   * @param edgeIds set to the id of the edge with each label
+   */
+  std::string getCanonicalForm(std::vector<uuids::uuid>& vertexIds,
+                               std::vector<uuids::uuid>& edgeIds) const;
+
+  /**
+   * @return the hash of `getCanonicalForm()`
+   */
+  uint64_t getCanonicalHash() const;
+
+  /**
+   * Hashes a canonical form, or anything appended to one, with 64-bit FNV-1a
+   */
+  static uint64_t hashCanonicalForm(const std::string& form);
+
+  /**
+   * Solves `expressions` with each discontinuity in `basis` restricted to one
+   * side of its boundary. The values held by the expression trees are only
+   * read, so partitions may be solved concurrently.
+   *
+   * @param expressions the residuals of the circuit, from `getExpressions`
+   * @param basis the discontinuities of `expressions`
+   * @param isHigh whether each discontinuity is restricted to be >= 0 (true)
+   * or <= 0 (false)
+   * @param config the options passed to ceres
+   * @return the solved values of the unknowns; they are not stored back into
+   * the expression trees
+   */
+  partitionSolution solvePartition(
+      const std::vector<Expression>& expressions,
+      const std::vector<double*>& basis, const std::vector<bool>& isHigh,
+      const SolverConfig& config = SolverConfig()) const;
   void print(std::ostream& out, const CircuitGraph& cg,
              std::unordered_set<const double*> parameters);
 
  private:
   std::vector<double*> getDiscontinuities();
-  void resetUnknowns();
+
+  /**
+   * Fixes the voltage of every unknown vertex joined to a known vertex by a
+   * chain of voltage sources, so that neither the voltage nor the constraint
+   * of those sources is part of the problem ceres solves
+   *
+   * @param pinned set to each fixed vertex with the source that fixes it,
+   * ordered outwards from the known vertices
+   * @param bridged set to the sources directly between two known vertices,
+   * each with the vertex where its current is found, in the same order
+   * @return false if two chains of sources disagree on the voltage of a
+   * vertex, in which case nothing is fixed
+   */
+  bool pinVoltageSources(
+      std::vector<std::pair<const Vertex*, const Edge*>>& pinned,
+      std::vector<std::pair<const Vertex*, const Edge*>>& bridged);
+
+  /**
+   * Solves for the current through each source of `pinned` from the currents
+   * of the other branches at the vertex it fixes, once the rest of the circuit
+   * is solved
+   */
+  void loadPinnedCurrents(
+      const std::vector<std::pair<const Vertex*, const Edge*>>& pinned);
+
+  /**
+   * Solves the expression trees of the circuit with ceres, restarting from
+   * random points until every subcircuit converges or the restart budget in
+   * `config` runs out
+   */
+  bool solveWithCeres(const SolverConfig& config);
+
+  /**
+   * Merges series and parallel resistors, series voltage sources and parallel
+   * current sources, and turns voltage sources in series with a resistor into
+   * current sources. Vertices and edges that are left are shared with this
+   * graph, so solving the reduced graph solves them here too.
+   *
+   * @return the reduced graph, or nothing if no branches could be merged
+   */
+  std::optional<ReducedGraph> reduce() const;
+
+  /**
+   * Solves the circuit directly in Modified Nodal Analysis form with a sparse
+   * factorisation, treating each ideal diode as a complementarity condition.
+   * Linear circuits are solved exactly in a single factorisation and the
+   * number of pivots for ideal diodes grows polynomially with the number of
+   * diodes instead of enumerating every combination of diode states.
+   * Non-linear branches are re-stamped about each solution until it
+   * converges.
+   *
+   * @param config the iteration limit and tolerance of the Newton-Raphson
+   * iteration
+   * @return false if a branch cannot be represented in the linear system, it
+   * has no solution or the iteration did not converge, in which case the
+   * graph is left unchanged
+   */
+  bool solveModifiedNodal(const SolverConfig& config);
+
+  /**
+   * Stamps and solves `mnaSystem` at its current time step until the
+   * Newton-Raphson iteration converges, without loading the solution
+   *
+   * @return false if a branch cannot be represented in the linear system, it
+   * has no solution or the iteration did not converge
+   */
+  bool iterateModifiedNodal(const SolverConfig& config);
+
+  /**
+   * Stores the solution of `system` in the unknowns of every vertex and edge
+   * and marks them as known
+   */
+  void loadSolution(const MnaSystem& system);
+
+  /**
+   * Calls `body(i)` for each i in [0, count), on `partitionPool` if
+   * `numThreads` allows more than one thread
+   *
+   * @param numThreads the number of threads to use; 0 uses one per core
+   */
+  void runJobs(size_t count, const std::function<void(size_t)>& body,
+               unsigned numThreads);
+
+  /**
+   * Solves every partition of the discontinuities of each subcircuit,
+   * starting from the values currently held by the unknowns. The partitions of
+   * all of the subcircuits are solved concurrently.
+   *
+   * @param subcircuits the subcircuits to solve, from `getSubcircuits`
+   * @param skip whether to leave out each subcircuit, e.g. because an earlier
+   * attempt already solved it
+   * @param config the options used to solve each partition
+   * @return the usable solution with the lowest cost for each subcircuit, if
+   * any; always empty for skipped subcircuits
+   */
+  std::vector<std::optional<partitionSolution>> solvePartitions(
+      const std::vector<Subcircuit>& subcircuits,
+      const std::vector<bool>& skip, const SolverConfig& config);
+
+  /**
+   * Solves a chain of circuits that ends close to this one, each starting
+   * from the solution of the one before, and leaves the unknowns at the last
+   * solution. The chain is chosen by `config.homotopy`: either the sources
+   * ramp up from 0, including those folded into other branches, or a
+   * conductance from every unknown vertex to 0V shrinks away.
+   *
+   * @param subcircuits the subcircuits of this graph
+   * @param skip whether to leave out each subcircuit
+   * @param config the options used to solve each step
+   */
+  void continueFromEasierCircuits(const std::vector<Subcircuit>& subcircuits,
+                                  const std::vector<bool>& skip,
+                                  const SolverConfig& config);
+
+  /**
+   * Moves every unknown of `subcircuit` to a random starting point drawn from
+   * `rng`
+   */
+  void resetUnknowns(const Subcircuit& subcircuit, std::mt19937_64& rng);
+
+  /**
+   * Splits the equations of the graph into its connected components. Vertices
+   * with a known voltage do not connect the branches on either side of them,
+   * since the equations of those branches share no unknowns.
+   *
+   * @return the components with at least one unknown
+   */
+  std::vector<Subcircuit> getSubcircuits();
   std::unordered_set<const double*> getUnknowns();
   /**
    * Get the sum of the currents going into/out of a node
@@ -158,8 +615,58 @@ class CircuitGraph {
    */
   EdgeMap edges;
 
-  int solveAttempts = 0;
-  const int maxSolveAttempts = 100;  // High but bounded
+  /**
+   * Workers used to solve partitions concurrently. Kept between solve attempts
+   * so that restarts do not recreate the threads
+   */
+  std::unique_ptr<ThreadPool> partitionPool;
+
+  /**
+   * The Modified Nodal Analysis form of the graph from the last solve. Kept
+   * until a vertex or edge is added so that re-solves after a parameter
+   * change reuse its numbering, sparsity pattern and last solution
+   */
+  std::unique_ptr<MnaSystem> mnaSystem;
+
+  /**
+   * The number of times the last `solveCircuit` solved the partitions with
+   * ceres
+   */
+  unsigned solveAttempts = 0;
+
+  /**
+   * Whether `setInitialGuess` or `warmStart` set unknowns since the last
+   * solve, so that the Newton-Raphson iteration starts from them
+   */
+  bool hasInitialGuess = false;
+
+  /**
+   * Holds the expression nodes of the vertices and edges built by `fromProto`
+   */
+  std::shared_ptr<ExpressionArena> arena = std::make_shared<ExpressionArena>();
+};
+
+/**
+ * A smaller graph with the same solution as another, from
+ * `CircuitGraph::reduce`
+ */
+struct ReducedGraph {
+  /**
+   * The graph with the merged branches. Its branches refer to the vertices of
+   * the original graph, so it must not outlive it
+   */
+  std::unique_ptr<CircuitGraph> graph;
+  /**
+   * The unknowns of the original graph that are not in `graph`, each with an
+   * expression for its value. An expression only depends on unknowns in
+   * `graph` and those after it in this list
+   */
+  std::vector<std::pair<Expression, Expression>> eliminated;
+
+  /**
+   * Stores the values of the eliminated unknowns once `graph` is solved
+   */
+  void expand() const;
 };
 
 std::ostream& operator<<(std::ostream& out, const CircuitGraph& cg);
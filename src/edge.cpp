@@ -27,6 +27,7 @@ Edge::Edge(Edge&& rhs) noexcept : id(rhs.id), branch(std::move(rhs.branch)) {
 }
 
 uuids::uuid Edge::getId() const { return id; };
+const Branch& Edge::getBranch() const { return *branch; }
 Vertex Edge::getFrom() const { return branch->getFrom(); };
 Vertex Edge::getTo() const { return branch->getTo(); };
 /**
@@ -36,6 +37,18 @@ Vertex Edge::getTo() const { return branch->getTo(); };
 Expression Edge::getCurrent() const { return branch->getCurrent(); }
 
 Expression Edge::getConstraint() const { return branch->getConstraint(); }
+bool Edge::stamp(MnaSystem& system) { return branch->stamp(system); }
+void Edge::loadSolution(const MnaSystem& system) {
+  branch->loadSolution(system);
+}
+
+bool Edge::stampSmallSignal(AcSystem& system, double amplitude) const {
+  return branch->stampSmallSignal(system, amplitude);
+}
+
+bool Edge::setParameter(const std::string& name, double value) {
+  return branch->setParameter(name, value);
+}
 bool Edge::operator==(const Edge& rhs) const { return id == rhs.id; }
 // Edge& operator=(const Edge& other);
 
@@ -65,6 +78,14 @@ std::optional<Edge> Edge::fromProto(proto::Edge proto,
   const Vertex& from = *vertices.at(fromId);
   const Vertex& to = *vertices.at(toId);
   switch (proto.specific_branch_case()) {
+    case proto::Edge::kCapacitor: {
+      Expression capacitance;
+      if (proto.capacitor().has_capacitance()) {
+        capacitance = proto.capacitor().capacitance();
+      }
+      newBranch = std::make_unique<Capacitor>(from, to, capacitance);
+      break;
+    }
     case proto::Edge::kCurrentSource: {
       Expression current;
       if (proto.has_current()) {
@@ -84,6 +105,14 @@ std::optional<Edge> Edge::fromProto(proto::Edge proto,
       newBranch = std::make_unique<IdealDiode>(from, to, voltage, current);
       break;
     }
+    case proto::Edge::kInductor: {
+      Expression inductance;
+      if (proto.inductor().has_inductance()) {
+        inductance = proto.inductor().inductance();
+      }
+      newBranch = std::make_unique<Inductor>(from, to, inductance);
+      break;
+    }
     case proto::Edge::kRealDiode: {
       Expression i0, n, vt;
       if (proto.real_diode().has_i0()) {
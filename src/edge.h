@@ -33,6 +33,35 @@ class Edge {
   Expression getCurrent() const;
 
   Expression getConstraint() const;
+
+  /**
+   * @return the branch of this edge, e.g. to inspect its type and parameters
+   */
+  const Branch& getBranch() const;
+
+  /**
+   * Adds the branch of this edge to `system`
+   * @return false if the branch cannot be represented in `system`
+   */
+  bool stamp(MnaSystem& system);
+
+  /**
+   * Stores the solution of `system` in the unknowns of the branch of this edge
+   */
+  void loadSolution(const MnaSystem& system);
+
+  /**
+   * Adds the linearisation of the branch of this edge to `system`
+   * @param amplitude the small-signal value of the branch if it is a source
+   * @return false if the branch has no linearisation
+   */
+  bool stampSmallSignal(AcSystem& system, double amplitude) const;
+
+  /**
+   * Changes a known parameter of the branch of this edge in place
+   * @return false if the branch has no known parameter called `name`
+   */
+  bool setParameter(const std::string& name, double value);
   bool operator==(const Edge& rhs) const;
   void toProto(proto::Edge* proto);
   void toProto(proto::Edge* proto, const double* parameters);
@@ -23,10 +23,10 @@ using namespace std;
 //  - 1 for voltages
 //  - 1 by default
 
-Expression::Expression() : Expression(make_shared<VariableNode>()) {}
+Expression::Expression() : Expression(expressionNode::make<VariableNode>()) {}
 
 Expression::Expression(double value)
-    : Expression(make_shared<VariableNode>(value)) {}
+    : Expression(expressionNode::make<VariableNode>(value)) {}
 
 Expression::Expression(shared_ptr<ExpressionNode> root)
     : root(std::move(root)) {}
@@ -34,12 +34,12 @@ Expression::Expression(shared_ptr<ExpressionNode> root)
 Expression::~Expression() {}
 
 Expression Expression::operator+(Expression rhs) const {
-  shared_ptr<VariableNode> u = dynamic_pointer_cast<VariableNode>(rhs.root);
+  VariableNode* u = expressionNode::as<VariableNode>(rhs.root);
   if (u && u->known && u->value == 0) {
     return Expression(root);
   }
 
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v && v->known && v->value == 0) {
     return Expression(std::move(rhs.root));
   }
@@ -48,22 +48,22 @@ Expression Expression::operator+(Expression rhs) const {
     return Expression(u->value + v->value);
   }
 
-  shared_ptr<UnaryOpNode> n = dynamic_pointer_cast<UnaryOpNode>(rhs.root);
+  UnaryOpNode* n = expressionNode::as<UnaryOpNode>(rhs.root);
   if (n && n->op == UnaryOp::NEG)
     return Expression(
-        make_shared<BinaryOpNode>(root, n->operand, BinaryOp::SUB));
+        expressionNode::makeBinary(root, n->operand, BinaryOp::SUB));
 
   return Expression(
-      make_shared<BinaryOpNode>(root, std::move(rhs.root), BinaryOp::ADD));
+      expressionNode::makeBinary(root, std::move(rhs.root), BinaryOp::ADD));
 }
 
 Expression Expression::operator-(Expression rhs) const {
-  shared_ptr<VariableNode> u = dynamic_pointer_cast<VariableNode>(rhs.root);
+  VariableNode* u = expressionNode::as<VariableNode>(rhs.root);
   if (u && u->known && u->value == 0) {
     return Expression(root);
   }
 
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v && v->known && v->value == 0) {
     if (u && u->known) return Expression(-u->value);
     return -Expression(std::move(rhs.root));
@@ -78,11 +78,11 @@ Expression Expression::operator-(Expression rhs) const {
   }
 
   return Expression(
-      make_shared<BinaryOpNode>(root, std::move(rhs.root), BinaryOp::SUB));
+      expressionNode::makeBinary(root, std::move(rhs.root), BinaryOp::SUB));
 }
 
 Expression Expression::operator*(Expression rhs) const {
-  shared_ptr<VariableNode> u = dynamic_pointer_cast<VariableNode>(rhs.root);
+  VariableNode* u = expressionNode::as<VariableNode>(rhs.root);
   if (u && u->known) {
     if (u->value == 0) {
       return Expression(std::move(rhs.root));
@@ -91,7 +91,7 @@ Expression Expression::operator*(Expression rhs) const {
     }
   }
 
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v && v->known) {
     if (v->value == 0) {
       return Expression(root);
@@ -105,17 +105,16 @@ Expression Expression::operator*(Expression rhs) const {
   }
 
   return Expression(
-      make_shared<BinaryOpNode>(root, std::move(rhs.root), BinaryOp::MUL));
+      expressionNode::makeBinary(root, std::move(rhs.root), BinaryOp::MUL));
 }
 
 Expression Expression::operator/(Expression rhs) const {
-  shared_ptr<VariableNode> u =
-      dynamic_pointer_cast<VariableNode>(std::move(rhs.root));
+  VariableNode* u = expressionNode::as<VariableNode>(rhs.root);
   if (u && u->known && u->value == 1) {
     return Expression(root);
   }
 
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
 
   if (v && u && v->known && u->known) {
     return Expression(v->value / u->value);
@@ -126,29 +125,29 @@ Expression Expression::operator/(Expression rhs) const {
   }
 
   return Expression(
-      make_shared<BinaryOpNode>(root, std::move(rhs.root), BinaryOp::DIV));
+      expressionNode::makeBinary(root, std::move(rhs.root), BinaryOp::DIV));
 }
 
 Expression Expression::operator-() const {
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v && v->known) {
     return Expression(-v->value);
   }
-  return Expression(make_shared<UnaryOpNode>(root, UnaryOp::NEG));
+  return Expression(expressionNode::makeUnary(root, UnaryOp::NEG));
 }
 
 Expression std::exp(Expression arg) {
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(arg.root);
+  VariableNode* v = expressionNode::as<VariableNode>(arg.root);
   if (v && v->known) {
     return Expression(std::exp(v->value));
   }
   return Expression(
-      make_shared<UnaryOpNode>(std::move(arg.root), UnaryOp::EXP));
+      expressionNode::makeUnary(std::move(arg.root), UnaryOp::EXP));
 }
 
 bool Expression::operator==(const Expression& rhs) const {
-  shared_ptr<VariableNode> u = dynamic_pointer_cast<VariableNode>(root);
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(rhs.root);
+  VariableNode* u = expressionNode::as<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(rhs.root);
   // TODO: why has this been implemented this way?
   if (u && v && u->known && v->known) {
     return u->value == v->value;
@@ -168,7 +167,7 @@ bool Expression::operator!=(const Expression& rhs) const {
 }
 
 Expression& Expression::operator=(double rhs) {
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v) {
     v->value = rhs;
     v->known = true;
@@ -211,13 +210,18 @@ Condition Expression::operator>=(Expression rhs) const {
 Expression Expression::makeConditional(Condition condition,
                                        Expression valIfTrue,
                                        Expression valIfFalse) {
-  return Expression(make_shared<TernaryOpNode>(
-      make_shared<Condition>(condition), std::move(valIfTrue.root),
+  return Expression(expressionNode::make<TernaryOpNode>(
+      expressionNode::make<Condition>(condition), std::move(valIfTrue.root),
       std::move(valIfFalse.root)));
 }
 
+Expression Expression::makeProduct(Expression lhs, Expression rhs) {
+  return Expression(expressionNode::makeBinary(
+      std::move(lhs.root), std::move(rhs.root), BinaryOp::MUL));
+}
+
 bool Expression::isConstant() const {
-  shared_ptr<VariableNode> v = dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   return v && v->known;
 }
 
@@ -266,32 +270,229 @@ ExpressionMap Expression::getMap() const {
   return map;
 }
 
+ExpressionTape Expression::compile() const {
+  std::unordered_set<double*> unknownSet;
+  root->getUnknowns(unknownSet);
+  return ExpressionTape(
+      root, std::vector<double*>(unknownSet.begin(), unknownSet.end()));
+}
+
+Expression Expression::simplify() const {
+  ExpressionSimplifier simplifier;
+  return Expression(simplifier.simplify(root));
+}
+
+ExpressionTape Expression::compileWithDerivatives(
+    ExpressionSimplifier* simplifier) const {
+  std::unordered_set<double*> unknownSet;
+  root->getUnknowns(unknownSet);
+  std::vector<double*> unknowns(unknownSet.begin(), unknownSet.end());
+  Expression value =
+      simplifier ? Expression(simplifier->simplify(root)) : *this;
+  std::vector<ExpressionNodePtr> outputs = {value.root};
+  for (double* unknown : unknowns) {
+    ExpressionNodePtr derivative = value.differentiate(unknown).root;
+    outputs.push_back(simplifier ? simplifier->simplify(derivative)
+                                 : derivative);
+  }
+  return ExpressionTape(outputs, std::move(unknowns));
+}
+
+ExpressionTape Expression::compileWithDerivatives(
+    const std::vector<Expression>& residuals,
+    ExpressionCostFunction::Derivatives& derivatives,
+    ExpressionSimplifier* simplifier) {
+  std::vector<double*> unknowns;
+  std::unordered_map<double*, size_t> slots;
+  std::vector<std::vector<double*>> residualUnknowns;
+  std::vector<ExpressionNodePtr> outputs;
+  for (const auto& residual : residuals) {
+    std::unordered_set<double*> unknownSet;
+    residual.root->getUnknowns(unknownSet);
+    residualUnknowns.emplace_back(unknownSet.begin(), unknownSet.end());
+    for (double* unknown : residualUnknowns.back()) {
+      if (slots.emplace(unknown, unknowns.size()).second) {
+        unknowns.push_back(unknown);
+      }
+    }
+    outputs.push_back(simplifier ? simplifier->simplify(residual.root)
+                                 : residual.root);
+  }
+  derivatives.clear();
+  for (size_t i = 0; i < residuals.size(); i++) {
+    Expression value(outputs[i]);
+    for (double* unknown : residualUnknowns[i]) {
+      Expression derivative = value.differentiate(unknown);
+      if (simplifier) {
+        derivative = Expression(simplifier->simplify(derivative.root));
+      }
+      if (derivative != 0) {
+        derivatives.emplace_back(i, slots.at(unknown));
+        outputs.push_back(derivative.root);
+      }
+    }
+  }
+  return ExpressionTape(outputs, std::move(unknowns));
+}
+
+Expression Expression::differentiate(const double* unknown) const {
+  std::unordered_map<const ExpressionNode*, Expression> memo;
+  return differentiate(root, unknown, memo);
+}
+
+Expression Expression::differentiate(
+    const ExpressionNodePtr& node, const double* unknown,
+    std::unordered_map<const ExpressionNode*, Expression>& memo) {
+  auto it = memo.find(node.get());
+  if (it != memo.end()) {
+    return it->second;
+  }
+  Expression derivative(0.0);
+  if (auto v = expressionNode::as<VariableNode>(node)) {
+    if (!v->known && &v->value == unknown) {
+      derivative = Expression(1.0);
+    }
+  } else if (auto b = expressionNode::as<BinaryOpNode>(node)) {
+    Expression lhs(b->lhs);
+    Expression rhs(b->rhs);
+    Expression dLhs = differentiate(b->lhs, unknown, memo);
+    Expression dRhs = differentiate(b->rhs, unknown, memo);
+    // Neither side depending on `unknown` would otherwise leave 0 / rhs
+    if (dLhs != 0 || dRhs != 0) {
+      switch (b->op) {
+        case BinaryOp::ADD:
+          derivative = dLhs + dRhs;
+          break;
+        case BinaryOp::SUB:
+          derivative = dLhs - dRhs;
+          break;
+        case BinaryOp::MUL:
+          derivative = dLhs * rhs + lhs * dRhs;
+          break;
+        case BinaryOp::DIV:
+          // (l / r)' = (l' - (l / r) r') / r, which reuses the node for l / r
+          derivative = (dLhs - Expression(node) * dRhs) / rhs;
+          break;
+      }
+    }
+  } else if (auto u = expressionNode::as<UnaryOpNode>(node)) {
+    Expression dOperand = differentiate(u->operand, unknown, memo);
+    switch (u->op) {
+      case UnaryOp::EXP:
+        derivative = Expression(node) * dOperand;
+        break;
+      case UnaryOp::NEG:
+        derivative = -dOperand;
+        break;
+    }
+  } else if (auto t = expressionNode::as<TernaryOpNode>(node)) {
+    Expression dTrue = differentiate(t->valIfTrue, unknown, memo);
+    Expression dFalse = differentiate(t->valIfFalse, unknown, memo);
+    if (dTrue == dFalse) {
+      derivative = dTrue;
+    } else {
+      derivative = Expression(expressionNode::make<TernaryOpNode>(
+          t->condition, std::move(dTrue.root), std::move(dFalse.root)));
+    }
+  }
+  memo.emplace(node.get(), derivative);
+  return derivative;
+}
+
+namespace {
+ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor>* makeCostFunction(
+    ExpressionTape tape) {
+  size_t numUnknowns = tape.getUnknowns().size();
+  auto costFunction =
+      new ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor>(
+          new ExpressionCostFunctor(std::move(tape)));
+  for (size_t i = 0; i < numUnknowns; i++) {
+    costFunction->AddParameterBlock(1);
+  }
+  costFunction->SetNumResiduals(1);
+  return costFunction;
+}
+}  // namespace
+
 ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor>*
 Expression::getCostFunction() {
-  ExpressionMap map = getMap();
-  auto costFunctor = new ExpressionCostFunctor(root, map);
-  return new ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor>(
-      costFunctor);
+  return makeCostFunction(compile());
 }
 
 void Expression::addToProblem(ceres::Problem& problem) {
-  auto costFunction = getCostFunction();
-  auto unknowns = getMutableUnknowns();
-  for (size_t i = 0; i < unknowns.size(); i++) {
-    costFunction->AddParameterBlock(1);
+  ParameterBlockMap blocks;
+  for (auto unknown : getMutableUnknowns()) {
+    blocks[unknown] = unknown;
   }
-  auto discontinuityErrors = getDiscontinuityErrors();
-  for (auto error : discontinuityErrors) {
-    error.addToProblem(problem);
+  addToProblem(problem, blocks);
+}
+
+void Expression::addToProblem(ceres::Problem& problem,
+                              const ParameterBlockMap& blocks) {
+  std::vector<ExpressionTape> tapes;
+  compileResiduals(tapes);
+  for (auto& tape : tapes) {
+    addResidual(problem, std::move(tape), blocks);
   }
-  costFunction->SetNumResiduals(1);
-  problem.AddResidualBlock(costFunction, new ceres::HuberLoss(2.0), unknowns);
+}
+
+void Expression::compileResiduals(std::vector<ExpressionTape>& tapes,
+                                  ExpressionSimplifier* simplifier) {
+  for (auto error : getDiscontinuityErrors()) {
+    error.compileResiduals(tapes, simplifier);
+  }
+  tapes.push_back(compileWithDerivatives(simplifier));
+}
+
+void Expression::getResiduals(std::vector<Expression>& residuals) {
+  for (auto error : getDiscontinuityErrors()) {
+    error.getResiduals(residuals);
+  }
+  residuals.push_back(*this);
+}
+
+void Expression::addResidual(ceres::Problem& problem, ExpressionTape tape,
+                             const ParameterBlockMap& blocks,
+                             std::shared_ptr<const NativeCode> code,
+                             size_t function) {
+  // The slots of the compiled tape fix the order of the parameter blocks
+  std::vector<double*> parameterBlocks;
+  parameterBlocks.reserve(tape.getUnknowns().size());
+  for (auto unknown : tape.getUnknowns()) {
+    parameterBlocks.push_back(blocks.at(unknown));
+  }
+  auto costFunction =
+      new ExpressionCostFunction(std::move(tape), std::move(code), function);
+  problem.AddResidualBlock(costFunction, new ceres::HuberLoss(2.0),
+                           parameterBlocks);
+}
+
+void Expression::addResiduals(ceres::Problem& problem, ExpressionTape tape,
+                              size_t numResiduals,
+                              ExpressionCostFunction::Derivatives derivatives,
+                              const ParameterBlockMap& blocks,
+                              std::shared_ptr<const NativeCode> code,
+                              size_t function) {
+  std::vector<double*> parameterBlocks;
+  parameterBlocks.reserve(tape.getUnknowns().size());
+  for (auto unknown : tape.getUnknowns()) {
+    parameterBlocks.push_back(blocks.at(unknown));
+  }
+  auto costFunction =
+      new ExpressionCostFunction(std::move(tape), numResiduals,
+                                 std::move(derivatives), std::move(code),
+                                 function);
+  problem.AddResidualBlock(costFunction, new ceres::HuberLoss(2.0),
+                           parameterBlocks);
 }
 
 double Expression::evaluate() const {
-  double* parameters = new double[getNumUnknowns()];
+  if (auto v = expressionNode::as<VariableNode>(root); v && v->known) {
+    return v->value;
+  }
   ExpressionMap map = getMap();
-  return expressionNode::evaluate(root, parameters, map);
+  std::vector<double> parameters(map.size(), 0.0);
+  return expressionNode::evaluate(root, parameters.data(), map);
 }
 
 double Expression::evaluate(double const* parameters) const {
@@ -300,8 +501,7 @@ double Expression::evaluate(double const* parameters) const {
 }
 
 double* Expression::getPtrToUnknown() {
-  std::shared_ptr<VariableNode> v =
-      std::dynamic_pointer_cast<VariableNode>(root);
+  VariableNode* v = expressionNode::as<VariableNode>(root);
   if (v) {
     return &v->value;
   } else {
@@ -311,6 +511,23 @@ double* Expression::getPtrToUnknown() {
 
 void Expression::markKnown() { root->markKnown(); }
 
+void Expression::markSolved() { root->markSolved(); }
+
+void Expression::markUnsolved() { root->markUnsolved(); }
+
+bool Expression::isSolved() const {
+  VariableNode* v = expressionNode::as<VariableNode>(root);
+  return v && v->solved;
+}
+
+void Expression::setSolution(double value) {
+  VariableNode* v = expressionNode::as<VariableNode>(root);
+  if (v && !v->known) {
+    v->value = value;
+    v->markSolved();
+  }
+}
+
 std::ostream& operator<<(std::ostream& out, const Expression& e) {
   out << "(" << e.root.get() << ")" << e.root;
   return out;
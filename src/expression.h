@@ -4,9 +4,12 @@
 #include <ceres/ceres.h>
 
 #include <iostream>
+#include <unordered_map>
 
 #include "expressionCostFunctor.h"
 #include "expressionNode.h"
+#include "expressionSimplifier.h"
+#include "expressionTape.h"
 
 class Expression;
 
@@ -102,6 +105,12 @@ class Expression {
   static Expression makeConditional(Condition condition, Expression valIfTrue,
                                     Expression valIfFalse);
 
+  /**
+   * @return `lhs * rhs` without folding known values together, so that the
+   * product follows later changes to either of them
+   */
+  static Expression makeProduct(Expression lhs, Expression rhs);
+
   /**
    * Checks if two Expressions are equal
    *
@@ -135,6 +144,73 @@ class Expression {
 
   size_t getNumUnknowns() const;
 
+  /**
+   * Differentiates this Expression symbolically. The derivative of a
+   * conditional is a conditional on the same condition between the
+   * derivatives of its branches
+   *
+   * @param unknown points to the value of the unknown to differentiate with
+   * respect to
+   * @return an Expression representing the partial derivative of this
+   * Expression with respect to `unknown`, treating the values that are known
+   * now as constants
+   */
+  Expression differentiate(const double* unknown) const;
+
+  /**
+   * Compiles this Expression into a tape that evaluates it without walking the
+   * tree. Its slots are the unknowns of this Expression in the order of
+   * `getMutableUnknowns`
+   *
+   * @return the compiled Expression
+   */
+  ExpressionTape compile() const;
+
+  /**
+   * Rewrites this Expression into an equivalent one that takes fewer
+   * operations to evaluate, folding in the current known values
+   *
+   * @return the simplified Expression
+   */
+  Expression simplify() const;
+
+  /**
+   * Compiles this Expression along with its derivatives
+   *
+   * @param simplifier if not null, simplifies the Expression and its
+   * derivatives before compiling them
+   * @return a tape whose first output is this Expression, followed by its
+   * partial derivative with respect to each slot. The slots are the unknowns
+   * of this Expression, even those that simplifying removes
+   */
+  ExpressionTape compileWithDerivatives(
+      ExpressionSimplifier* simplifier = nullptr) const;
+
+  /**
+   * Compiles several residuals along with their derivatives into one tape, so
+   * that the subexpressions they share are evaluated once
+   *
+   * @param residuals the residuals to compile
+   * @param derivatives set to the residual and slot of each partial
+   * derivative the tape outputs after the residuals. Those that are always 0
+   * are left out
+   * @param simplifier if not null, simplifies the residuals and their
+   * derivatives before compiling them
+   * @return a tape whose outputs are the residuals, in order, followed by the
+   * partial derivatives in `derivatives`. The slots are the unknowns of the
+   * residuals
+   */
+  static ExpressionTape compileWithDerivatives(
+      const std::vector<Expression>& residuals,
+      ExpressionCostFunction::Derivatives& derivatives,
+      ExpressionSimplifier* simplifier = nullptr);
+
+  /**
+   * Creates a cost function for this Expression, with one parameter block of
+   * size 1 per unknown in the order of `getMutableUnknowns`
+   *
+   * @return the cost function, owned by the caller
+   */
   ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor>* getCostFunction();
 
   /**
@@ -161,8 +237,101 @@ class Expression {
 
   void markKnown();
 
+  /**
+   * Marks every unknown in `this` as known until `markUnsolved` is called
+   */
+  void markSolved();
+
+  /**
+   * Makes the unknowns of `this` that were marked by `markSolved` or
+   * `setSolution` unknown again. They keep their values, so the next solve
+   * starts from the previous solution.
+   */
+  void markUnsolved();
+
+  /**
+   * @return true if `this` is a single unknown that is known only because it
+   * was solved for
+   */
+  bool isSolved() const;
+
+  /**
+   * If `this` represents a single unknown, sets it to the solved `value` and
+   * marks it solved. Does nothing if `this` is known.
+   *
+   * @param value the solved value
+   */
+  void setSolution(double value);
+
   void addToProblem(ceres::Problem& problem);
 
+  /**
+   * Adds this Expression as a residual to `problem`, using separate storage for
+   * the unknowns instead of the values held by the expression tree. This
+   * allows several problems over the same Expression to be solved at once.
+   *
+   * @param problem the problem to add this Expression to
+   * @param blocks maps each unknown of this Expression to the storage the
+   * problem should use for it
+   */
+  void addToProblem(ceres::Problem& problem, const ParameterBlockMap& blocks);
+
+  /**
+   * Compiles the residuals `addToProblem` would add for this Expression: the
+   * errors of its discontinuities, then this Expression itself, each with its
+   * derivatives
+   *
+   * @param tapes the tapes to append the residuals to
+   * @param simplifier if not null, simplifies each residual before compiling
+   * it
+   */
+  void compileResiduals(std::vector<ExpressionTape>& tapes,
+                        ExpressionSimplifier* simplifier = nullptr);
+
+  /**
+   * Collects the residuals `addToProblem` would add for this Expression: the
+   * errors of its discontinuities, then this Expression itself
+   *
+   * @param residuals the residuals to append to
+   */
+  void getResiduals(std::vector<Expression>& residuals);
+
+  /**
+   * Adds a compiled residual to `problem`
+   *
+   * @param problem the problem to add the residual to
+   * @param tape a tape from `compileResiduals`
+   * @param blocks maps each unknown of the tape to the storage the problem
+   * should use for it
+   * @param code machine code for the tape, or null to interpret it
+   * @param function the index of the tape's function in `code`
+   */
+  static void addResidual(ceres::Problem& problem, ExpressionTape tape,
+                          const ParameterBlockMap& blocks,
+                          std::shared_ptr<const NativeCode> code = nullptr,
+                          size_t function = 0);
+
+  /**
+   * Adds residuals compiled into one tape to `problem` as a single residual
+   * block
+   *
+   * @param problem the problem to add the residuals to
+   * @param tape a tape from `compileWithDerivatives` for several residuals
+   * @param numResiduals the number of residuals in the tape
+   * @param derivatives the partial derivatives the tape outputs, as set by
+   * `compileWithDerivatives`
+   * @param blocks maps each unknown of the tape to the storage the problem
+   * should use for it
+   * @param code machine code for the tape, or null to interpret it
+   * @param function the index of the tape's function in `code`
+   */
+  static void addResiduals(ceres::Problem& problem, ExpressionTape tape,
+                           size_t numResiduals,
+                           ExpressionCostFunction::Derivatives derivatives,
+                           const ParameterBlockMap& blocks,
+                           std::shared_ptr<const NativeCode> code = nullptr,
+                           size_t function = 0);
+
  private:
   /**
    * Obtain a mapping of double* to array indices for function arguments.
@@ -170,6 +339,16 @@ class Expression {
    * between
    */
   ExpressionMap getMap() const;
+
+  /**
+   * Differentiates the AST with `node` as a root
+   * @param memo the derivatives of the nodes differentiated so far, so that
+   * shared subtrees are only differentiated once
+   */
+  static Expression differentiate(
+      const ExpressionNodePtr& node, const double* unknown,
+      std::unordered_map<const ExpressionNode*, Expression>& memo);
+
   Expression(ExpressionNodePtr root);
   ExpressionNodePtr root;
   friend std::ostream& operator<<(std::ostream& out, const Expression& e);
@@ -0,0 +1,24 @@
+#include "expressionArena.h"
+
+#include <utility>
+
+namespace {
+thread_local std::shared_ptr<ExpressionArena> currentArena;
+}  // namespace
+
+ExpressionArena::ExpressionArena(size_t chunkSize)
+    : resource(chunkSize, std::pmr::new_delete_resource()) {}
+
+void* ExpressionArena::allocate(size_t bytes, size_t alignment) {
+  bytesAllocated += bytes;
+  return resource.allocate(bytes, alignment);
+}
+
+const std::shared_ptr<ExpressionArena>& ExpressionArena::current() {
+  return currentArena;
+}
+
+ExpressionArena::Scope::Scope(std::shared_ptr<ExpressionArena> arena)
+    : previous(std::exchange(currentArena, std::move(arena))) {}
+
+ExpressionArena::Scope::~Scope() { currentArena = std::move(previous); }
@@ -0,0 +1,158 @@
+#ifndef EXPRESSION_ARENA_H
+#define EXPRESSION_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+
+namespace expressionNode {
+struct OperationTable;
+}  // namespace expressionNode
+
+/**
+ * A region of memory that the nodes of many `Expression`s are carved out of,
+ * instead of each node being a separate heap allocation.
+ *
+ * Nodes are allocated from the arena of the calling thread's innermost
+ * `Scope`, or from the heap outside of any scope. Freeing a node does not
+ * return its memory; the arena releases all of it at once when it is
+ * destroyed. Every node holds a reference to its arena, so expressions can
+ * safely outlive the graph that built them.
+ *
+ * Only one thread may allocate from an arena at a time, so a scope should only
+ * be opened around code that builds expressions on one thread.
+ */
+class ExpressionArena {
+ public:
+  /**
+   * Creates an empty arena
+   * @param chunkSize the size of the first block of memory to allocate, in
+   * bytes. Each following block is larger than the last
+   */
+  explicit ExpressionArena(size_t chunkSize = 16384);
+
+  ExpressionArena(const ExpressionArena&) = delete;
+  ExpressionArena& operator=(const ExpressionArena&) = delete;
+
+  /**
+   * Allocates uninitialised memory
+   * @param bytes the size of the allocation
+   * @param alignment the alignment of the allocation
+   * @return the start of the allocation, which lives as long as the arena
+   */
+  void* allocate(size_t bytes, size_t alignment);
+
+  /**
+   * @return the number of bytes handed out by `allocate`
+   */
+  size_t getBytesAllocated() const { return bytesAllocated; }
+
+  /**
+   * @return the table that shares the operation nodes built in this arena,
+   * which is null until the first one is built
+   */
+  std::shared_ptr<expressionNode::OperationTable>& getOperations() {
+    return operations;
+  }
+
+  /**
+   * @return the arena of the innermost open `Scope` on this thread, or null
+   * if there is none
+   */
+  static const std::shared_ptr<ExpressionArena>& current();
+
+  /**
+   * Makes nodes created on this thread come from an arena for as long as it
+   * exists. Scopes can be nested
+   */
+  class Scope {
+   public:
+    /**
+     * @param arena the arena to allocate from, or null to use the heap
+     */
+    explicit Scope(std::shared_ptr<ExpressionArena> arena);
+
+    /**
+     * Restores the arena that was current before this scope
+     */
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    std::shared_ptr<ExpressionArena> previous;
+  };
+
+ private:
+  std::pmr::monotonic_buffer_resource resource;
+  size_t bytesAllocated = 0;
+  /**
+   * Declared after `resource`, so that it lets go of the nodes before their
+   * memory is released
+   */
+  std::shared_ptr<expressionNode::OperationTable> operations;
+};
+
+/**
+ * A standard allocator that allocates from an `ExpressionArena`, and keeps it
+ * alive for as long as anything it allocated might still be in use
+ */
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(std::shared_ptr<ExpressionArena> arena)
+      : arena(std::move(arena)) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  /**
+   * Does nothing: the memory is released along with the arena
+   */
+  void deallocate(T*, size_t) {}
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return arena == other.arena;
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return arena != other.arena;
+  }
+
+ private:
+  template <typename U>
+  friend class ArenaAllocator;
+
+  std::shared_ptr<ExpressionArena> arena;
+};
+
+namespace expressionNode {
+
+/**
+ * Creates a node of an expression tree, in the current `ExpressionArena` if
+ * there is one
+ * @param args the arguments to the constructor of the node
+ * @return the new node
+ */
+template <typename Node, typename... Args>
+std::shared_ptr<Node> make(Args&&... args) {
+  const std::shared_ptr<ExpressionArena>& arena = ExpressionArena::current();
+  if (arena) {
+    return std::allocate_shared<Node>(ArenaAllocator<Node>(arena),
+                                      std::forward<Args>(args)...);
+  }
+  return std::make_shared<Node>(std::forward<Args>(args)...);
+}
+}  // namespace expressionNode
+
+#endif  // EXPRESSION_ARENA_H
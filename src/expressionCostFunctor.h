@@ -1,23 +1,131 @@
 #ifndef EXPRESSION_COST_FUNCTOR_H
 #define EXPRESSION_COST_FUNCTOR_H
 
-#include "expressionNode.h"
+#include <ceres/ceres.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "expressionTape.h"
+#include "nativeCode.h"
 
 class ExpressionCostFunctor {
  public:
   ~ExpressionCostFunctor() {}
-  ExpressionCostFunctor(ExpressionNodePtr expressionNode,
-                        const ExpressionMap& map)
-      : expressionNode(expressionNode), map(map) {}
+  /**
+   * @param tape the compiled residual. Each of its slots is one parameter
+   * block of size 1
+   */
+  explicit ExpressionCostFunctor(ExpressionTape tape) : tape(std::move(tape)) {}
   template <typename T>
-  bool operator()(T const* const* parameters, T* residuals) {
-    residuals[0] = expressionNode::evaluate(expressionNode, parameters[0], map);
+  bool operator()(T const* const* parameters, T* residuals) const {
+    residuals[0] = tape.evaluate(parameters);
+    return true;
+  }
+
+ private:
+  ExpressionTape tape;
+};
+
+/**
+ * A cost function that evaluates residuals and their exact Jacobian together
+ * from one compiled tape, without automatic differentiation. The tape is
+ * interpreted unless machine code was generated for it
+ */
+class ExpressionCostFunction : public ceres::CostFunction {
+ public:
+  /**
+   * The residual and the slot of each partial derivative that a tape outputs
+   * after its residuals. Every other partial derivative is 0
+   */
+  typedef std::vector<std::pair<size_t, size_t>> Derivatives;
+
+  /**
+   * @param tape the compiled residual followed by its partial derivative with
+   * respect to each slot, as from `Expression::compileWithDerivatives`. Each
+   * of its slots is one parameter block of size 1
+   * @param code machine code for the tape, or null to interpret it
+   * @param function the index of the tape's function in `code`
+   */
+  explicit ExpressionCostFunction(ExpressionTape tape,
+                                  std::shared_ptr<const NativeCode> code = {},
+                                  size_t function = 0)
+      : ExpressionCostFunction(std::move(tape), 1, {}, std::move(code),
+                               function) {
+    for (size_t slot = 0; slot < this->tape.getUnknowns().size(); slot++) {
+      derivatives.emplace_back(0, slot);
+    }
+  }
+
+  /**
+   * @param tape the compiled residuals followed by their partial
+   * derivatives, as from `Expression::compileWithDerivatives` for several
+   * residuals. Each of its slots is one parameter block of size 1
+   * @param numResiduals the number of residuals the tape outputs first
+   * @param derivatives the partial derivative of each later output
+   * @param code machine code for the tape, or null to interpret it
+   * @param function the index of the tape's function in `code`
+   */
+  ExpressionCostFunction(ExpressionTape tape, size_t numResiduals,
+                         Derivatives derivatives,
+                         std::shared_ptr<const NativeCode> code = {},
+                         size_t function = 0)
+      : tape(std::move(tape)),
+        numResiduals(numResiduals),
+        derivatives(std::move(derivatives)),
+        code(std::move(code)),
+        native(this->code ? this->code->getFunction(function) : nullptr) {
+    set_num_residuals(static_cast<int>(numResiduals));
+    mutable_parameter_block_sizes()->assign(this->tape.getUnknowns().size(),
+                                            1);
+  }
+
+  bool Evaluate(double const* const* parameters, double* residuals,
+                double** jacobians) const override {
+    if (jacobians == nullptr) {
+      evaluate(parameters, residuals, numResiduals);
+      return true;
+    }
+    std::vector<double> outputs(tape.getNumOutputs());
+    evaluate(parameters, outputs.data(), outputs.size());
+    std::copy_n(outputs.begin(), numResiduals, residuals);
+    // The Jacobian of each parameter block is one column, with a row per
+    // residual
+    for (size_t slot = 0; slot < tape.getUnknowns().size(); slot++) {
+      if (jacobians[slot] != nullptr) {
+        std::fill_n(jacobians[slot], numResiduals, 0.0);
+      }
+    }
+    for (size_t i = 0; i < derivatives.size(); i++) {
+      auto [residual, slot] = derivatives[i];
+      if (jacobians[slot] != nullptr) {
+        jacobians[slot][residual] = outputs[numResiduals + i];
+      }
+    }
     return true;
   }
 
  private:
-  ExpressionNodePtr expressionNode;
-  ExpressionMap map;
+  void evaluate(double const* const* parameters, double* outputs,
+                size_t numOutputs) const {
+    if (native != nullptr) {
+      native(parameters, tape.getConstants().data(), outputs,
+             static_cast<int>(numOutputs));
+    } else {
+      tape.evaluate(parameters, outputs, numOutputs);
+    }
+  }
+
+  ExpressionTape tape;
+  size_t numResiduals;
+  Derivatives derivatives;
+  /**
+   * Keeps the shared object holding `native` loaded
+   */
+  std::shared_ptr<const NativeCode> code;
+  NativeCode::Function native;
 };
 
 #endif  // !EXPRESSION_COST_FUNCTOR_H
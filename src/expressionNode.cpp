@@ -1,44 +1,150 @@
 #include "expressionNode.h"
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <unordered_map>
 #include <unordered_set>
 
+namespace {
+
+/**
+ * Identifies an operation by its type and the nodes of its operands. Unary
+ * operations have no `rhs`
+ */
+struct OperationKey {
+  const ExpressionNode* lhs;
+  const ExpressionNode* rhs;
+  int op;
+
+  bool operator==(const OperationKey& other) const {
+    return lhs == other.lhs && rhs == other.rhs && op == other.op;
+  }
+};
+
+struct OperationKeyHash {
+  size_t operator()(const OperationKey& key) const {
+    size_t hash = std::hash<const void*>()(key.lhs);
+    hash ^= std::hash<const void*>()(key.rhs) + 0x9e3779b97f4a7c15 +
+            (hash << 6) + (hash >> 2);
+    return hash ^ static_cast<size_t>(key.op);
+  }
+};
+
+OperationKey binaryKey(const ExpressionNode* lhs, const ExpressionNode* rhs,
+                       BinaryOp op) {
+  return {lhs, rhs, static_cast<int>(op)};
+}
+
+OperationKey unaryKey(const ExpressionNode* operand, UnaryOp op) {
+  return {operand, nullptr, 4 + static_cast<int>(op)};
+}
+}  // namespace
+
+/**
+ * Looks up the operation nodes that are still alive for `intern`. The entries
+ * do not keep their nodes alive; expired entries are replaced when their key
+ * is built again, and purged whenever the table doubles in size
+ */
+struct expressionNode::OperationTable {
+  std::unordered_map<OperationKey, std::weak_ptr<ExpressionNode>,
+                     OperationKeyHash>
+      nodes;
+  size_t purgeAt = 64;
+};
+
+namespace {
+
+expressionNode::OperationTable& getOperationTable() {
+  const std::shared_ptr<ExpressionArena>& arena = ExpressionArena::current();
+  if (arena) {
+    std::shared_ptr<expressionNode::OperationTable>& table =
+        arena->getOperations();
+    if (!table) {
+      table = std::make_shared<expressionNode::OperationTable>();
+    }
+    return *table;
+  }
+  thread_local expressionNode::OperationTable heapTable;
+  return heapTable;
+}
+
+template <typename Node, typename... Args>
+ExpressionNodePtr intern(const OperationKey& key, Args&&... args) {
+  expressionNode::OperationTable& table = getOperationTable();
+  std::weak_ptr<ExpressionNode>& entry = table.nodes[key];
+  // A live node holds its operands, so no other node can have their addresses
+  if (ExpressionNodePtr existing = entry.lock()) {
+    return existing;
+  }
+  ExpressionNodePtr node =
+      expressionNode::make<Node>(std::forward<Args>(args)...);
+  entry = node;
+  if (table.nodes.size() >= table.purgeAt) {
+    for (auto it = table.nodes.begin(); it != table.nodes.end();) {
+      it = it->second.expired() ? table.nodes.erase(it) : std::next(it);
+    }
+    table.purgeAt = std::max<size_t>(64, 2 * table.nodes.size());
+  }
+  return node;
+}
+}  // namespace
+
+ExpressionNodePtr expressionNode::makeBinary(ExpressionNodePtr lhs,
+                                             ExpressionNodePtr rhs,
+                                             BinaryOp op) {
+  OperationKey key = binaryKey(lhs.get(), rhs.get(), op);
+  return intern<BinaryOpNode>(key, std::move(lhs), std::move(rhs), op);
+}
+
+ExpressionNodePtr expressionNode::makeUnary(ExpressionNodePtr operand,
+                                            UnaryOp op) {
+  OperationKey key = unaryKey(operand.get(), op);
+  return intern<UnaryOpNode>(key, std::move(operand), op);
+}
+
 BinaryOpNode::BinaryOpNode(ExpressionNodePtr lhs, ExpressionNodePtr rhs,
                            BinaryOp op)
-    : lhs(lhs), rhs(rhs), op(op) {}
+    : ExpressionNode(kKind), lhs(lhs), rhs(rhs), op(op) {}
 
 Condition::Condition(ExpressionNodePtr lhs, ExpressionNodePtr rhs,
                      BooleanBinaryOp op) {
   switch (op) {
     case BooleanBinaryOp::LT:
-      val = std::make_shared<BinaryOpNode>(rhs, lhs, BinaryOp::SUB);
+      val = expressionNode::makeBinary(rhs, lhs, BinaryOp::SUB);
       includeZero = false;
       break;
     case BooleanBinaryOp::LEQ:
-      val = std::make_shared<BinaryOpNode>(rhs, lhs, BinaryOp::SUB);
+      val = expressionNode::makeBinary(rhs, lhs, BinaryOp::SUB);
       includeZero = true;
       break;
     case BooleanBinaryOp::GEQ:
-      val = std::make_shared<BinaryOpNode>(lhs, rhs, BinaryOp::SUB);
+      val = expressionNode::makeBinary(lhs, rhs, BinaryOp::SUB);
       includeZero = true;
       break;
     case BooleanBinaryOp::GT:
-      val = std::make_shared<BinaryOpNode>(lhs, rhs, BinaryOp::SUB);
+      val = expressionNode::makeBinary(lhs, rhs, BinaryOp::SUB);
       includeZero = false;
       break;
   }
-  constraint = std::make_shared<VariableNode>();
+  constraint = expressionNode::make<VariableNode>();
 }
 
 TernaryOpNode::TernaryOpNode(std::shared_ptr<Condition> condition,
                              ExpressionNodePtr valIfTrue,
                              ExpressionNodePtr valIfFalse)
-    : condition(condition), valIfTrue(valIfTrue), valIfFalse(valIfFalse) {}
+    : ExpressionNode(kKind),
+      condition(condition),
+      valIfTrue(valIfTrue),
+      valIfFalse(valIfFalse) {}
 UnaryOpNode::UnaryOpNode(ExpressionNodePtr operand, UnaryOp op)
-    : operand(operand), op(op) {}
+    : ExpressionNode(kKind), operand(operand), op(op) {}
 
-VariableNode::VariableNode() : value(1.0), known(false) {}
-VariableNode::VariableNode(double value) : value(value), known(true) {}
+VariableNode::VariableNode()
+    : ExpressionNode(kKind), value(1.0), known(false) {}
+VariableNode::VariableNode(double value)
+    : ExpressionNode(kKind), value(value), known(true) {}
 
 void BinaryOpNode::getUnknowns(
     std::unordered_set<const double*>& unknowns) const {
@@ -112,6 +218,56 @@ void UnaryOpNode::markKnown() { operand->markKnown(); }
 
 void VariableNode::markKnown() { known = true; }
 
+void BinaryOpNode::markSolved() {
+  lhs->markSolved();
+  rhs->markSolved();
+}
+
+void Condition::markSolved() {
+  val->markSolved();
+  constraint->markSolved();
+}
+
+void TernaryOpNode::markSolved() {
+  condition->markSolved();
+  valIfTrue->markSolved();
+  valIfFalse->markSolved();
+}
+
+void UnaryOpNode::markSolved() { operand->markSolved(); }
+
+void VariableNode::markSolved() {
+  if (!known) {
+    known = true;
+    solved = true;
+  }
+}
+
+void BinaryOpNode::markUnsolved() {
+  lhs->markUnsolved();
+  rhs->markUnsolved();
+}
+
+void Condition::markUnsolved() {
+  val->markUnsolved();
+  constraint->markUnsolved();
+}
+
+void TernaryOpNode::markUnsolved() {
+  condition->markUnsolved();
+  valIfTrue->markUnsolved();
+  valIfFalse->markUnsolved();
+}
+
+void UnaryOpNode::markUnsolved() { operand->markUnsolved(); }
+
+void VariableNode::markUnsolved() {
+  if (solved) {
+    known = false;
+    solved = false;
+  }
+}
+
 void BinaryOpNode::getDiscontinuities(
     std::unordered_set<double*>& discontinuities) {
   lhs->getDiscontinuities(discontinuities);
@@ -173,7 +329,7 @@ void VariableNode::getDiscontinuityError(
 }
 
 std::shared_ptr<BinaryOpNode> Condition::getError() const {
-  return std::make_shared<BinaryOpNode>(val, constraint, BinaryOp::SUB);
+  return expressionNode::make<BinaryOpNode>(val, constraint, BinaryOp::SUB);
 }
 
 std::ostream& BinaryOpNode::serialize(std::ostream& out) const {
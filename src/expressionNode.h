@@ -1,12 +1,15 @@
 #ifndef EXPRESSIONNODE_H
 #define EXPRESSIONNODE_H
 
+#include <cstdint>
 #include <memory>
 #include <ostream>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "expressionArena.h"
+
 struct BinaryOpNode;
 struct ExpressionNode;
 struct TernaryOpNode;
@@ -24,23 +27,79 @@ struct VariableNode;
  */
 
 typedef std::unordered_map<const double*, size_t> ExpressionMap;
+/**
+ * A mapping from pointers to unknown values to the storage that `ceres` should
+ * use for that unknown while solving
+ */
+typedef std::unordered_map<const double*, double*> ParameterBlockMap;
 typedef std::shared_ptr<ExpressionNode> ExpressionNodePtr;
 
 namespace expressionNode {
 template <typename T>
-T evaluate(ExpressionNodePtr root, T const* parameters,
+T evaluate(const ExpressionNodePtr& root, T const* parameters,
            const ExpressionMap& map);
 }
 
+/**
+ * Types of binary operations
+ */
+enum class BinaryOp { MUL, DIV, ADD, SUB };
+
+/**
+ * Types of unary operations
+ */
+enum class UnaryOp { EXP, NEG };
+
+namespace expressionNode {
+
+/**
+ * Creates a node for `lhs op rhs`, or returns the live node that already
+ * represents it.
+ *
+ * Operations are hash-consed on the identity of their operands, so building
+ * the same operation on the same subtrees twice yields one shared node, and a
+ * tree built this way is a DAG in which every distinct subexpression appears
+ * once. Nodes are only shared within the current `ExpressionArena`, or within
+ * the calling thread outside of any arena, so that threads building
+ * expressions never wait on each other.
+ * @return the node for the operation
+ */
+ExpressionNodePtr makeBinary(ExpressionNodePtr lhs, ExpressionNodePtr rhs,
+                             BinaryOp op);
+
+/**
+ * Creates a node for `op(operand)`, or returns the live node that already
+ * represents it, as `makeBinary`
+ * @return the node for the operation
+ */
+ExpressionNodePtr makeUnary(ExpressionNodePtr operand, UnaryOp op);
+}  // namespace expressionNode
+
 /**
  * A single node in the AST of an `Expression`
  */
-struct ExpressionNode {
+struct ExpressionNode : std::enable_shared_from_this<ExpressionNode> {
+  /**
+   * The concrete types of node. The set is closed, so code that depends on
+   * the type of a node switches on `kind` rather than casting
+   */
+  enum class Kind : uint8_t { VARIABLE, BINARY, UNARY, TERNARY };
+
+  /**
+   * @param kind the concrete type of the node
+   */
+  explicit ExpressionNode(Kind kind) : kind(kind) {}
+
   /**
    * virtual destructor to enable dynamic dispatch
    */
   virtual ~ExpressionNode() {}
 
+  /**
+   * The concrete type of the node
+   */
+  const Kind kind;
+
   /**
    * Stores const pointers to all unknown values in the AST with `this` as a
    * root in `unknowns`
@@ -66,20 +125,30 @@ struct ExpressionNode {
   virtual std::ostream& serialize(std::ostream& out) const = 0;
 
   virtual void markKnown() = 0;
+
+  /**
+   * Marks every unknown in the AST as known, remembering that its value came
+   * from solving so that `markUnsolved` can make it unknown again
+   */
+  virtual void markSolved() = 0;
+
+  /**
+   * Makes every unknown that was marked known by `markSolved` unknown again,
+   * keeping its value as the starting point of the next solve
+   */
+  virtual void markUnsolved() = 0;
+
   virtual void getDiscontinuities(
       std::unordered_set<double*>& discontinuities) = 0;
   virtual void getDiscontinuityError(std::vector<ExpressionNodePtr>& error) = 0;
 };
 
-/**
- * Types of binary operations
- */
-enum class BinaryOp { MUL, DIV, ADD, SUB };
-
 /**
  * A Binary operation node in the AST
  */
 struct BinaryOpNode : ExpressionNode {
+  static constexpr Kind kKind = Kind::BINARY;
+
   /**
    * Creates a `BinaryOpNode`
    * @param lhs the left hand side of the operation
@@ -134,6 +203,16 @@ struct BinaryOpNode : ExpressionNode {
    */
   void markKnown() override;
 
+  /**
+   * @inheritdoc
+   */
+  void markSolved() override;
+
+  /**
+   * @inheritdoc
+   */
+  void markUnsolved() override;
+
   void getDiscontinuities(
       std::unordered_set<double*>& discontinuities) override;
 
@@ -216,6 +295,8 @@ struct Condition {
   std::ostream& serialize(std::ostream& out) const;
 
   void markKnown();
+  void markSolved();
+  void markUnsolved();
   void getDiscontinuities(std::unordered_set<double*>& discontinuities);
   void getDiscontinuityError(std::vector<ExpressionNodePtr>& error);
 
@@ -240,6 +321,8 @@ struct Condition {
  * A Ternary operation node in the AST
  */
 struct TernaryOpNode : ExpressionNode {
+  static constexpr Kind kKind = Kind::TERNARY;
+
   /*
    * Creates a `TernaryOpNode`
    * @param condition what to test to determine which expression to use
@@ -289,6 +372,16 @@ struct TernaryOpNode : ExpressionNode {
    */
   void markKnown() override;
 
+  /**
+   * @inheritdoc
+   */
+  void markSolved() override;
+
+  /**
+   * @inheritdoc
+   */
+  void markUnsolved() override;
+
   void getDiscontinuities(
       std::unordered_set<double*>& discontinuities) override;
   void getDiscontinuityError(std::vector<ExpressionNodePtr>& error) override;
@@ -303,15 +396,12 @@ struct TernaryOpNode : ExpressionNode {
   ExpressionNodePtr valIfFalse;
 };
 
-/**
- * Types of unary operations
- */
-enum class UnaryOp { EXP, NEG };
-
 /**
  * A Unary operation node in the AST
  */
 struct UnaryOpNode : ExpressionNode {
+  static constexpr Kind kKind = Kind::UNARY;
+
   /**
    * Creates a `UnaryOpNode`
    * @param operand the operand for the operation
@@ -357,6 +447,16 @@ struct UnaryOpNode : ExpressionNode {
    */
   void markKnown() override;
 
+  /**
+   * @inheritdoc
+   */
+  void markSolved() override;
+
+  /**
+   * @inheritdoc
+   */
+  void markUnsolved() override;
+
   void getDiscontinuities(
       std::unordered_set<double*>& discontinuities) override;
   void getDiscontinuityError(std::vector<ExpressionNodePtr>& error) override;
@@ -375,6 +475,8 @@ struct UnaryOpNode : ExpressionNode {
  * A node representing a single known or unknown value in the AST
  */
 struct VariableNode : ExpressionNode {
+  static constexpr Kind kKind = Kind::VARIABLE;
+
   /**
    * Creates a `VariableNode` representing an unknown
    */
@@ -423,6 +525,16 @@ struct VariableNode : ExpressionNode {
    */
   void markKnown() override;
 
+  /**
+   * @inheritdoc
+   */
+  void markSolved() override;
+
+  /**
+   * @inheritdoc
+   */
+  void markUnsolved() override;
+
   void getDiscontinuities(
       std::unordered_set<double*>& discontinuities) override;
   void getDiscontinuityError(std::vector<ExpressionNodePtr>& error) override;
@@ -435,6 +547,11 @@ struct VariableNode : ExpressionNode {
    * Is the value known or does this node represent an unknown
    */
   bool known;
+
+  /**
+   * Is the value known only because it was solved for
+   */
+  bool solved = false;
 };
 
 namespace expressionNode {
@@ -449,26 +566,36 @@ namespace expressionNode {
  * @return the value of the AST with `root` as a root
  */
 template <typename T>
-T evaluate(ExpressionNodePtr root, T const* parameters,
+T evaluate(const ExpressionNodePtr& root, T const* parameters,
            const ExpressionMap& map) {
-  if (std::shared_ptr<VariableNode> node =
-          std::dynamic_pointer_cast<VariableNode>(root)) {
-    return node->evaluateImplementation(parameters, map);
-  }
-  if (std::shared_ptr<BinaryOpNode> node =
-          std::dynamic_pointer_cast<BinaryOpNode>(root)) {
-    return node->evaluateImplementation(parameters, map);
-  }
-  if (std::shared_ptr<UnaryOpNode> node =
-          std::dynamic_pointer_cast<UnaryOpNode>(root)) {
-    return node->evaluateImplementation(parameters, map);
-  }
-  if (std::shared_ptr<TernaryOpNode> node =
-          std::dynamic_pointer_cast<TernaryOpNode>(root)) {
-    return node->evaluateImplementation(parameters, map);
+  switch (root->kind) {
+    case ExpressionNode::Kind::VARIABLE:
+      return static_cast<const VariableNode&>(*root).evaluateImplementation(
+          parameters, map);
+    case ExpressionNode::Kind::BINARY:
+      return static_cast<const BinaryOpNode&>(*root).evaluateImplementation(
+          parameters, map);
+    case ExpressionNode::Kind::UNARY:
+      return static_cast<const UnaryOpNode&>(*root).evaluateImplementation(
+          parameters, map);
+    case ExpressionNode::Kind::TERNARY:
+      return static_cast<const TernaryOpNode&>(*root).evaluateImplementation(
+          parameters, map);
   }
   return T();
 }
+
+/**
+ * Casts a node to its concrete type
+ * @return `node` as a `Node`, or null if it is a different kind of node.
+ * Unlike `std::dynamic_pointer_cast`, this is a single comparison and does not
+ * copy a reference to the node
+ */
+template <typename Node>
+Node* as(const ExpressionNodePtr& node) {
+  return node && node->kind == Node::kKind ? static_cast<Node*>(node.get())
+                                           : nullptr;
+}
 }  // namespace expressionNode
 
 std::ostream& operator<<(std::ostream& out, ExpressionNodePtr node);
@@ -0,0 +1,328 @@
+#include "expressionSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+ExpressionNodePtr ExpressionSimplifier::simplify(
+    const ExpressionNodePtr& root) {
+  roots.push_back(root);
+  countUses(root);
+  return build(root);
+}
+
+void ExpressionSimplifier::countUses(const ExpressionNodePtr& node) {
+  if (uses[node.get()]++ > 0) {
+    // The operands of the node were counted when it was first seen
+    return;
+  }
+  if (auto b = expressionNode::as<BinaryOpNode>(node)) {
+    countUses(b->lhs);
+    countUses(b->rhs);
+  } else if (auto u = expressionNode::as<UnaryOpNode>(node)) {
+    countUses(u->operand);
+  } else if (auto t = expressionNode::as<TernaryOpNode>(node)) {
+    countUses(t->condition->val);
+    countUses(t->valIfTrue);
+    countUses(t->valIfFalse);
+  }
+}
+
+ExpressionSimplifier::Entry& ExpressionSimplifier::get(
+    const ExpressionNodePtr& node) {
+  auto it = entries.find(node.get());
+  if (it != entries.end()) {
+    return it->second;
+  }
+  Sum sum = simplifyNode(node);
+  return entries[node.get()] = Entry{std::move(sum), nullptr};
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::simplifyNode(
+    const ExpressionNodePtr& node) {
+  if (auto v = expressionNode::as<VariableNode>(node)) {
+    if (v->known) {
+      Sum sum;
+      sum.constant = v->value;
+      sum.constantFromValues = true;
+      return sum;
+    }
+    return term(node);
+  }
+  if (auto b = expressionNode::as<BinaryOpNode>(node)) {
+    Sum lhs = operand(b->lhs);
+    Sum rhs = operand(b->rhs);
+    switch (b->op) {
+      case BinaryOp::ADD:
+        accumulate(lhs, rhs, 1);
+        return lhs;
+      case BinaryOp::SUB:
+        accumulate(lhs, rhs, -1);
+        return lhs;
+      case BinaryOp::MUL:
+        return multiply(lhs, rhs);
+      case BinaryOp::DIV:
+        return divide(lhs, rhs);
+    }
+  }
+  if (auto u = expressionNode::as<UnaryOpNode>(node)) {
+    Sum operandSum = operand(u->operand);
+    if (u->op == UnaryOp::NEG) {
+      Sum sum;
+      accumulate(sum, operandSum, -1);
+      return sum;
+    }
+    if (operandSum.terms.empty()) {
+      Sum sum;
+      sum.constant = std::exp(operandSum.constant);
+      sum.constantFromValues = operandSum.constantFromValues;
+      return sum;
+    }
+    return term(expressionNode::makeUnary(build(operandSum), UnaryOp::EXP));
+  }
+  if (auto t = expressionNode::as<TernaryOpNode>(node)) {
+    const Sum& condition = get(t->condition->val).sum;
+    if (condition.terms.empty()) {
+      // The constraint of the condition is still solved for by the residual
+      // of its discontinuity, which is compiled from the original tree
+      bool isTrue = t->condition->includeZero ? condition.constant >= 0
+                                              : condition.constant > 0;
+      return operand(isTrue ? t->valIfTrue : t->valIfFalse);
+    }
+    ExpressionNodePtr val = build(t->condition->val);
+    ExpressionNodePtr valIfTrue = build(t->valIfTrue);
+    ExpressionNodePtr valIfFalse = build(t->valIfFalse);
+    if (val == t->condition->val && valIfTrue == t->valIfTrue &&
+        valIfFalse == t->valIfFalse) {
+      return term(node);
+    }
+    std::shared_ptr<Condition> simplified = t->condition;
+    if (val != t->condition->val) {
+      // Keeps the constraint, so the discontinuity is the same unknown
+      simplified = expressionNode::make<Condition>(*t->condition);
+      simplified->val = val;
+    }
+    return term(expressionNode::make<TernaryOpNode>(simplified, valIfTrue,
+                                                    valIfFalse));
+  }
+  return term(node);
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::operand(
+    const ExpressionNodePtr& node) {
+  Entry& entry = get(node);
+  if (entry.sum.terms.size() > 1 && uses[node.get()] > 1) {
+    // Flattening a shared sum into every parent would repeat its additions
+    return term(build(node));
+  }
+  return entry.sum;
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::multiply(const Sum& lhs,
+                                                         const Sum& rhs) {
+  if (lhs.terms.empty()) {
+    return scale(rhs, lhs.constant, lhs.constantFromValues);
+  }
+  if (rhs.terms.empty()) {
+    return scale(lhs, rhs.constant, rhs.constantFromValues);
+  }
+  if (isSingleTerm(lhs) && isSingleTerm(rhs)) {
+    const Term& l = lhs.terms[0];
+    const Term& r = rhs.terms[0];
+    return term(makeCommutative(l.node, r.node, BinaryOp::MUL),
+                l.coefficient * r.coefficient, l.fromValues || r.fromValues);
+  }
+  return term(makeCommutative(build(lhs), build(rhs), BinaryOp::MUL));
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::divide(const Sum& lhs,
+                                                       const Sum& rhs) {
+  // Whether a known divisor is 0 does not change the structure
+  if (rhs.terms.empty() && (rhs.constantFromValues || rhs.constant != 0)) {
+    return scale(lhs, 1 / rhs.constant, rhs.constantFromValues);
+  }
+  if (isSingleTerm(lhs) && isSingleTerm(rhs)) {
+    const Term& l = lhs.terms[0];
+    const Term& r = rhs.terms[0];
+    double coefficient = l.coefficient / r.coefficient;
+    bool fromValues = l.fromValues || r.fromValues;
+    if (l.node == r.node) {
+      Sum quotient;
+      quotient.constant = coefficient;
+      quotient.constantFromValues = fromValues;
+      return quotient;
+    }
+    return term(expressionNode::makeBinary(l.node, r.node, BinaryOp::DIV),
+                coefficient, fromValues);
+  }
+  return term(expressionNode::makeBinary(build(lhs), build(rhs),
+                                         BinaryOp::DIV));
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::scale(const Sum& sum,
+                                                      double factor,
+                                                      bool factorFromValues) {
+  if (factorFromValues && sum.terms.size() > 1) {
+    // Distributing it would give each term a constant of its own
+    return term(build(sum), factor, true);
+  }
+  Sum scaled;
+  accumulate(scaled, sum, factor, factorFromValues);
+  return scaled;
+}
+
+ExpressionNodePtr ExpressionSimplifier::build(const ExpressionNodePtr& node) {
+  Entry& entry = get(node);
+  if (!entry.node) {
+    entry.node = build(entry.sum);
+  }
+  return entry.node;
+}
+
+ExpressionNodePtr ExpressionSimplifier::build(const Sum& sum) {
+  if (sum.terms.empty()) {
+    return constant(sum.constant, sum.constantFromValues);
+  }
+  std::vector<Term> terms = sum.terms;
+  std::stable_sort(terms.begin(), terms.end(),
+                   [this](const Term& a, const Term& b) {
+                     return rank(a.node) < rank(b.node);
+                   });
+  typedef std::vector<std::pair<ExpressionNodePtr, bool>> Items;
+  // The terms with each magnitude of coefficient, and whether each is negated.
+  // A coefficient from known values is a group of its own, with its sign
+  struct Group {
+    double coefficient;
+    bool fromValues;
+    Items items;
+  };
+  std::vector<Group> groups;
+  for (auto& entry : terms) {
+    if (entry.fromValues) {
+      groups.push_back({entry.coefficient, true, {{entry.node, false}}});
+      continue;
+    }
+    double magnitude = std::abs(entry.coefficient);
+    auto group = std::find_if(groups.begin(), groups.end(), [&](Group& g) {
+      return !g.fromValues && g.coefficient == magnitude;
+    });
+    if (group == groups.end()) {
+      groups.push_back({magnitude, false, Items()});
+      group = groups.end() - 1;
+    }
+    group->items.emplace_back(entry.node, entry.coefficient < 0);
+  }
+
+  // Adds up `items`, subtracting the negated ones. Returns whether the result
+  // is negated, which is only when every item is
+  auto combine = [](Items items, ExpressionNodePtr& result) {
+    std::stable_partition(items.begin(), items.end(),
+                          [](const auto& item) { return !item.second; });
+    bool negated = items[0].second;
+    result = items[0].first;
+    for (size_t i = 1; i < items.size(); i++) {
+      result = expressionNode::makeBinary(
+          result, items[i].first,
+          items[i].second == negated ? BinaryOp::ADD : BinaryOp::SUB);
+    }
+    return negated;
+  };
+
+  Items items;
+  for (auto& group : groups) {
+    ExpressionNodePtr node;
+    bool negated = combine(group.items, node);
+    if (group.fromValues || group.coefficient != 1) {
+      node = makeCommutative(constant(group.coefficient, group.fromValues),
+                             node, BinaryOp::MUL);
+    }
+    items.emplace_back(node, negated);
+  }
+  if (sum.constantFromValues && sum.constant != 0) {
+    items.emplace_back(constant(sum.constant, true), false);
+  } else if (sum.constant != 0) {
+    items.emplace_back(constant(std::abs(sum.constant)), sum.constant < 0);
+  }
+  ExpressionNodePtr result;
+  if (combine(items, result)) {
+    result = expressionNode::makeUnary(result, UnaryOp::NEG);
+  }
+  return result;
+}
+
+ExpressionNodePtr ExpressionSimplifier::makeCommutative(
+    const ExpressionNodePtr& lhs, const ExpressionNodePtr& rhs, BinaryOp op) {
+  if (rank(rhs) < rank(lhs)) {
+    return expressionNode::makeBinary(rhs, lhs, op);
+  }
+  return expressionNode::makeBinary(lhs, rhs, op);
+}
+
+ExpressionNodePtr ExpressionSimplifier::constant(double value,
+                                                 bool fromValues) {
+  if (fromValues) {
+    // Sharing it with an equal constant would make the structure depend on it
+    return expressionNode::make<VariableNode>(value);
+  }
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  ExpressionNodePtr& node = constants[bits];
+  if (!node) {
+    node = expressionNode::make<VariableNode>(value);
+  }
+  return node;
+}
+
+ExpressionSimplifier::Sum ExpressionSimplifier::term(
+    const ExpressionNodePtr& node, double coefficient, bool fromValues) {
+  rank(node);
+  Sum sum;
+  if (fromValues || coefficient != 0) {
+    sum.terms.push_back({node, coefficient, fromValues});
+  }
+  return sum;
+}
+
+bool ExpressionSimplifier::isSingleTerm(const Sum& sum) {
+  return sum.terms.size() == 1 && !sum.constantFromValues &&
+         sum.constant == 0;
+}
+
+size_t ExpressionSimplifier::rank(const ExpressionNodePtr& node) {
+  auto it = ranks.find(node.get());
+  if (it == ranks.end()) {
+    it = ranks.emplace(node.get(), std::make_pair(node, ranks.size())).first;
+  }
+  return it->second.second;
+}
+
+void ExpressionSimplifier::accumulate(Sum& into, const Sum& from,
+                                      double scale, bool scaleFromValues) {
+  // A constant that is 0 whatever the known values are adds nothing, even to
+  // an infinite scale
+  if (from.constantFromValues || from.constant != 0) {
+    into.constant += scale * from.constant;
+    into.constantFromValues |= from.constantFromValues || scaleFromValues;
+  }
+  for (auto& entry : from.terms) {
+    bool fromValues = entry.fromValues || scaleFromValues;
+    auto it = std::find_if(
+        into.terms.begin(), into.terms.end(),
+        [&](const Term& existing) { return existing.node == entry.node; });
+    if (it == into.terms.end()) {
+      into.terms.push_back(
+          {entry.node, scale * entry.coefficient, fromValues});
+    } else {
+      it->coefficient += scale * entry.coefficient;
+      it->fromValues |= fromValues;
+    }
+  }
+  // Only terms that cancel whatever the known values are can be dropped
+  into.terms.erase(std::remove_if(into.terms.begin(), into.terms.end(),
+                                  [](const Term& entry) {
+                                    return !entry.fromValues &&
+                                           entry.coefficient == 0;
+                                  }),
+                   into.terms.end());
+}
@@ -0,0 +1,168 @@
+#ifndef EXPRESSION_SIMPLIFIER_H
+#define EXPRESSION_SIMPLIFIER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "expressionNode.h"
+
+/**
+ * Rewrites expression DAGs into equivalent ones that take fewer operations to
+ * evaluate.
+ *
+ * Every chain of sums and differences is flattened into a constant plus a
+ * linear combination of terms that are not sums. Known values are folded into
+ * the constant, like terms are collected, and negation and division by a
+ * constant become coefficients. Products and quotients of single terms fold
+ * their coefficients together, and the operands of commutative operations are
+ * put in a canonical order so that hash-consing merges `a * b` and `b * a`.
+ *
+ * The structure of the result only depends on the structure of the DAG, not
+ * on the known values, so that `NativeCode` compiled for it is reused when
+ * they change. Coefficients that known values contribute to stay constants of
+ * their own, even when they are 0 or 1 or equal to another, and a sum scaled
+ * by one is multiplied once rather than term by term. The only exception is a
+ * known constant added to a sum, which is left out while it is 0.
+ *
+ * Known values are copied, so the result has to be simplified again after any
+ * of them change. Sums shared by several parents stay shared rather than being
+ * flattened into each of them. Results are remembered between calls, so one
+ * simplifier should be used for all of the residuals of a circuit.
+ */
+class ExpressionSimplifier {
+ public:
+  /**
+   * Simplifies the DAG with `root` as a root
+   * @return the root of a DAG with the same value for all values of the
+   * unknowns. It may depend on fewer unknowns than `root`
+   */
+  ExpressionNodePtr simplify(const ExpressionNodePtr& root);
+
+ private:
+  struct Term {
+    ExpressionNodePtr node;
+    double coefficient;
+    /**
+     * Whether a known value contributed to `coefficient`, rather than only
+     * the structure of the DAG
+     */
+    bool fromValues;
+  };
+
+  /**
+   * `constant + sum(coefficient * term)`, where no term is a known value, a
+   * sum, a difference or a negation
+   */
+  struct Sum {
+    double constant = 0;
+    /**
+     * Whether a known value contributed to `constant`
+     */
+    bool constantFromValues = false;
+    std::vector<Term> terms;
+  };
+
+  struct Entry {
+    Sum sum;
+    /**
+     * The node for `sum`, built the first time it is needed
+     */
+    ExpressionNodePtr node;
+  };
+
+  /**
+   * Counts the parents of each node in the DAG with `node` as a root
+   */
+  void countUses(const ExpressionNodePtr& node);
+
+  /**
+   * @return the simplified form of `node`
+   */
+  Entry& get(const ExpressionNodePtr& node);
+
+  Sum simplifyNode(const ExpressionNodePtr& node);
+
+  /**
+   * @return the simplified form of an operand, as a single term if it is a
+   * sum that other nodes also use
+   */
+  Sum operand(const ExpressionNodePtr& node);
+
+  Sum multiply(const Sum& lhs, const Sum& rhs);
+  Sum divide(const Sum& lhs, const Sum& rhs);
+
+  /**
+   * @return `factor * sum`
+   * @param factorFromValues whether a known value contributed to `factor`
+   */
+  Sum scale(const Sum& sum, double factor, bool factorFromValues);
+
+  /**
+   * @return the simplified node for `node`
+   */
+  ExpressionNodePtr build(const ExpressionNodePtr& node);
+
+  /**
+   * @return a node for `sum`, sharing one multiplication between the terms
+   * whose coefficients are equal up to sign and do not come from known values
+   */
+  ExpressionNodePtr build(const Sum& sum);
+
+  /**
+   * @return `lhs op rhs` for a commutative `op`, with the operands in
+   * canonical order
+   */
+  ExpressionNodePtr makeCommutative(const ExpressionNodePtr& lhs,
+                                    const ExpressionNodePtr& rhs, BinaryOp op);
+
+  /**
+   * @return the node for a constant, shared by every use of the value unless
+   * it comes from known values
+   */
+  ExpressionNodePtr constant(double value, bool fromValues = false);
+
+  Sum term(const ExpressionNodePtr& node, double coefficient = 1,
+           bool fromValues = false);
+
+  /**
+   * @return whether `sum` is one term with nothing added to it
+   */
+  static bool isSingleTerm(const Sum& sum);
+
+  /**
+   * @return the canonical position of a term, which is the order in which
+   * terms were first seen
+   */
+  size_t rank(const ExpressionNodePtr& node);
+
+  /**
+   * Adds `scale * from` to `into`
+   * @param scaleFromValues whether a known value contributed to `scale`
+   */
+  static void accumulate(Sum& into, const Sum& from, double scale,
+                         bool scaleFromValues = false);
+
+  /**
+   * The roots simplified so far, which keep every node in `uses` and
+   * `entries` from being freed and its address reused
+   */
+  std::vector<ExpressionNodePtr> roots;
+  std::unordered_map<const ExpressionNode*, size_t> uses;
+  std::unordered_map<const ExpressionNode*, Entry> entries;
+  /**
+   * The rank of each term, holding the term so that its address is not reused
+   */
+  std::unordered_map<const ExpressionNode*,
+                     std::pair<ExpressionNodePtr, size_t>>
+      ranks;
+  /**
+   * Constant nodes that no known value contributed to, by the bits of their
+   * value
+   */
+  std::unordered_map<uint64_t, ExpressionNodePtr> constants;
+};
+
+#endif  // EXPRESSION_SIMPLIFIER_H
@@ -0,0 +1,315 @@
+#include "expressionTape.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ExpressionTape::Compiler {
+ public:
+  explicit Compiler(ExpressionTape& tape) : tape(tape) {
+    for (size_t i = 0; i < tape.unknowns.size(); i++) {
+      slots[tape.unknowns[i]] = static_cast<uint32_t>(i);
+    }
+  }
+
+  /**
+   * Emits `root` and everything it depends on
+   * @return the register holding the value of `root`
+   */
+  uint32_t compileRoot(const ExpressionNodePtr& root) {
+    return materialize(compile(root));
+  }
+
+ private:
+  /**
+   * The result of compiling a node: a value known while compiling, or the
+   * register holding it at run time
+   */
+  struct Operand {
+    bool constant;
+    double value;
+    uint32_t reg;
+  };
+
+  uint32_t emit(OpCode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+    tape.instructions.push_back({op, {a, b, c}});
+    return static_cast<uint32_t>(tape.instructions.size() - 1);
+  }
+
+  uint32_t materialize(const Operand& operand) {
+    if (!operand.constant) {
+      return operand.reg;
+    }
+    tape.constants.push_back(operand.value);
+    return emit(OpCode::CONSTANT,
+                static_cast<uint32_t>(tape.constants.size() - 1));
+  }
+
+  Operand compile(const ExpressionNodePtr& node) {
+    // Subtrees shared between several parents are only emitted once
+    auto it = compiled.find(node.get());
+    if (it != compiled.end()) {
+      return it->second;
+    }
+    Operand result = compileNode(node);
+    compiled[node.get()] = result;
+    return result;
+  }
+
+  Operand compileNode(const ExpressionNodePtr& node) {
+    if (auto v = expressionNode::as<VariableNode>(node)) {
+      if (v->known) {
+        return {true, v->value, 0};
+      }
+      auto it = parameters.find(&v->value);
+      if (it == parameters.end()) {
+        uint32_t reg = emit(OpCode::PARAMETER, slots.at(&v->value));
+        it = parameters.emplace(&v->value, reg).first;
+      }
+      return {false, 0, it->second};
+    }
+    if (auto b = expressionNode::as<BinaryOpNode>(node)) {
+      Operand lhs = compile(b->lhs);
+      Operand rhs = compile(b->rhs);
+      if (lhs.constant && rhs.constant) {
+        return {true, fold(b->op, lhs.value, rhs.value), 0};
+      }
+      uint32_t a = materialize(lhs);
+      uint32_t c = materialize(rhs);
+      switch (b->op) {
+        case BinaryOp::MUL:
+          return {false, 0, emit(OpCode::MUL, a, c)};
+        case BinaryOp::DIV:
+          return {false, 0, emit(OpCode::DIV, a, c)};
+        case BinaryOp::ADD:
+          return {false, 0, emit(OpCode::ADD, a, c)};
+        case BinaryOp::SUB:
+          return {false, 0, emit(OpCode::SUB, a, c)};
+      }
+    }
+    if (auto u = expressionNode::as<UnaryOpNode>(node)) {
+      Operand operand = compile(u->operand);
+      if (operand.constant) {
+        double value = u->op == UnaryOp::EXP ? std::exp(operand.value)
+                                             : -operand.value;
+        return {true, value, 0};
+      }
+      OpCode op = u->op == UnaryOp::EXP ? OpCode::EXP : OpCode::NEG;
+      return {false, 0, emit(op, operand.reg)};
+    }
+    if (auto t = expressionNode::as<TernaryOpNode>(node)) {
+      Operand condition = compile(t->condition->val);
+      if (condition.constant) {
+        bool isTrue = t->condition->includeZero ? condition.value >= 0
+                                                : condition.value > 0;
+        return compile(isTrue ? t->valIfTrue : t->valIfFalse);
+      }
+      uint32_t valIfTrue = materialize(compile(t->valIfTrue));
+      uint32_t valIfFalse = materialize(compile(t->valIfFalse));
+      OpCode op = t->condition->includeZero ? OpCode::SELECT_GEQ
+                                            : OpCode::SELECT_GT;
+      return {false, 0, emit(op, condition.reg, valIfTrue, valIfFalse)};
+    }
+    return {true, 0, 0};
+  }
+
+  static double fold(BinaryOp op, double lhs, double rhs) {
+    switch (op) {
+      case BinaryOp::MUL:
+        return lhs * rhs;
+      case BinaryOp::DIV:
+        return lhs / rhs;
+      case BinaryOp::ADD:
+        return lhs + rhs;
+      case BinaryOp::SUB:
+        return lhs - rhs;
+    }
+    return 0;
+  }
+
+  ExpressionTape& tape;
+  std::unordered_map<const double*, uint32_t> slots;
+  /**
+   * The register each unknown was loaded into
+   */
+  std::unordered_map<const double*, uint32_t> parameters;
+  std::unordered_map<const ExpressionNode*, Operand> compiled;
+};
+
+ExpressionTape::ExpressionTape(const ExpressionNodePtr& root,
+                               std::vector<double*> unknowns)
+    : ExpressionTape(std::vector<ExpressionNodePtr>{root},
+                     std::move(unknowns)) {}
+
+ExpressionTape::ExpressionTape(const std::vector<ExpressionNodePtr>& roots,
+                               std::vector<double*> unknowns)
+    : unknowns(std::move(unknowns)) {
+  // One compiler for every root, so that shared subtrees are emitted once
+  Compiler compiler(*this);
+  for (auto& root : roots) {
+    results.push_back(compiler.compileRoot(root));
+  }
+}
+
+namespace {
+
+/**
+ * The number of parameter sets in a `Pack`: one AVX-512 register, two AVX2
+ * registers or four SSE2 registers
+ */
+constexpr size_t kPackLanes = 8;
+
+// Only aligned as a double is, so that every clone of `runBatch` agrees on
+// the layout and packs can be loaded from any array of doubles
+typedef double Pack __attribute__((vector_size(kPackLanes * sizeof(double)),
+                                   aligned(sizeof(double))));
+typedef int64_t IntPack
+    __attribute__((vector_size(kPackLanes * sizeof(int64_t)),
+                   aligned(sizeof(int64_t))));
+
+/**
+ * The number of packs `evaluateBatch` runs each instruction over at a time,
+ * chosen so that the registers of a typical residual stay in cache
+ */
+constexpr size_t kBatchPacks = 4;
+constexpr size_t kBatchLanes = kBatchPacks * kPackLanes;
+
+#if defined(__has_attribute)
+#if __has_attribute(always_inline)
+// Inlined into each clone of `runBatch`, so that it uses the same instructions
+#define EXP_INLINE inline __attribute__((always_inline))
+#endif
+#endif
+#ifndef EXP_INLINE
+#define EXP_INLINE inline
+#endif
+
+/**
+ * Sets each lane of `x` to e^x, to within a few ulp. NaN passes through
+ */
+EXP_INLINE void expPack(Pack& x) {
+  // Adding 1.5 * 2^52 rounds to an integer held in the low bits of the sum
+  const Pack kRound = Pack{} + 6755399441055744.0;
+  // ln 2 split so that k * kLn2High is exact for every k in range
+  constexpr double kLn2High = 6.93147180369123816490e-01;
+  constexpr double kLn2Low = 1.90821492927058770002e-10;
+  // Beyond these the result is infinite or zero
+  x = x < -745.2 ? Pack{} - 745.2 : x;
+  x = x > 709.8 ? Pack{} + 709.8 : x;
+  Pack shifted = x * 1.4426950408889634 + kRound;
+  Pack k = shifted - kRound;
+  // e^x = 2^k e^r with |r| <= ln(2) / 2
+  Pack r = (x - k * kLn2High) - k * kLn2Low;
+  Pack p = Pack{} + 1.0 / 6227020800;
+  p = p * r + 1.0 / 479001600;
+  p = p * r + 1.0 / 39916800;
+  p = p * r + 1.0 / 3628800;
+  p = p * r + 1.0 / 362880;
+  p = p * r + 1.0 / 40320;
+  p = p * r + 1.0 / 5040;
+  p = p * r + 1.0 / 720;
+  p = p * r + 1.0 / 120;
+  p = p * r + 1.0 / 24;
+  p = p * r + 1.0 / 6;
+  p = p * r + 0.5;
+  p = p * r + 1;
+  p = p * r + 1;
+  // 2^k is applied as two halves, since k can be outside the exponent range
+  IntPack n = reinterpret_cast<IntPack>(shifted) -
+              reinterpret_cast<IntPack>(kRound);
+  IntPack half = n >> 1;
+  Pack low = reinterpret_cast<Pack>((half + 1023) << 52);
+  Pack high = reinterpret_cast<Pack>((n - half + 1023) << 52);
+  x = p * low * high;
+}
+
+#if defined(__x86_64__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+// Compiled for each instruction set, and picked when the program is loaded
+#define BATCH_TARGETS \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef BATCH_TARGETS
+#define BATCH_TARGETS
+#endif
+
+/**
+ * Runs a tape over `kBatchLanes` parameter sets, of which the first `lanes`
+ * start at `offset` in `parameters` and the rest are zero. Register i of the
+ * sets is `registers[i * kBatchPacks]` to `registers[(i + 1) * kBatchPacks]`
+ */
+BATCH_TARGETS void runBatch(const ExpressionTape::Instruction* instructions,
+                            size_t numInstructions, const double* constants,
+                            double const* const* parameters, size_t offset,
+                            size_t lanes, Pack* registers) {
+  typedef ExpressionTape::OpCode OpCode;
+  for (size_t i = 0; i < numInstructions; i++) {
+    const uint32_t* args = instructions[i].args;
+    Pack* out = registers + i * kBatchPacks;
+    const Pack* a = registers + args[0] * kBatchPacks;
+    const Pack* b = registers + args[1] * kBatchPacks;
+    const Pack* c = registers + args[2] * kBatchPacks;
+    for (size_t p = 0; p < kBatchPacks; p++) {
+      switch (instructions[i].op) {
+        case OpCode::CONSTANT:
+          out[p] = Pack{} + constants[args[0]];
+          break;
+        case OpCode::PARAMETER:
+          out[p] = Pack{};
+          if (p * kPackLanes < lanes) {
+            std::memcpy(&out[p], parameters[args[0]] + offset + p * kPackLanes,
+                        std::min(kPackLanes, lanes - p * kPackLanes) *
+                            sizeof(double));
+          }
+          break;
+        case OpCode::ADD:
+          out[p] = a[p] + b[p];
+          break;
+        case OpCode::SUB:
+          out[p] = a[p] - b[p];
+          break;
+        case OpCode::MUL:
+          out[p] = a[p] * b[p];
+          break;
+        case OpCode::DIV:
+          out[p] = a[p] / b[p];
+          break;
+        case OpCode::NEG:
+          out[p] = -a[p];
+          break;
+        case OpCode::EXP:
+          out[p] = a[p];
+          expPack(out[p]);
+          break;
+        case OpCode::SELECT_GT:
+          out[p] = a[p] > 0 ? b[p] : c[p];
+          break;
+        case OpCode::SELECT_GEQ:
+          out[p] = a[p] >= 0 ? b[p] : c[p];
+          break;
+      }
+    }
+  }
+}
+}  // namespace
+
+void ExpressionTape::evaluateBatch(double const* const* parameters,
+                                   size_t count, double* outputs) const {
+  if (instructions.empty()) {
+    std::fill(outputs, outputs + count, 0.0);
+    return;
+  }
+  size_t end = results[0] + 1;
+  std::vector<double> registers(end * kBatchLanes);
+  Pack* packs = reinterpret_cast<Pack*>(registers.data());
+  for (size_t offset = 0; offset < count; offset += kBatchLanes) {
+    size_t lanes = std::min(kBatchLanes, count - offset);
+    runBatch(instructions.data(), end, constants.data(), parameters, offset,
+             lanes, packs);
+    std::copy_n(registers.data() + results[0] * kBatchLanes, lanes,
+                outputs + offset);
+  }
+}
@@ -0,0 +1,228 @@
+#ifndef EXPRESSION_TAPE_H
+#define EXPRESSION_TAPE_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "expressionNode.h"
+
+/**
+ * An `Expression` compiled into a flat list of instructions, for evaluating it
+ * many times without walking its tree.
+ *
+ * Instruction i writes register i and reads only registers written before it,
+ * so the tape is evaluated with one pass over contiguous memory and no dynamic
+ * dispatch. Each unknown is resolved to an integer slot when compiling, and
+ * known values and conditions are folded into constants.
+ *
+ * The tape copies known values when it is compiled, so it has to be compiled
+ * again after any of them change.
+ */
+class ExpressionTape {
+ public:
+  /**
+   * The operation of an instruction
+   */
+  enum class OpCode : uint8_t {
+    /**
+     * Loads `constants[args[0]]`
+     */
+    CONSTANT,
+    /**
+     * Loads the unknown in slot `args[0]`
+     */
+    PARAMETER,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    NEG,
+    EXP,
+    /**
+     * Picks register `args[1]` if register `args[0]` is greater than zero,
+     * otherwise register `args[2]`
+     */
+    SELECT_GT,
+    /**
+     * As `SELECT_GT`, but also picks `args[1]` if register `args[0]` is zero
+     */
+    SELECT_GEQ,
+  };
+
+  struct Instruction {
+    OpCode op;
+    /**
+     * The registers of the operands, or the index of the constant or slot to
+     * load
+     */
+    uint32_t args[3];
+  };
+
+  /**
+   * Creates an empty tape that evaluates to 0
+   */
+  ExpressionTape() = default;
+
+  /**
+   * Compiles the AST with `root` as a root
+   * @param unknowns the unknowns of the AST. The unknown at index i is given to
+   * `evaluate` in slot i. Unknowns that compiling folds away keep their slot
+   */
+  ExpressionTape(const ExpressionNodePtr& root, std::vector<double*> unknowns);
+
+  /**
+   * Compiles several ASTs into one tape with one output per AST. Subtrees they
+   * share are only evaluated once, and every instruction the first k outputs
+   * depend on comes before any instruction that only later outputs need
+   * @param roots the roots of the ASTs, in the order of the outputs
+   * @param unknowns the unknowns of the ASTs, as for a single AST
+   */
+  ExpressionTape(const std::vector<ExpressionNodePtr>& roots,
+                 std::vector<double*> unknowns);
+
+  /**
+   * Evaluates the first output of the tape.
+   * Note that this is templated so that `ceres` can do automatic
+   * differentiation
+   * @param parameters one block of size 1 per slot, as `ceres` passes them to
+   * a cost function
+   * @return the value of the compiled expression
+   */
+  template <typename T>
+  T evaluate(T const* const* parameters) const {
+    T output;
+    evaluate(parameters, &output, 1);
+    return output;
+  }
+
+  /**
+   * Evaluates the first `numOutputs` outputs of the tape, running only the
+   * instructions that they depend on
+   * @param parameters one block of size 1 per slot
+   * @param outputs set to the values of the outputs
+   * @param numOutputs the number of outputs to evaluate, at most
+   * `getNumOutputs`
+   */
+  template <typename T>
+  void evaluate(T const* const* parameters, T* outputs,
+                size_t numOutputs) const {
+    using std::exp;
+    if (instructions.empty()) {
+      std::fill(outputs, outputs + numOutputs, T(0.0));
+      return;
+    }
+    size_t end = 0;
+    for (size_t k = 0; k < numOutputs; k++) {
+      end = std::max<size_t>(end, results[k] + 1);
+    }
+    std::array<T, kStackRegisters> stackRegisters;
+    std::vector<T> heapRegisters;
+    T* registers = stackRegisters.data();
+    if (end > kStackRegisters) {
+      heapRegisters.resize(end);
+      registers = heapRegisters.data();
+    }
+    for (size_t i = 0; i < end; i++) {
+      const uint32_t* args = instructions[i].args;
+      switch (instructions[i].op) {
+        case OpCode::CONSTANT:
+          registers[i] = T(constants[args[0]]);
+          break;
+        case OpCode::PARAMETER:
+          registers[i] = parameters[args[0]][0];
+          break;
+        case OpCode::ADD:
+          registers[i] = registers[args[0]] + registers[args[1]];
+          break;
+        case OpCode::SUB:
+          registers[i] = registers[args[0]] - registers[args[1]];
+          break;
+        case OpCode::MUL:
+          registers[i] = registers[args[0]] * registers[args[1]];
+          break;
+        case OpCode::DIV:
+          registers[i] = registers[args[0]] / registers[args[1]];
+          break;
+        case OpCode::NEG:
+          registers[i] = -registers[args[0]];
+          break;
+        case OpCode::EXP:
+          registers[i] = exp(registers[args[0]]);
+          break;
+        case OpCode::SELECT_GT:
+          registers[i] = registers[args[registers[args[0]] > 0 ? 1 : 2]];
+          break;
+        case OpCode::SELECT_GEQ:
+          registers[i] = registers[args[registers[args[0]] >= 0 ? 1 : 2]];
+          break;
+      }
+    }
+    for (size_t k = 0; k < numOutputs; k++) {
+      outputs[k] = registers[results[k]];
+    }
+  }
+
+  /**
+   * Evaluates the first output of the tape for many sets of parameters at
+   * once. Each instruction is run across every set before the next, using the
+   * widest vector instructions the processor supports, including for `EXP`
+   * @param parameters one array of `count` values per slot, so that set j
+   * gives slot i the value `parameters[i][j]`
+   * @param count the number of sets of parameters
+   * @param outputs set to the value of the tape for each set
+   */
+  void evaluateBatch(double const* const* parameters, size_t count,
+                     double* outputs) const;
+
+  /**
+   * @return the number of ASTs compiled into the tape
+   */
+  size_t getNumOutputs() const { return results.size(); }
+
+  /**
+   * @return the unknowns of the compiled expression, in slot order
+   */
+  const std::vector<double*>& getUnknowns() const { return unknowns; }
+
+  /**
+   * @return the instructions of the tape, in the order they are run
+   */
+  const std::vector<Instruction>& getInstructions() const {
+    return instructions;
+  }
+
+  /**
+   * @return the values loaded by `CONSTANT` instructions
+   */
+  const std::vector<double>& getConstants() const { return constants; }
+
+  /**
+   * @return the register holding each output
+   */
+  const std::vector<uint32_t>& getResults() const { return results; }
+
+ private:
+  /**
+   * Most residuals fit in this many registers, which are then kept on the
+   * stack
+   */
+  static constexpr size_t kStackRegisters = 64;
+
+  /**
+   * Emits the instructions of an AST onto a tape
+   */
+  class Compiler;
+
+  std::vector<Instruction> instructions;
+  std::vector<double> constants;
+  std::vector<double*> unknowns;
+  /**
+   * The register holding each output
+   */
+  std::vector<uint32_t> results;
+};
+
+#endif  // EXPRESSION_TAPE_H
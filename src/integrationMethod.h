@@ -0,0 +1,21 @@
+#ifndef INTEGRATION_METHOD_H
+#define INTEGRATION_METHOD_H
+
+/**
+ * How capacitors and inductors turn their derivatives into a companion model
+ * over a time step
+ */
+enum class IntegrationMethod {
+  /**
+   * First order and L-stable: the derivative at the end of the step is taken
+   * as the slope across it. Damps ringing, at the cost of some accuracy
+   */
+  BACKWARD_EULER,
+  /**
+   * Second order: the mean of the derivatives at both ends of the step is
+   * taken as the slope across it
+   */
+  TRAPEZOIDAL,
+};
+
+#endif  // INTEGRATION_METHOD_H
@@ -0,0 +1,107 @@
+#include "lcpSolver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+
+constexpr double pivotTolerance = 1e-12;
+
+void pivot(Eigen::MatrixXd& tableau, Eigen::Index row, Eigen::Index col) {
+  tableau.row(row) /= tableau(row, col);
+  for (Eigen::Index i = 0; i < tableau.rows(); i++) {
+    if (i != row && tableau(i, col) != 0) {
+      tableau.row(i) -= tableau(i, col) * tableau.row(row);
+    }
+  }
+}
+
+/**
+ * Chooses the row that leaves the basis when `col` enters it, using the
+ * lexicographic minimum ratio rule so that degenerate problems do not cycle.
+ *
+ * @return the leaving row or -1 if `col` is unbounded (a secondary ray)
+ */
+Eigen::Index leavingRow(const Eigen::MatrixXd& tableau, Eigen::Index col,
+                        Eigen::Index rhsCol, Eigen::Index artificialCol,
+                        const std::vector<Eigen::Index>& basis) {
+  const Eigen::Index n = tableau.rows();
+  Eigen::Index best = -1;
+  for (Eigen::Index i = 0; i < n; i++) {
+    if (tableau(i, col) <= pivotTolerance) continue;
+    if (best == -1) {
+      best = i;
+      continue;
+    }
+    // Compare (rhs, w_0, ..., w_n-1) / pivot element lexicographically
+    double difference = tableau(i, rhsCol) / tableau(i, col) -
+                        tableau(best, rhsCol) / tableau(best, col);
+    for (Eigen::Index j = 0; j < n && std::abs(difference) <= 1e-12; j++) {
+      difference = tableau(i, j) / tableau(i, col) -
+                   tableau(best, j) / tableau(best, col);
+    }
+    if (difference < -1e-12) {
+      best = i;
+    } else if (std::abs(difference) <= 1e-12 && basis[i] == artificialCol) {
+      // Prefer to finish as soon as the artificial variable can leave
+      best = i;
+    }
+  }
+  return best;
+}
+
+}  // namespace
+
+bool solveLcp(const Eigen::MatrixXd& M, const Eigen::VectorXd& q,
+              Eigen::VectorXd& z) {
+  const Eigen::Index n = q.size();
+  z = Eigen::VectorXd::Zero(n);
+  if (n == 0 || q.minCoeff() >= 0) {
+    // The trivial solution z = 0, w = q is feasible
+    return true;
+  }
+
+  // Columns: w (n), z (n), the artificial variable z0, and the right hand side
+  const Eigen::Index artificialCol = 2 * n;
+  const Eigen::Index rhsCol = 2 * n + 1;
+  Eigen::MatrixXd tableau(n, 2 * n + 2);
+  tableau.leftCols(n).setIdentity();
+  tableau.middleCols(n, n) = -M;
+  tableau.col(artificialCol).setConstant(-1);
+  tableau.col(rhsCol) = q;
+
+  std::vector<Eigen::Index> basis(n);
+  for (Eigen::Index i = 0; i < n; i++) {
+    basis[i] = i;
+  }
+
+  // The artificial variable enters in place of the most infeasible w
+  Eigen::Index row;
+  q.minCoeff(&row);
+  pivot(tableau, row, artificialCol);
+  Eigen::Index leaving = basis[row];
+  basis[row] = artificialCol;
+
+  const long maxPivots = 50 * static_cast<long>(n) + 100;
+  for (long pivots = 0; pivots < maxPivots; pivots++) {
+    // The complement of the variable that just left enters the basis
+    Eigen::Index entering = leaving < n ? leaving + n : leaving - n;
+    row = leavingRow(tableau, entering, rhsCol, artificialCol, basis);
+    if (row == -1) {
+      return false;
+    }
+    pivot(tableau, row, entering);
+    leaving = basis[row];
+    basis[row] = entering;
+    if (leaving == artificialCol) {
+      for (Eigen::Index i = 0; i < n; i++) {
+        if (basis[i] >= n && basis[i] < 2 * n) {
+          z[basis[i] - n] = std::max(0.0, tableau(i, rhsCol));
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
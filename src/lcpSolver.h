@@ -0,0 +1,25 @@
+#ifndef LCP_SOLVER_H
+#define LCP_SOLVER_H
+
+#include <Eigen/Dense>
+
+/**
+ * Solves the linear complementarity problem
+ *
+ *   w = q + M z,  w >= 0,  z >= 0,  w_i z_i = 0 for all i
+ *
+ * with Lemke's complementary pivoting algorithm. For the P-matrices and
+ * positive semi-definite matrices that come from passive networks this
+ * terminates after a number of pivots that grows polynomially with the size
+ * of the problem in practice.
+ *
+ * @param M the square matrix of the problem
+ * @param q the constant vector of the problem
+ * @param z set to the solution on success
+ * @return true if a solution was found, false if the algorithm terminated on
+ * a secondary ray (no solution exists) or ran out of pivots
+ */
+bool solveLcp(const Eigen::MatrixXd& M, const Eigen::VectorXd& q,
+              Eigen::VectorXd& z);
+
+#endif  // LCP_SOLVER_H
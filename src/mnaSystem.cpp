@@ -0,0 +1,314 @@
+#include "mnaSystem.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <optional>
+
+#include "lcpSolver.h"
+
+// Conductance from every node to 0V used when the system has ideal diodes.
+// Nodes that are only connected through diodes would otherwise make the
+// linear part of the system singular
+static constexpr double gmin = 1e-12;
+
+MnaSystem::MnaSystem(const VertexMap& vertices) : numNodes(0) {
+  nodeIndices.reserve(vertices.size());
+  for (auto& entry : vertices) {
+    Expression voltage = entry.second->getVoltage();
+    if (voltage.isConstant() && !voltage.isSolved()) {
+      knownVoltages[entry.first] = voltage.evaluate();
+    } else {
+      nodeIndices[entry.first] = numNodes++;
+    }
+  }
+  rhs.resize(numNodes);
+  solution = Eigen::VectorXd::Zero(numNodes);
+}
+
+long MnaSystem::getNode(const Vertex& v) const {
+  auto it = nodeIndices.find(v.getId());
+  if (it == nodeIndices.end()) {
+    return -1;
+  }
+  return static_cast<long>(it->second);
+}
+
+double MnaSystem::getKnownVoltage(const Vertex& v) const {
+  return knownVoltages.at(v.getId());
+}
+
+void MnaSystem::addEntry(long row, long col, double value) {
+  if (row < 0 || col < 0) return;
+  entries.push_back({static_cast<size_t>(row), static_cast<size_t>(col), value});
+}
+
+void MnaSystem::stampConductance(const Vertex& from, const Vertex& to,
+                                 double conductance) {
+  long a = getNode(from);
+  long b = getNode(to);
+  addEntry(a, a, conductance);
+  addEntry(b, b, conductance);
+  addEntry(a, b, -conductance);
+  addEntry(b, a, -conductance);
+  // Known voltages move to the right hand side
+  if (a >= 0 && b < 0) {
+    rhs[a] += conductance * getKnownVoltage(to);
+  }
+  if (b >= 0 && a < 0) {
+    rhs[b] += conductance * getKnownVoltage(from);
+  }
+}
+
+void MnaSystem::stampCurrent(const Vertex& from, const Vertex& to,
+                             double current) {
+  long a = getNode(from);
+  long b = getNode(to);
+  // Each node row is the sum of the currents leaving that node
+  if (a >= 0) rhs[a] -= current;
+  if (b >= 0) rhs[b] += current;
+}
+
+size_t MnaSystem::stampVoltageSource(const Vertex& from, const Vertex& to,
+                                     double voltage) {
+  long a = getNode(from);
+  long b = getNode(to);
+  size_t index = numVoltageSources++;
+  long row = static_cast<long>(numNodes + index);
+  rhs.push_back(voltage);
+  // The source current leaves `from` and enters `to`
+  addEntry(a, row, 1);
+  addEntry(b, row, -1);
+  // v(to) - v(from) = voltage
+  addEntry(row, b, 1);
+  addEntry(row, a, -1);
+  if (b < 0) rhs[row] -= getKnownVoltage(to);
+  if (a < 0) rhs[row] += getKnownVoltage(from);
+  return index;
+}
+
+size_t MnaSystem::stampIdealDiode(const Vertex& from, const Vertex& to) {
+  Diode diode{getNode(from), getNode(to), 0};
+  if (diode.from < 0) diode.knownVoltage += getKnownVoltage(from);
+  if (diode.to < 0) diode.knownVoltage -= getKnownVoltage(to);
+  diodes.push_back(diode);
+  return diodes.size() - 1;
+}
+
+void MnaSystem::markNonlinear(bool limited) {
+  nonlinear = true;
+  this->limited = this->limited || limited;
+}
+
+void MnaSystem::setInitialGuess(const Vertex& v, double voltage) {
+  long node = getNode(v);
+  if (node >= 0) {
+    solution[node] = voltage;
+    guessed = true;
+  }
+}
+
+bool MnaSystem::hasEstimate() const { return iteration > 0 || guessed; }
+
+void MnaSystem::restart() {
+  guessed = hasEstimate();
+  iteration = 0;
+}
+
+void MnaSystem::clear() {
+  entries.clear();
+  rhs.assign(numNodes, 0);
+  diodes.clear();
+  numVoltageSources = 0;
+  nonlinear = false;
+  limited = false;
+}
+
+void MnaSystem::setTimeStep(double step, IntegrationMethod method) {
+  timeStep = step;
+  integrationMethod = method;
+}
+
+double MnaSystem::getTimeStep() const { return timeStep; }
+
+IntegrationMethod MnaSystem::getIntegrationMethod() const {
+  return integrationMethod;
+}
+
+bool MnaSystem::factorize(const SparseMatrix& matrix) {
+  bool wasSymmetric = symmetric;
+  symmetric = numVoltageSources == 0;
+  const int* outer = matrix.outerIndexPtr();
+  const int* inner = matrix.innerIndexPtr();
+  bool samePattern =
+      symmetric == wasSymmetric &&
+      outerPattern.size() == static_cast<size_t>(matrix.outerSize() + 1) &&
+      innerPattern.size() == static_cast<size_t>(matrix.nonZeros()) &&
+      std::equal(outerPattern.begin(), outerPattern.end(), outer) &&
+      std::equal(innerPattern.begin(), innerPattern.end(), inner);
+  const double* values = matrix.valuePtr();
+  // Only a successful factorisation leaves its values behind
+  if (samePattern && !factorizedValues.empty() &&
+      factorizedValues.size() == static_cast<size_t>(matrix.nonZeros()) &&
+      std::equal(factorizedValues.begin(), factorizedValues.end(), values)) {
+    return true;
+  }
+  factorizedValues.clear();
+  if (!samePattern) {
+    outerPattern.assign(outer, outer + matrix.outerSize() + 1);
+    innerPattern.assign(inner, inner + matrix.nonZeros());
+    if (symmetric) {
+      cholesky.analyzePattern(matrix);
+    } else {
+      lu.analyzePattern(matrix);
+    }
+  }
+  factorizations++;
+  if (symmetric) {
+    cholesky.factorize(matrix);
+    if (cholesky.info() != Eigen::Success) return false;
+    // A node without a path to a known voltage shows up as a zero pivot
+    const Eigen::VectorXd& pivots = cholesky.vectorD();
+    if (pivots.size() > 0 &&
+        pivots.minCoeff() <= 1e-14 * pivots.cwiseAbs().maxCoeff()) {
+      return false;
+    }
+  } else {
+    lu.factorize(matrix);
+    if (lu.info() != Eigen::Success) return false;
+  }
+  factorizedValues.assign(values, values + matrix.nonZeros());
+  return true;
+}
+
+Eigen::MatrixXd MnaSystem::solveFactorized(const Eigen::MatrixXd& rhs) const {
+  if (symmetric) {
+    return cholesky.solve(rhs);
+  }
+  return lu.solve(rhs);
+}
+
+bool MnaSystem::solve() {
+  const Eigen::Index size = static_cast<Eigen::Index>(rhs.size());
+  const Eigen::Index numDiodes = static_cast<Eigen::Index>(diodes.size());
+  std::vector<Eigen::Triplet<double>> triplets;
+  triplets.reserve(entries.size() + (numDiodes > 0 ? numNodes : 0));
+  for (auto& entry : entries) {
+    triplets.emplace_back(entry.row, entry.col, entry.value);
+  }
+  if (numDiodes > 0) {
+    for (size_t i = 0; i < numNodes; i++) {
+      triplets.emplace_back(i, i, gmin);
+    }
+  }
+  SparseMatrix A(size, size);
+  A.setFromTriplets(triplets.begin(), triplets.end());
+  Eigen::VectorXd b = Eigen::Map<Eigen::VectorXd>(rhs.data(), size);
+
+  iteration++;
+  if (!factorize(A)) {
+    return false;
+  }
+  previousSolution = std::move(solution);
+  solution = solveFactorized(b);
+  if (!solution.allFinite()) {
+    return false;
+  }
+  diodeCurrents = Eigen::VectorXd::Zero(numDiodes);
+  if (numDiodes == 0) {
+    return true;
+  }
+
+  // With the diode currents z injected into the network, x = x0 - Y z, so the
+  // diode voltages are affine in z. The reverse voltages w = -v must satisfy
+  // w = q + M z with w >= 0, z >= 0 and w^T z = 0
+  Eigen::MatrixXd incidence = Eigen::MatrixXd::Zero(size, numDiodes);
+  Eigen::VectorXd knownVoltage(numDiodes);
+  for (Eigen::Index j = 0; j < numDiodes; j++) {
+    if (diodes[j].from >= 0) incidence(diodes[j].from, j) += 1;
+    if (diodes[j].to >= 0) incidence(diodes[j].to, j) -= 1;
+    knownVoltage[j] = diodes[j].knownVoltage;
+  }
+  Eigen::MatrixXd Y = solveFactorized(incidence);
+  Eigen::MatrixXd M = incidence.transpose() * Y;
+  Eigen::VectorXd q = -(incidence.transpose() * solution + knownVoltage);
+  if (!solveLcp(M, q, diodeCurrents)) {
+    return false;
+  }
+  solution -= Y * diodeCurrents;
+
+  // A conducting diode has exactly zero voltage across it; remove the
+  // round-off so that both ends agree on which side of the discontinuity
+  // they are
+  std::vector<size_t> parent(numNodes);
+  std::iota(parent.begin(), parent.end(), 0);
+  auto find = [&parent](size_t i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  };
+  std::vector<std::optional<double>> fixedVoltage(numNodes);
+  for (Eigen::Index j = 0; j < numDiodes; j++) {
+    if (diodeCurrents[j] <= 0) continue;
+    const Diode& diode = diodes[j];
+    if (diode.from >= 0 && diode.to >= 0) {
+      size_t a = find(diode.from);
+      size_t b = find(diode.to);
+      if (a != b) {
+        parent[a] = b;
+        if (fixedVoltage[a]) fixedVoltage[b] = fixedVoltage[a];
+      }
+    } else if (diode.from >= 0) {
+      fixedVoltage[find(diode.from)] = diode.knownVoltage;
+    } else if (diode.to >= 0) {
+      fixedVoltage[find(diode.to)] = -diode.knownVoltage;
+    }
+  }
+  std::vector<double> groupSum(numNodes, 0);
+  std::vector<size_t> groupSize(numNodes, 0);
+  for (size_t i = 0; i < numNodes; i++) {
+    groupSum[find(i)] += solution[i];
+    groupSize[find(i)]++;
+  }
+  for (size_t i = 0; i < numNodes; i++) {
+    size_t group = find(i);
+    if (groupSize[group] == 1 && !fixedVoltage[group]) continue;
+    solution[i] = fixedVoltage[group].value_or(groupSum[group] /
+                                               groupSize[group]);
+  }
+  return true;
+}
+
+size_t MnaSystem::getIteration() const { return iteration; }
+
+size_t MnaSystem::getFactorizations() const { return factorizations; }
+
+bool MnaSystem::hasConverged(double tolerance) const {
+  if (!nonlinear) return true;
+  if (limited || (iteration < 2 && !guessed)) return false;
+  for (size_t i = 0; i < numNodes; i++) {
+    double change = std::abs(solution[i] - previousSolution[i]);
+    double scale =
+        std::max(std::abs(solution[i]), std::abs(previousSolution[i]));
+    if (change > tolerance * (1 + scale)) return false;
+  }
+  return true;
+}
+
+double MnaSystem::getVoltage(const Vertex& v) const {
+  long node = getNode(v);
+  if (node < 0) {
+    return getKnownVoltage(v);
+  }
+  return solution[node];
+}
+
+double MnaSystem::getBranchCurrent(size_t index) const {
+  return solution[numNodes + index];
+}
+
+double MnaSystem::getDiodeCurrent(size_t index) const {
+  return diodeCurrents[index];
+}
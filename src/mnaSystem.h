@@ -0,0 +1,257 @@
+#ifndef MNA_SYSTEM_H
+#define MNA_SYSTEM_H
+
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <unordered_map>
+#include <vector>
+
+#include "integrationMethod.h"
+#include "uuid.h"
+#include "vertex.h"
+
+/**
+ * A linear circuit in Modified Nodal Analysis form.
+ *
+ * Branches add themselves to the system through the `stamp*` methods. The
+ * unknowns of the system are the voltage of every vertex whose voltage is not
+ * known, followed by the current through every voltage source. Ideal diodes
+ * are not part of the linear system; each one adds a complementarity
+ * condition (i >= 0, v <= 0, i * v = 0) which is solved as a linear
+ * complementarity problem over the rest of the network.
+ *
+ * The system is stored and factorised as a sparse matrix, so the cost of a
+ * solve grows with the number of branches rather than the cube of the number
+ * of unknowns.
+ *
+ * Non-linear branches stamp their linearisation about the voltages of the
+ * previous solution (the Newton-Raphson companion model) and call
+ * `markNonlinear`. The caller then repeats `clear`, stamping and `solve` until
+ * `hasConverged` is true.
+ *
+ * Capacitors and inductors stamp their companion model over the time step set
+ * with `setTimeStep`, or their DC behaviour if it is 0. Consecutive solves
+ * with the same matrix, e.g. the time steps of a linear circuit, reuse its
+ * factorisation.
+ */
+class MnaSystem {
+ public:
+  /**
+   * Creates an empty system
+   * @param vertices the vertices of the circuit. Those whose voltage was
+   * given rather than solved for are treated as fixed references rather than
+   * unknowns
+   */
+  explicit MnaSystem(const VertexMap& vertices);
+
+  /**
+   * Adds a conductance between two vertices
+   * @param from one end of the conductance
+   * @param to the other end of the conductance
+   * @param conductance the conductance, in Siemens
+   */
+  void stampConductance(const Vertex& from, const Vertex& to,
+                        double conductance);
+
+  /**
+   * Adds an independent current flowing from `from` to `to` through a branch
+   * @param current the current, in Amps
+   */
+  void stampCurrent(const Vertex& from, const Vertex& to, double current);
+
+  /**
+   * Adds an independent voltage source such that `to` is `voltage` higher than
+   * `from`
+   * @return the index to use with `getBranchCurrent` to get the current
+   * flowing from `from` to `to` through the source
+   */
+  size_t stampVoltageSource(const Vertex& from, const Vertex& to,
+                            double voltage);
+
+  /**
+   * Adds an ideal diode that conducts from `from` to `to`
+   * @return the index to use with `getDiodeCurrent` to get the current
+   * flowing from `from` to `to` through the diode
+   */
+  size_t stampIdealDiode(const Vertex& from, const Vertex& to);
+
+  /**
+   * Records that a branch stamped a linearisation of itself, so the solution
+   * only holds once the iterates have converged
+   * @param limited whether the branch was linearised about a different
+   * voltage than the previous solution to keep the iteration stable
+   */
+  void markNonlinear(bool limited = false);
+
+  /**
+   * Sets the voltage of `v` that non-linear branches are linearised about in
+   * the next solve, in place of the last solution
+   * @param v a vertex whose voltage is not known
+   * @param voltage the guess, in Volts
+   */
+  void setInitialGuess(const Vertex& v, double voltage);
+
+  /**
+   * @return true if `getVoltage` is an estimate of the solution, from an
+   * earlier solve or `setInitialGuess`, rather than 0
+   */
+  bool hasEstimate() const;
+
+  /**
+   * Starts a new solve from the last solution, or from the guesses set after
+   * this call, counting its iterations from 0
+   */
+  void restart();
+
+  /**
+   * Removes every stamp, keeping the solution so that non-linear branches can
+   * be linearised about it
+   */
+  void clear();
+
+  /**
+   * Sets the time step that capacitors and inductors stamp their companion
+   * model over, from the end of the last solution they loaded
+   * @param step the length of the step, in seconds; 0 for a DC solution
+   * @param method how the derivatives are integrated over the step
+   */
+  void setTimeStep(double step, IntegrationMethod method =
+                                    IntegrationMethod::BACKWARD_EULER);
+
+  /**
+   * @return the time step set with `setTimeStep`, or 0 for a DC solution
+   */
+  double getTimeStep() const;
+
+  IntegrationMethod getIntegrationMethod() const;
+
+  /**
+   * Solves the system
+   * @return false if the system is singular or the diodes have no consistent
+   * state
+   */
+  bool solve();
+
+  /**
+   * @return the number of times `solve` has been called since `restart`
+   */
+  size_t getIteration() const;
+
+  /**
+   * @return the number of times the matrix was factorised, which is less than
+   * `getIteration` when solves reused the factorisation of the one before
+   */
+  size_t getFactorizations() const;
+
+  /**
+   * @param tolerance the largest allowed change in a node voltage between the
+   * last two solutions, relative to the magnitude of the voltage plus 1V
+   * @return true if the system is linear or the last solution changed every
+   * node voltage by less than `tolerance` without any branch limiting its
+   * voltage
+   */
+  bool hasConverged(double tolerance) const;
+
+  /**
+   * @return the voltage of `v` in the last solution, or 0 for unknown
+   * vertices before the first solve
+   */
+  double getVoltage(const Vertex& v) const;
+
+  /**
+   * @pre `solve` returned true
+   * @return the current through the voltage source at `index`
+   */
+  double getBranchCurrent(size_t index) const;
+
+  /**
+   * @pre `solve` returned true
+   * @return the current through the ideal diode at `index`
+   */
+  double getDiodeCurrent(size_t index) const;
+
+ private:
+  struct Entry {
+    size_t row;
+    size_t col;
+    double value;
+  };
+
+  /**
+   * An ideal diode, stored as the incidence of its current on the node
+   * equations and the part of its voltage that comes from known vertices
+   */
+  struct Diode {
+    long from;
+    long to;
+    double knownVoltage;
+  };
+
+  typedef Eigen::SparseMatrix<double> SparseMatrix;
+
+  /**
+   * Factorises `matrix`, with a Cholesky factorisation if it is symmetric or
+   * an LU factorisation otherwise. The ordering from the previous
+   * factorisation is reused if `matrix` has the same sparsity pattern, and
+   * the factorisation itself if it also has the same values
+   * @return false if `matrix` is singular
+   */
+  bool factorize(const SparseMatrix& matrix);
+
+  /**
+   * Solves the factorised system for each column of `rhs`
+   */
+  Eigen::MatrixXd solveFactorized(const Eigen::MatrixXd& rhs) const;
+
+  /**
+   * @return the index of the node unknown for `v` or -1 if `v` has a known
+   * voltage
+   */
+  long getNode(const Vertex& v) const;
+  double getKnownVoltage(const Vertex& v) const;
+  void addEntry(long row, long col, double value);
+
+  std::unordered_map<uuids::uuid, size_t> nodeIndices;
+  std::unordered_map<uuids::uuid, double> knownVoltages;
+  size_t numNodes;
+  std::vector<Entry> entries;
+  std::vector<double> rhs;
+  std::vector<Diode> diodes;
+  size_t numVoltageSources = 0;
+
+  /**
+   * Whether the system was factorised with `cholesky` rather than `lu`.
+   * Without voltage sources the nodal matrix is symmetric positive definite
+   */
+  bool symmetric = false;
+  /**
+   * The sparsity pattern that `cholesky` or `lu` were analysed for
+   */
+  std::vector<int> outerPattern;
+  std::vector<int> innerPattern;
+  /**
+   * The values of the matrix that `cholesky` or `lu` factorised
+   */
+  std::vector<double> factorizedValues;
+  size_t factorizations = 0;
+  Eigen::SimplicialLDLT<SparseMatrix> cholesky;
+  Eigen::SparseLU<SparseMatrix, Eigen::COLAMDOrdering<int>> lu;
+
+  bool nonlinear = false;
+  bool limited = false;
+  /**
+   * Whether `solution` held an estimate when the current solve started, from
+   * an earlier solve or `setInitialGuess`, so its first iteration is already a
+   * step from that estimate
+   */
+  bool guessed = false;
+  size_t iteration = 0;
+  double timeStep = 0;
+  IntegrationMethod integrationMethod = IntegrationMethod::BACKWARD_EULER;
+
+  Eigen::VectorXd solution;
+  Eigen::VectorXd previousSolution;
+  Eigen::VectorXd diodeCurrents;
+};
+
+#endif  // MNA_SYSTEM_H
@@ -0,0 +1,347 @@
+#include "nativeCode.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+extern char** environ;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+uint64_t hashSource(const std::string& source) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : source) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * Runs `arguments[0]`, found on the path, with its output discarded
+ *
+ * @return whether it ran and exited with status 0
+ */
+bool run(const std::vector<std::string>& arguments) {
+  std::vector<char*> argv;
+  for (const std::string& argument : arguments) {
+    argv.push_back(const_cast<char*>(argument.c_str()));
+  }
+  argv.push_back(nullptr);
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0) {
+    return false;
+  }
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  pid_t pid;
+  int error =
+      posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    return false;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool readFile(const fs::path& path, std::string& contents) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  contents.assign(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>());
+  return true;
+}
+
+bool writeFile(const fs::path& path, const std::string& contents) {
+  std::ofstream out(path, std::ios::binary);
+  out << contents;
+  return static_cast<bool>(out);
+}
+
+/**
+ * Compiles `source` into the shared object at `library`. Both files are
+ * written under temporary names and renamed into place, so that other
+ * processes sharing the cache never see a partial file
+ */
+bool compile(const std::string& source, const fs::path& sourcePath,
+             const fs::path& library, const std::string& compiler) {
+  std::string suffix = "." + std::to_string(getpid()) + ".tmp";
+  fs::path temporarySource = sourcePath.string() + suffix + ".cpp";
+  fs::path temporaryLibrary = library.string() + suffix;
+  if (!writeFile(temporarySource, source)) {
+    return false;
+  }
+  std::string command = compiler;
+  if (command.empty()) {
+    const char* cxx = std::getenv("CXX");
+    command = cxx != nullptr && *cxx != '\0' ? cxx : "c++";
+  }
+  // The compiler may come with flags of its own, separated by spaces
+  std::vector<std::string> arguments;
+  std::istringstream words(command);
+  for (std::string word; words >> word;) {
+    arguments.push_back(word);
+  }
+  bool compiled = !arguments.empty();
+  if (compiled) {
+    arguments.insert(arguments.end(),
+                     {"-std=c++17", "-O2", "-fPIC", "-shared", "-o",
+                      temporaryLibrary.string(), temporarySource.string()});
+    compiled = run(arguments);
+  }
+  std::error_code error;
+  if (compiled) {
+    fs::rename(temporaryLibrary, library, error);
+    compiled = !error;
+  }
+  if (compiled) {
+    fs::rename(temporarySource, sourcePath, error);
+    compiled = !error;
+  }
+  fs::remove(temporarySource, error);
+  fs::remove(temporaryLibrary, error);
+  return compiled;
+}
+
+/**
+ * @return the directory to cache code in: `directory` if it is set, or else a
+ * directory private to the current user, created if need be. Empty if the
+ * private directory is missing or anyone else could write to it, so that no
+ * code is loaded from it
+ */
+fs::path getCacheDirectory(const std::string& directory) {
+  std::error_code error;
+  if (!directory.empty()) {
+    fs::create_directories(directory, error);
+    return directory;
+  }
+  fs::path base;
+  const char* cacheHome = std::getenv("XDG_CACHE_HOME");
+  const char* home = std::getenv("HOME");
+  if (cacheHome != nullptr && *cacheHome == '/') {
+    base = cacheHome;
+  } else if (home != nullptr && *home == '/') {
+    base = fs::path(home) / ".cache";
+  } else {
+    return {};
+  }
+  fs::create_directories(base, error);
+  fs::path cache = base / "circuitSolver";
+  // Fails if the directory exists, which is checked below like a new one
+  mkdir(cache.c_str(), 0700);
+  struct stat info;
+  if (lstat(cache.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+      info.st_uid != geteuid() || (info.st_mode & 077) != 0) {
+    return {};
+  }
+  return cache;
+}
+
+/**
+ * Code loaded by this process, so that solving the same structure again does
+ * not reload it
+ */
+struct LoadedCode {
+  /**
+   * A second hash of the source, to tell apart sources whose first hashes
+   * collide without keeping the source
+   */
+  size_t check;
+  /**
+   * Set while a thread is loading the code, for other threads to wait on
+   */
+  std::shared_future<std::shared_ptr<const NativeCode>> loading;
+  std::weak_ptr<const NativeCode> code;
+};
+}  // namespace
+
+std::string NativeCode::generateSource(
+    const std::vector<ExpressionTape>& tapes) {
+  std::ostringstream out;
+  out << "// Generated by circuitSolver from compiled expressions\n"
+         "#include <cmath>\n\n"
+         "extern \"C\" {\n";
+  for (size_t t = 0; t < tapes.size(); t++) {
+    const ExpressionTape& tape = tapes[t];
+    const auto& instructions = tape.getInstructions();
+    const auto& results = tape.getResults();
+    out << "void circuitsolver_tape_" << t
+        << "(const double* const* p, const double* c, double* o, int n) {\n";
+    if (instructions.empty()) {
+      out << "  for (int k = 0; k < n; k++) o[k] = 0;\n}\n";
+      continue;
+    }
+    // The last instruction each prefix of the outputs depends on
+    std::vector<uint32_t> end(results.size());
+    for (size_t k = 0; k < results.size(); k++) {
+      end[k] = k == 0 ? results[0] : std::max(end[k - 1], results[k]);
+    }
+    size_t next = 0;
+    for (size_t i = 0; i < instructions.size(); i++) {
+      const uint32_t* args = instructions[i].args;
+      out << "  const double r" << i << " = ";
+      switch (instructions[i].op) {
+        case ExpressionTape::OpCode::CONSTANT:
+          out << "c[" << args[0] << "]";
+          break;
+        case ExpressionTape::OpCode::PARAMETER:
+          out << "p[" << args[0] << "][0]";
+          break;
+        case ExpressionTape::OpCode::ADD:
+          out << "r" << args[0] << " + r" << args[1];
+          break;
+        case ExpressionTape::OpCode::SUB:
+          out << "r" << args[0] << " - r" << args[1];
+          break;
+        case ExpressionTape::OpCode::MUL:
+          out << "r" << args[0] << " * r" << args[1];
+          break;
+        case ExpressionTape::OpCode::DIV:
+          out << "r" << args[0] << " / r" << args[1];
+          break;
+        case ExpressionTape::OpCode::NEG:
+          out << "-r" << args[0];
+          break;
+        case ExpressionTape::OpCode::EXP:
+          out << "std::exp(r" << args[0] << ")";
+          break;
+        case ExpressionTape::OpCode::SELECT_GT:
+          out << "r" << args[0] << " > 0 ? r" << args[1] << " : r" << args[2];
+          break;
+        case ExpressionTape::OpCode::SELECT_GEQ:
+          out << "r" << args[0] << " >= 0 ? r" << args[1] << " : r"
+              << args[2];
+          break;
+      }
+      out << ";\n";
+      // The first k outputs only depend on the instructions up to the last of
+      // their own, so a caller that needs only those stops there
+      for (; next < results.size() && end[next] <= i; next++) {
+        out << "  o[" << next << "] = r" << results[next] << ";\n";
+        if (next + 1 < results.size()) {
+          out << "  if (n <= " << next + 1 << ") return;\n";
+        }
+      }
+    }
+    out << "}\n";
+  }
+  out << "}\n";
+  return out.str();
+}
+
+std::shared_ptr<const NativeCode> NativeCode::load(
+    const std::vector<ExpressionTape>& tapes, const std::string& compiler,
+    const std::string& directory) {
+  static std::mutex mutex;
+  static std::unordered_map<uint64_t, LoadedCode> loaded;
+  std::string source = generateSource(tapes);
+  uint64_t hash = hashSource(source);
+  size_t check = std::hash<std::string>()(source);
+  // Only made by the thread that compiles the code
+  std::optional<std::promise<std::shared_ptr<const NativeCode>>> promise;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = loaded.find(hash);
+    if (it != loaded.end() && it->second.check == check) {
+      if (auto code = it->second.code.lock()) {
+        return code;
+      }
+      if (it->second.loading.valid()) {
+        // Another thread is compiling the same code
+        auto loading = it->second.loading;
+        lock.unlock();
+        return loading.get();
+      }
+    }
+    if (it == loaded.end() || it->second.code.expired()) {
+      promise.emplace();
+      loaded[hash] = LoadedCode{check, promise->get_future().share(), {}};
+    }
+  }
+
+  std::shared_ptr<const NativeCode> code =
+      compileAndLoad(tapes, source, hash, compiler, directory);
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = loaded.find(hash);
+  if (it != loaded.end() && it->second.check == check) {
+    it->second.loading = {};
+    it->second.code = code;
+  }
+  for (it = loaded.begin(); it != loaded.end();) {
+    bool unused = it->second.code.expired() && !it->second.loading.valid();
+    it = unused ? loaded.erase(it) : std::next(it);
+  }
+  if (promise.has_value()) {
+    promise->set_value(code);
+  }
+  return code;
+}
+
+std::shared_ptr<const NativeCode> NativeCode::compileAndLoad(
+    const std::vector<ExpressionTape>& tapes, const std::string& source,
+    uint64_t hash, const std::string& compiler, const std::string& directory) {
+  fs::path cache = getCacheDirectory(directory);
+  if (cache.empty()) {
+    return nullptr;
+  }
+  char name[17];
+  std::snprintf(name, sizeof(name), "%016llx",
+                static_cast<unsigned long long>(hash));
+  fs::path sourcePath = cache / (std::string(name) + ".cpp");
+  fs::path library = cache / (std::string(name) + ".so");
+  // The source is kept next to the library to rule out hash collisions
+  std::error_code error;
+  std::string cachedSource;
+  if (!fs::exists(library, error) || !readFile(sourcePath, cachedSource) ||
+      cachedSource != source) {
+    if (!compile(source, sourcePath, library, compiler)) {
+      return nullptr;
+    }
+  }
+
+  void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == nullptr) {
+    return nullptr;
+  }
+  std::vector<Function> functions(tapes.size());
+  for (size_t t = 0; t < tapes.size(); t++) {
+    std::string symbol = "circuitsolver_tape_" + std::to_string(t);
+    functions[t] = reinterpret_cast<Function>(dlsym(handle, symbol.c_str()));
+    if (functions[t] == nullptr) {
+      dlclose(handle);
+      return nullptr;
+    }
+  }
+  return std::shared_ptr<const NativeCode>(
+      new NativeCode(handle, std::move(functions)));
+}
+
+NativeCode::~NativeCode() { dlclose(handle); }
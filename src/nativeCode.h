@@ -0,0 +1,91 @@
+#ifndef NATIVE_CODE_H
+#define NATIVE_CODE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "expressionTape.h"
+
+/**
+ * Machine code for a set of `ExpressionTape`s, generated as C++ and compiled
+ * with the system compiler into a shared object.
+ *
+ * The generated code depends only on the structure of the tapes: the values
+ * of their constants are passed in when it is called. Circuits with the same
+ * topology and the same known values folded away therefore share one shared
+ * object, which is cached on disk under the hash of its source so that later
+ * runs load it without compiling.
+ */
+class NativeCode {
+ public:
+  /**
+   * Evaluates the first `numOutputs` outputs of one tape, as
+   * `ExpressionTape::evaluate`
+   * @param parameters one block of size 1 per slot of the tape
+   * @param constants the constants of the tape
+   * @param outputs set to the values of the outputs
+   * @param numOutputs the number of outputs to evaluate
+   */
+  typedef void (*Function)(double const* const* parameters,
+                           const double* constants, double* outputs,
+                           int numOutputs);
+
+  /**
+   * Loads the code for `tapes`, compiling it first unless a process or an
+   * earlier run already did
+   * @param compiler the C++ compiler, with any flags of its own separated by
+   * spaces. It is run directly rather than through a shell. Empty uses $CXX,
+   * or c++ if that is not set
+   * @param directory where compiled code is cached; empty uses
+   * $XDG_CACHE_HOME/circuitSolver, or ~/.cache/circuitSolver if that is not
+   * set, which is only used while it belongs to the current user and no one
+   * else can access it
+   * @return the code, or null if it could not be compiled or loaded, in which
+   * case the tapes should be interpreted instead
+   */
+  static std::shared_ptr<const NativeCode> load(
+      const std::vector<ExpressionTape>& tapes, const std::string& compiler,
+      const std::string& directory);
+
+  /**
+   * @return the C++ source of a shared object with one `Function` named
+   * `circuitsolver_tape_<i>` for tape i
+   */
+  static std::string generateSource(const std::vector<ExpressionTape>& tapes);
+
+  /**
+   * Unloads the shared object
+   */
+  ~NativeCode();
+
+  NativeCode(const NativeCode&) = delete;
+  NativeCode& operator=(const NativeCode&) = delete;
+
+  /**
+   * @return the function that evaluates the tape at `index`
+   */
+  Function getFunction(size_t index) const { return functions[index]; }
+
+ private:
+  NativeCode(void* handle, std::vector<Function> functions)
+      : handle(handle), functions(std::move(functions)) {}
+
+  /**
+   * Loads the code for `tapes` from the cache in `directory`, compiling
+   * `source` into it first if it is not there
+   * @param hash the hash of `source`, which names its files in the cache
+   * @return the code, or null if it could not be compiled or loaded
+   */
+  static std::shared_ptr<const NativeCode> compileAndLoad(
+      const std::vector<ExpressionTape>& tapes, const std::string& source,
+      uint64_t hash, const std::string& compiler,
+      const std::string& directory);
+
+  void* handle;
+  std::vector<Function> functions;
+};
+
+#endif  // NATIVE_CODE_H
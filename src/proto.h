@@ -4,4 +4,7 @@ namespace proto {
 using CircuitGraph = circuit_solver::v1::CircuitGraphMessage;
 using Vertex = circuit_solver::v1::CircuitGraphMessage::Vertex;
 using Edge = circuit_solver::v1::CircuitGraphMessage::Edge;
+using DcSweep = circuit_solver::v1::DcSweepMessage;
+using AcSweep = circuit_solver::v1::AcSweepMessage;
+using SolveResult = circuit_solver::v1::SolveResultMessage;
 }  // namespace proto
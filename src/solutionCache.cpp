@@ -0,0 +1,74 @@
+#include "solutionCache.h"
+
+#include <utility>
+
+SolutionCache::SolutionCache(size_t capacity) : capacity(capacity) {}
+
+std::optional<std::string> SolutionCache::find(uint64_t hash,
+                                               const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(hash);
+  // Different keys can share a hash, so only a matching key is a hit
+  if (it == index.end() || it->second->key != key) {
+    misses++;
+    return std::nullopt;
+  }
+  entries.splice(entries.begin(), entries, it->second);
+  hits++;
+  return it->second->solution;
+}
+
+void SolutionCache::insert(uint64_t hash, std::string key,
+                           std::string solution) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (capacity == 0) return;
+  auto it = index.find(hash);
+  if (it != index.end()) {
+    entries.erase(it->second);
+    index.erase(it);
+  }
+  entries.push_front(Entry{hash, std::move(key), std::move(solution)});
+  index[hash] = entries.begin();
+  evictToCapacity();
+}
+
+void SolutionCache::setCapacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->capacity = capacity;
+  evictToCapacity();
+}
+
+size_t SolutionCache::getCapacity() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return capacity;
+}
+
+size_t SolutionCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+void SolutionCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+  hits = 0;
+  misses = 0;
+}
+
+uint64_t SolutionCache::getHits() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return hits;
+}
+
+uint64_t SolutionCache::getMisses() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return misses;
+}
+
+void SolutionCache::evictToCapacity() {
+  while (entries.size() > capacity) {
+    index.erase(entries.back().hash);
+    entries.pop_back();
+  }
+}
@@ -0,0 +1,94 @@
+#ifndef SOLUTION_CACHE_H
+#define SOLUTION_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+/**
+ * A bounded cache of solved circuits that evicts the least recently used
+ * circuit when it is full. Safe to use from several threads at once.
+ */
+class SolutionCache {
+ public:
+  /**
+   * @param capacity the most solutions the cache holds; 0 stores nothing
+   */
+  explicit SolutionCache(size_t capacity);
+
+  SolutionCache(const SolutionCache&) = delete;
+  SolutionCache& operator=(const SolutionCache&) = delete;
+
+  /**
+   * Looks up the solution stored for `key` and marks it as the most recently
+   * used. Counts a hit or a miss.
+   *
+   * @param hash the hash of `key`, e.g. from `CircuitGraph::hashCanonicalForm`
+   * @param key the canonical form of the circuit and of anything else that
+   * changes its solution
+   * @return the stored solution, if there is one
+   */
+  std::optional<std::string> find(uint64_t hash, const std::string& key);
+
+  /**
+   * Stores the solution for `key`, replacing any solution with the same hash
+   * and evicting the least recently used solution if the cache is full
+   */
+  void insert(uint64_t hash, std::string key, std::string solution);
+
+  /**
+   * Changes the most solutions the cache holds, evicting the least recently
+   * used ones that no longer fit
+   */
+  void setCapacity(size_t capacity);
+
+  size_t getCapacity() const;
+
+  /**
+   * @return the number of solutions stored
+   */
+  size_t size() const;
+
+  /**
+   * Removes every stored solution and resets the counters
+   */
+  void clear();
+
+  /**
+   * @return the number of calls to `find` that returned a solution
+   */
+  uint64_t getHits() const;
+
+  /**
+   * @return the number of calls to `find` that did not
+   */
+  uint64_t getMisses() const;
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    std::string key;
+    std::string solution;
+  };
+
+  void evictToCapacity();
+
+  /**
+   * Guards all of the state below
+   */
+  mutable std::mutex mutex;
+  size_t capacity;
+  /**
+   * The stored solutions, most recently used first
+   */
+  std::list<Entry> entries;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+#endif  // SOLUTION_CACHE_H
@@ -0,0 +1,84 @@
+#include "solverConfig.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "expression.h"
+
+// Below this many unknowns the dense factorisation is cheaper than finding a
+// fill-reducing ordering
+static constexpr size_t maxDenseParameters = 100;
+// Above this fraction of non-zero Jacobian entries a sparse factorisation has
+// little to gain
+static constexpr double minSparseDensity = 0.2;
+
+static ceres::LinearSolverType chooseLinearSolver(const SolverConfig& config,
+                                                  size_t numParameters,
+                                                  size_t numResiduals,
+                                                  size_t jacobianNonZeros) {
+  switch (config.linearSolver) {
+    case LinearSolver::DENSE_QR:
+      return ceres::DENSE_QR;
+    case LinearSolver::SPARSE_NORMAL_CHOLESKY:
+      return ceres::SPARSE_NORMAL_CHOLESKY;
+    case LinearSolver::ITERATIVE_SCHUR:
+      return ceres::ITERATIVE_SCHUR;
+    case LinearSolver::CGNR:
+      return ceres::CGNR;
+    case LinearSolver::AUTO:
+      break;
+  }
+  if (numParameters <= maxDenseParameters || numResiduals == 0) {
+    return ceres::DENSE_QR;
+  }
+  double density = static_cast<double>(jacobianNonZeros) /
+                   (static_cast<double>(numParameters) * numResiduals);
+  return density >= minSparseDensity ? ceres::DENSE_QR
+                                     : ceres::SPARSE_NORMAL_CHOLESKY;
+}
+
+ceres::Solver::Options getCeresOptions(const SolverConfig& config,
+                                       size_t numParameters,
+                                       size_t numResiduals,
+                                       size_t jacobianNonZeros) {
+  ceres::Solver::Options options = getDefaultOptions();
+  options.linear_solver_type = chooseLinearSolver(
+      config, numParameters, numResiduals, jacobianNonZeros);
+  unsigned numThreads = config.numThreads;
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  options.num_threads = static_cast<int>(numThreads);
+  options.function_tolerance = config.functionTolerance;
+  options.gradient_tolerance = config.gradientTolerance;
+  options.parameter_tolerance = config.parameterTolerance;
+  options.max_num_iterations = static_cast<int>(config.maxIterations);
+  return options;
+}
+
+/**
+ * Appends the bytes of `value` to `out`
+ */
+template <typename T>
+static void appendBytes(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+std::string getCanonicalForm(const SolverConfig& config) {
+  std::string form;
+  appendBytes(form, static_cast<int>(config.engine));
+  appendBytes(form, static_cast<int>(config.linearSolver));
+  appendBytes(form, config.maxNewtonIterations);
+  appendBytes(form, config.newtonTolerance);
+  appendBytes(form, config.maxSolveAttempts);
+  appendBytes(form, config.maxSolveSeconds);
+  appendBytes(form, config.seed);
+  appendBytes(form, config.functionTolerance);
+  appendBytes(form, config.gradientTolerance);
+  appendBytes(form, config.parameterTolerance);
+  appendBytes(form, config.maxIterations);
+  appendBytes(form, config.reduceTopology);
+  appendBytes(form, static_cast<int>(config.homotopy));
+  appendBytes(form, config.homotopySteps);
+  return form;
+}
@@ -0,0 +1,269 @@
+#ifndef SOLVER_CONFIG_H
+#define SOLVER_CONFIG_H
+
+#include <ceres/ceres.h>
+
+#include <cstddef>
+#include <string>
+
+#include "integrationMethod.h"
+
+/**
+ * The methods `CircuitGraph::solveCircuit` can use to solve a circuit
+ */
+enum class SolverEngine {
+  /**
+   * Uses `NEWTON` when every branch can be represented in the Modified Nodal
+   * Analysis form of the circuit and it converges, otherwise uses `CERES`
+   */
+  AUTO,
+  /**
+   * Solves the Modified Nodal Analysis form of the circuit with a sparse
+   * factorisation, with ideal diodes as a linear complementarity problem.
+   * Non-linear branches are linearised about the previous solution with
+   * Newton-Raphson iteration, so linear circuits take a single solve
+   */
+  NEWTON,
+  /**
+   * Minimises the residuals of the expression trees with ceres, solving once
+   * for every combination of ideal diode states
+   */
+  CERES,
+};
+
+/**
+ * The linear solvers ceres can use for each step of `SolverEngine::CERES`
+ */
+enum class LinearSolver {
+  /**
+   * Uses `DENSE_QR` for small or dense problems and `SPARSE_NORMAL_CHOLESKY`
+   * otherwise
+   */
+  AUTO,
+  /**
+   * Dense QR factorisation of the Jacobian. Exact but cubic in the number of
+   * unknowns
+   */
+  DENSE_QR,
+  /**
+   * Sparse Cholesky factorisation of the normal equations
+   */
+  SPARSE_NORMAL_CHOLESKY,
+  /**
+   * Conjugate gradients on the Schur complement of the normal equations
+   */
+  ITERATIVE_SCHUR,
+  /**
+   * Conjugate gradients on the normal equations, without a factorisation
+   */
+  CGNR,
+};
+
+/**
+ * The easier circuits `SolverEngine::CERES` can work up from when a circuit
+ * does not converge from its starting point
+ */
+enum class Homotopy {
+  /**
+   * Only restarts from random starting points
+   */
+  NONE,
+  /**
+   * Ramps every independent source up from 0, including the currents that
+   * diodes pass with no bias, starting from 0V and 0A
+   */
+  SOURCE_STEPPING,
+  /**
+   * Connects every unknown vertex to 0V through a conductance, starting at
+   * 10mS and shrinking tenfold each step
+   */
+  GMIN_STEPPING,
+};
+
+/**
+ * Options controlling how `CircuitGraph::solveCircuit` searches for a solution
+ */
+struct SolverConfig {
+  /**
+   * The method used to solve the circuit
+   */
+  SolverEngine engine = SolverEngine::AUTO;
+
+  /**
+   * The number of threads used to solve the diode partitions. Each partition
+   * is an independent problem with its own copy of the unknowns, so they can
+   * be solved concurrently. 1 solves them one after another on the calling
+   * thread and 0 uses one thread per hardware core. The frequencies of an AC
+   * sweep use the same threads.
+   */
+  unsigned partitionThreads = 1;
+
+  /**
+   * The most Newton-Raphson iterations `NEWTON` takes before giving up
+   */
+  unsigned maxNewtonIterations = 100;
+
+  /**
+   * `NEWTON` has converged once no node voltage changes by more than this
+   * fraction of its magnitude plus 1V between iterations
+   */
+  double newtonTolerance = 1e-9;
+
+  /**
+   * The most times `CERES` solves the circuit. Each attempt after the first
+   * restarts from a random point, so this bounds the total work
+   */
+  unsigned maxSolveAttempts = 100;
+
+  /**
+   * No new attempt is started after this many seconds of `CERES`; 0 means no
+   * time limit
+   */
+  double maxSolveSeconds = 0;
+
+  /**
+   * The seed for the random restarts of `CERES`, so that a solve can be
+   * reproduced exactly
+   */
+  unsigned long seed = 0;
+
+  /**
+   * The linear solver ceres uses in each step of `CERES`
+   */
+  LinearSolver linearSolver = LinearSolver::AUTO;
+
+  /**
+   * The number of threads ceres uses to evaluate the residuals and factorise
+   * the linear system of each partition; 0 uses one per hardware core
+   */
+  unsigned numThreads = 1;
+
+  /**
+   * `CERES` stops when the relative decrease in cost of a step is below
+   * this
+   */
+  double functionTolerance = 1e-6;
+
+  /**
+   * `CERES` stops when the largest component of the gradient is below this
+   */
+  double gradientTolerance = 0;
+
+  /**
+   * `CERES` stops when the relative change in the unknowns of a step is
+   * below this
+   */
+  double parameterTolerance = 0;
+
+  /**
+   * The most steps `CERES` takes for each partition
+   */
+  unsigned maxIterations = 1000;
+
+  /**
+   * Whether `CERES` first merges series and parallel resistors, series voltage
+   * sources, parallel current sources and voltage sources in series with a
+   * resistor, then solves the smaller circuit. The values of everything that
+   * was merged are recovered from its solution.
+   */
+  bool reduceTopology = true;
+
+  /**
+   * What `CERES` does when a subcircuit does not converge on its first
+   * attempt. Random restarts follow if it still does not converge.
+   */
+  Homotopy homotopy = Homotopy::SOURCE_STEPPING;
+
+  /**
+   * The number of circuits in the chain `homotopy` solves, including the
+   * circuit itself
+   */
+  unsigned homotopySteps = 10;
+
+  /**
+   * Whether `CERES` evaluates the residuals and their Jacobians with machine
+   * code generated for the circuit rather than by interpreting them. The code
+   * is compiled the first time a circuit with the same structure is solved
+   * and cached on disk, which pays off for circuits that are solved many times.
+   * Falls back to interpreting if the code cannot be compiled.
+   */
+  bool nativeCode = false;
+
+  /**
+   * The compiler for the generated code, with any flags of its own separated
+   * by spaces; empty uses $CXX, or c++ if that is not set
+   */
+  std::string nativeCompiler;
+
+  /**
+   * Where the generated code is cached between runs; empty uses a directory
+   * private to the user in $XDG_CACHE_HOME or ~/.cache, as `NativeCode::load`
+   */
+  std::string nativeCodeDirectory;
+};
+
+/**
+ * Options controlling how `CircuitGraph::transient` steps through time
+ */
+struct TransientConfig {
+  /**
+   * The time the simulation ends at, in seconds. It starts at 0
+   */
+  double stopTime = 1e-3;
+
+  /**
+   * The longest time step, in seconds; 0 uses a fiftieth of `stopTime`
+   */
+  double maxStep = 0;
+
+  /**
+   * The simulation fails rather than take a shorter time step than this, in
+   * seconds; 0 uses a billionth of the longest step
+   */
+  double minStep = 0;
+
+  /**
+   * How capacitors and inductors are integrated over each step. The first
+   * step always uses `IntegrationMethod::BACKWARD_EULER`, since the
+   * derivatives are not known at the start
+   */
+  IntegrationMethod method = IntegrationMethod::TRAPEZOIDAL;
+
+  /**
+   * A step is repeated at half the length when the estimated local truncation
+   * error of a node voltage is more than this fraction of the voltage plus
+   * `absoluteTolerance`
+   */
+  double relativeTolerance = 1e-3;
+
+  /**
+   * The error allowed in each node voltage in addition to
+   * `relativeTolerance`, in Volts
+   */
+  double absoluteTolerance = 1e-6;
+};
+
+/**
+ * Converts `config` to options for ceres, choosing the linear solver from the
+ * shape of the problem if it is `LinearSolver::AUTO`
+ *
+ * @param config the options to convert
+ * @param numParameters the number of unknowns in the problem
+ * @param numResiduals the number of residuals in the problem
+ * @param jacobianNonZeros the number of (residual, unknown) pairs where the
+ * residual depends on the unknown
+ * @return the options to pass to `ceres::Solve`
+ */
+ceres::Solver::Options getCeresOptions(const SolverConfig& config,
+                                       size_t numParameters,
+                                       size_t numResiduals,
+                                       size_t jacobianNonZeros);
+
+/**
+ * Encodes the options of `config` that can change the solution of a circuit,
+ * leaving out those that only change how fast it is found, e.g. the numbers of
+ * threads
+ */
+std::string getCanonicalForm(const SolverConfig& config);
+
+#endif  // SOLVER_CONFIG_H
@@ -0,0 +1,102 @@
+#include "threadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned numThreads) {
+  if (numThreads == 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // The calling thread counts as one of the threads
+  workers.reserve(numThreads - 1);
+  for (unsigned i = 1; i < numThreads; i++) {
+    workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned ThreadPool::size() const {
+  return static_cast<unsigned>(workers.size()) + 1;
+}
+
+void ThreadPool::parallelFor(size_t count,
+                             const std::function<void(size_t)>& body) {
+  if (count == 0) return;
+  if (workers.empty() || count == 1) {
+    for (size_t i = 0; i < count; i++) {
+      body(i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> loopLock(loopMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->body = &body;
+    this->count = count;
+    nextIndex = 0;
+    busyWorkers = workers.size();
+    error = nullptr;
+    generation++;
+  }
+  workAvailable.notify_all();
+  runIterations();
+
+  std::exception_ptr firstError;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    workFinished.wait(lock, [this] { return busyWorkers == 0; });
+    this->body = nullptr;
+    firstError = error;
+    error = nullptr;
+  }
+  if (firstError) {
+    std::rethrow_exception(firstError);
+  }
+}
+
+void ThreadPool::runIterations() {
+  while (true) {
+    size_t i;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (nextIndex >= count) return;
+      i = nextIndex++;
+    }
+    try {
+      (*body)(i);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error) error = std::current_exception();
+    }
+  }
+}
+
+void ThreadPool::workerLoop() {
+  unsigned long lastGeneration = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      workAvailable.wait(lock, [this, lastGeneration] {
+        return stopping || generation != lastGeneration;
+      });
+      if (stopping) return;
+      lastGeneration = generation;
+    }
+    runIterations();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busyWorkers--;
+      if (busyWorkers == 0) workFinished.notify_one();
+    }
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads used to run independent iterations of a loop
+ * concurrently
+ */
+class ThreadPool {
+ public:
+  /**
+   * Creates a pool that runs work on `numThreads` threads in total. The thread
+   * that calls `parallelFor` takes part in the work, so a pool of size 1 does
+   * not start any workers.
+   *
+   * @param numThreads the number of threads to use, or 0 to use one thread per
+   * hardware core
+   */
+  explicit ThreadPool(unsigned numThreads);
+
+  /**
+   * Stops and joins all the workers
+   */
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * Calls `body(i)` for each i in [0, count) and blocks until every call has
+   * returned. The order of the calls is unspecified. If a call throws, the
+   * remaining iterations still run and the first exception is rethrown once
+   * they have finished.
+   *
+   * Calls from different threads are serialized. `body` must not call
+   * `parallelFor` on the same pool.
+   *
+   * @param count the number of iterations
+   * @param body the function to call for each iteration
+   */
+  void parallelFor(size_t count, const std::function<void(size_t)>& body);
+
+  /**
+   * @return the number of threads that run work, including the caller
+   */
+  unsigned size() const;
+
+ private:
+  void workerLoop();
+  void runIterations();
+
+  std::vector<std::thread> workers;
+
+  /**
+   * Held for the whole of a `parallelFor` call so that only one loop uses the
+   * workers at a time
+   */
+  std::mutex loopMutex;
+
+  /**
+   * Guards all of the state below
+   */
+  std::mutex mutex;
+  std::condition_variable workAvailable;
+  std::condition_variable workFinished;
+  const std::function<void(size_t)>* body = nullptr;
+  size_t count = 0;
+  size_t nextIndex = 0;
+  size_t busyWorkers = 0;
+  unsigned long generation = 0;
+  bool stopping = false;
+  std::exception_ptr error;
+};
+
+#endif  // THREAD_POOL_H
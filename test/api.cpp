@@ -0,0 +1,805 @@
+#include "src/api.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/util/json_util.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <thread>
+#include <uuid.h>
+#include <vector>
+
+#include "src/expression.h"
+#include "src/nativeCode.h"
+#include "src/proto.h"
+#include "utils.h"
+
+/**
+ * Adds a vertex to `message`, with a known voltage if `voltage` is given
+ * @return the id of the vertex
+ */
+static std::string addVertex(proto::CircuitGraph& message,
+                             uuids::uuid_random_generator& gen,
+                             std::optional<double> voltage = std::nullopt) {
+  std::string id = uuids::to_string(gen());
+  proto::Vertex& vertex = (*message.mutable_vertices())[id];
+  vertex.set_id(id);
+  if (voltage.has_value()) {
+    vertex.set_voltage(voltage.value());
+  }
+  return id;
+}
+
+/**
+ * Adds an edge from `from` to `to` to `message`, for the caller to set its
+ * branch
+ */
+static proto::Edge& addEdge(proto::CircuitGraph& message,
+                            uuids::uuid_random_generator& gen,
+                            const std::string& from, const std::string& to) {
+  std::string id = uuids::to_string(gen());
+  proto::Edge& edge = (*message.mutable_edges())[id];
+  edge.set_id(id);
+  edge.set_from_id(from);
+  edge.set_to_id(to);
+  return edge;
+}
+
+/**
+ * @return `messages` in the length-delimited format of a batch
+ */
+static std::string toBatch(const std::vector<std::string>& messages) {
+  std::string batch;
+  {
+    google::protobuf::io::StringOutputStream stream(&batch);
+    google::protobuf::io::CodedOutputStream coded(&stream);
+    for (auto& message : messages) {
+      coded.WriteVarint32(static_cast<uint32_t>(message.size()));
+      coded.WriteString(message);
+    }
+  }
+  return batch;
+}
+
+/**
+ * @return the results in the output of solveGraphBatchFromBuffer
+ */
+static std::vector<proto::SolveResult> fromBatch(const void* output,
+                                                 size_t outputLength) {
+  std::vector<proto::SolveResult> results;
+  google::protobuf::io::CodedInputStream input(
+      static_cast<const uint8_t*>(output), static_cast<int>(outputLength));
+  uint32_t size;
+  while (input.ReadVarint32(&size)) {
+    auto limit = input.PushLimit(static_cast<int>(size));
+    results.emplace_back();
+    EXPECT_TRUE(results.back().ParseFromCodedStream(&input));
+    input.PopLimit(limit);
+  }
+  return results;
+}
+
+/**
+ * A source of `voltage` driving a divider of 2k and 3k, so that the voltage
+ * at `out` is 3/5 of the source and the current through every edge is
+ * voltage / 5k
+ */
+struct Divider {
+  Divider(uuids::uuid_random_generator& gen, double voltage) {
+    std::string ref = addVertex(message, gen, 0);
+    std::string in = addVertex(message, gen);
+    out = addVertex(message, gen);
+    proto::Edge& vs = addEdge(message, gen, ref, in);
+    vs.mutable_voltage_source()->set_voltage(voltage);
+    source = vs.id();
+    addEdge(message, gen, in, out).mutable_resistor()->set_resistance(2000);
+    addEdge(message, gen, out, ref).mutable_resistor()->set_resistance(3000);
+    buffer = message.SerializeAsString();
+  }
+
+  proto::CircuitGraph message;
+  std::string buffer;
+  std::string out;
+  std::string source;
+};
+
+TEST(ApiTest, SolveFromBuffer) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 5);
+
+  void* output = nullptr;
+  size_t outputLength = 0;
+  ASSERT_EQ(0, solveGraphFromBuffer(divider.buffer.data(),
+                                    divider.buffer.size(), &output,
+                                    &outputLength));
+  proto::CircuitGraph solved;
+  ASSERT_TRUE(solved.ParseFromArray(output, static_cast<int>(outputLength)));
+  destroyGraphBuffer(output);
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      3, solved.vertices().at(divider.out).voltage()));
+  for (auto& edge : solved.edges()) {
+    EXPECT_TRUE(
+        IsWithinRelativeTolerance(1e-3, std::abs(edge.second.current())));
+  }
+
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  options.engine = CIRCUITSOLVER_ENGINE_CERES;
+  options.linearSolver = CIRCUITSOLVER_LINEAR_SOLVER_DENSE_QR;
+  ASSERT_EQ(0, solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                               divider.buffer.size(), &output,
+                                               &outputLength, &options));
+  ASSERT_TRUE(solved.ParseFromArray(output, static_cast<int>(outputLength)));
+  destroyGraphBuffer(output);
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      3, solved.vertices().at(divider.out).voltage()));
+
+  options.engine = 7;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+
+  // A caller built before the homotopy fields existed gets their defaults
+  getDefaultSolverOptions(&options);
+  options.homotopy = 7;
+  options.size = offsetof(CircuitSolverOptions, homotopy);
+  getDefaultSolverOptions(&options);
+  EXPECT_EQ(7, options.homotopy);
+  ASSERT_EQ(0, solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                               divider.buffer.size(), &output,
+                                               &outputLength, &options));
+  destroyGraphBuffer(output);
+  options.size = sizeof(options);
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+  options.size = 0;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+  std::string garbage = "not a circuit";
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBuffer(garbage.data(), garbage.size(), &output,
+                                 &outputLength));
+}
+
+TEST(ApiTest, SolveFromJson) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 5);
+  std::string input;
+  ASSERT_TRUE(
+      google::protobuf::json::MessageToJsonString(divider.message, &input)
+          .ok());
+
+  char* output = nullptr;
+  ASSERT_EQ(0, solveGraphFromJson(input.data(), &output));
+  proto::CircuitGraph solved;
+  EXPECT_TRUE(
+      google::protobuf::json::JsonStringToMessage(output, &solved).ok());
+  destroyGraphJson(output);
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      3, solved.vertices().at(divider.out).voltage()));
+
+  std::string garbage = "{";
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromJson(garbage.data(), &output));
+}
+
+TEST(ApiTest, RestartOptions) {
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 5);
+  void* output = nullptr;
+  size_t outputLength = 0;
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  options.engine = CIRCUITSOLVER_ENGINE_CERES;
+  options.maxSolveAttempts = 3;
+  options.maxSolveSeconds = 10;
+  options.seed = 42;
+  ASSERT_EQ(0, solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                               divider.buffer.size(), &output,
+                                               &outputLength, &options));
+  proto::CircuitGraph solved;
+  ASSERT_TRUE(solved.ParseFromArray(output, static_cast<int>(outputLength)));
+  destroyGraphBuffer(output);
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      3, solved.vertices().at(divider.out).voltage()));
+
+  options.maxSolveAttempts = 0;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+  options.maxSolveAttempts = 3;
+  options.maxSolveSeconds = -1;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+}
+
+TEST(ApiTest, ReduceTopology) {
+  auto gen = getUuidGenerator();
+  // Reduces to one resistor across the source, with the voltage between the
+  // two recovered afterwards
+  Divider divider(gen, 5);
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  options.engine = CIRCUITSOLVER_ENGINE_CERES;
+  for (int reduceTopology : {0, 1}) {
+    options.reduceTopology = reduceTopology;
+    void* output = nullptr;
+    size_t outputLength = 0;
+    ASSERT_EQ(0, solveGraphFromBufferWithOptions(
+                     divider.buffer.data(), divider.buffer.size(), &output,
+                     &outputLength, &options));
+    proto::CircuitGraph solved;
+    ASSERT_TRUE(
+        solved.ParseFromArray(output, static_cast<int>(outputLength)));
+    destroyGraphBuffer(output);
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        3, solved.vertices().at(divider.out).voltage()));
+    for (auto& edge : solved.edges()) {
+      EXPECT_TRUE(
+          IsWithinRelativeTolerance(1e-3, std::abs(edge.second.current())));
+    }
+  }
+}
+
+TEST(ApiTest, HomotopyOptions) {
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 5);
+  void* output = nullptr;
+  size_t outputLength = 0;
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  EXPECT_EQ(CIRCUITSOLVER_HOMOTOPY_SOURCE_STEPPING, options.homotopy);
+  options.engine = CIRCUITSOLVER_ENGINE_CERES;
+  for (int homotopy :
+       {CIRCUITSOLVER_HOMOTOPY_NONE, CIRCUITSOLVER_HOMOTOPY_SOURCE_STEPPING,
+        CIRCUITSOLVER_HOMOTOPY_GMIN_STEPPING}) {
+    options.homotopy = homotopy;
+    ASSERT_EQ(0, solveGraphFromBufferWithOptions(
+                     divider.buffer.data(), divider.buffer.size(), &output,
+                     &outputLength, &options));
+    proto::CircuitGraph solved;
+    ASSERT_TRUE(
+        solved.ParseFromArray(output, static_cast<int>(outputLength)));
+    destroyGraphBuffer(output);
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        3, solved.vertices().at(divider.out).voltage()));
+  }
+
+  options.homotopy = 3;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+  options.homotopy = CIRCUITSOLVER_HOMOTOPY_GMIN_STEPPING;
+  options.homotopySteps = 0;
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphFromBufferWithOptions(divider.buffer.data(),
+                                            divider.buffer.size(), &output,
+                                            &outputLength, &options));
+}
+
+/**
+ * 5V driving 1k, an ideal diode with a given `current` and another 1k in
+ * series. It only has a solution for 2.5mA, with 2.5V at both ends of the
+ * diode.
+ */
+struct DiodeSeries {
+  DiodeSeries(uuids::uuid_random_generator& gen, double current) {
+    std::string ref = addVertex(message, gen, 0);
+    std::string vcc = addVertex(message, gen, 5);
+    anode = addVertex(message, gen);
+    cathode = addVertex(message, gen);
+    addEdge(message, gen, vcc, anode).mutable_resistor()->set_resistance(1000);
+    proto::Edge& diode = addEdge(message, gen, anode, cathode);
+    diode.mutable_ideal_diode()->set_voltage(0.7);
+    diode.set_current(current);
+    addEdge(message, gen, cathode, ref)
+        .mutable_resistor()
+        ->set_resistance(1000);
+    buffer = message.SerializeAsString();
+  }
+
+  proto::CircuitGraph message;
+  std::string buffer;
+  std::string anode;
+  std::string cathode;
+};
+
+TEST(ApiTest, SolutionCache) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 5);
+  auto solve = [&]() {
+    void* output = nullptr;
+    size_t outputLength = 0;
+    EXPECT_EQ(0, solveGraphFromBuffer(divider.buffer.data(),
+                                      divider.buffer.size(), &output,
+                                      &outputLength));
+    proto::CircuitGraph solved;
+    EXPECT_TRUE(
+        solved.ParseFromArray(output, static_cast<int>(outputLength)));
+    destroyGraphBuffer(output);
+    return solved.vertices().at(divider.out).voltage();
+  };
+  unsigned long long hits, misses;
+
+  double first = solve();
+  EXPECT_EQ(first, solve());
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(1u, hits);
+  EXPECT_EQ(1u, misses);
+
+  setSolutionCacheCapacity(0);
+  EXPECT_TRUE(IsWithinRelativeTolerance(first, solve()));
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(1u, hits);
+  setSolutionCacheCapacity(256);
+  clearSolutionCache();
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(0u, hits);
+  EXPECT_EQ(0u, misses);
+}
+
+TEST(ApiTest, SolveLongChain) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  // Refining the colours of the canonical form to the end would take a round
+  // for every vertex along the chain
+  const size_t length = 5000;
+  proto::CircuitGraph message;
+  std::string ref = addVertex(message, gen, 0);
+  std::string previous = addVertex(message, gen, 10);
+  std::string middle;
+  for (size_t i = 1; i < length; i++) {
+    std::string next = addVertex(message, gen);
+    addEdge(message, gen, previous, next).mutable_resistor()->set_resistance(1);
+    if (i == length / 2) {
+      middle = next;
+    }
+    previous = next;
+  }
+  addEdge(message, gen, previous, ref).mutable_resistor()->set_resistance(1);
+  std::string buffer = message.SerializeAsString();
+  auto solve = [&]() {
+    void* output = nullptr;
+    size_t outputLength = 0;
+    EXPECT_EQ(0, solveGraphFromBuffer(buffer.data(), buffer.size(), &output,
+                                      &outputLength));
+    proto::CircuitGraph solved;
+    EXPECT_TRUE(
+        solved.ParseFromArray(output, static_cast<int>(outputLength)));
+    destroyGraphBuffer(output);
+    return solved.vertices().at(middle).voltage();
+  };
+
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, solve()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, solve()));
+  unsigned long long hits, misses;
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(1u, hits);
+  EXPECT_EQ(1u, misses);
+}
+
+TEST(ApiTest, SolutionCacheKeysOnEveryGivenValue) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  options.maxSolveAttempts = 1;
+  auto solve = [&](DiodeSeries& circuit, proto::CircuitGraph& solved) {
+    void* output = nullptr;
+    size_t outputLength = 0;
+    int status = solveGraphFromBufferWithOptions(
+        circuit.buffer.data(), circuit.buffer.size(), &output, &outputLength,
+        &options);
+    if (status == 0) {
+      EXPECT_TRUE(
+          solved.ParseFromArray(output, static_cast<int>(outputLength)));
+      destroyGraphBuffer(output);
+    }
+    return status;
+  };
+  unsigned long long hits, misses;
+
+  DiodeSeries balanced(gen, 2.5e-3);
+  proto::CircuitGraph solved;
+  ASSERT_EQ(0, solve(balanced, solved));
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      2.5, solved.vertices().at(balanced.anode).voltage()));
+
+  // The diodes only differ in their given current, which is not one of
+  // their parameters
+  DiodeSeries unbalanced(gen, 1e-3);
+  proto::CircuitGraph other;
+  if (solve(unbalanced, other) == 0) {
+    EXPECT_FALSE(IsWithinRelativeTolerance(
+        2.5, other.vertices().at(unbalanced.anode).voltage()));
+  }
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(0u, hits);
+
+  // The same circuit with other ids is a hit, answered with its own ids
+  DiodeSeries renamed(gen, 2.5e-3);
+  ASSERT_EQ(0, solve(renamed, solved));
+  getSolutionCacheStats(&hits, &misses);
+  EXPECT_EQ(1u, hits);
+  EXPECT_EQ(renamed.message.vertices().size(), solved.vertices().size());
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      2.5, solved.vertices().at(renamed.cathode).voltage()));
+  for (auto& entry : renamed.message.edges()) {
+    const proto::Edge& edge = solved.edges().at(entry.first);
+    EXPECT_EQ(entry.second.from_id(), edge.from_id());
+    EXPECT_EQ(entry.second.to_id(), edge.to_id());
+    EXPECT_TRUE(IsWithinRelativeTolerance(2.5e-3, edge.current()));
+  }
+}
+
+TEST(ApiTest, StructuralErrors) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  void* output = nullptr;
+  size_t outputLength = 0;
+
+  Divider floating(gen, 5);
+  std::string a = addVertex(floating.message, gen);
+  std::string b = addVertex(floating.message, gen);
+  addEdge(floating.message, gen, a, b).mutable_resistor()->set_resistance(1);
+  std::string buffer = floating.message.SerializeAsString();
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_FLOATING_VERTEX,
+            solveGraphFromBuffer(buffer.data(), buffer.size(), &output,
+                                 &outputLength));
+
+  Divider loop(gen, 5);
+  const proto::Edge& source = loop.message.edges().at(loop.source);
+  std::string from = source.from_id();
+  std::string to = source.to_id();
+  addEdge(loop.message, gen, from, to).mutable_voltage_source()->set_voltage(
+      5);
+  buffer = loop.message.SerializeAsString();
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_VOLTAGE_SOURCE_LOOP,
+            solveGraphFromBuffer(buffer.data(), buffer.size(), &output,
+                                 &outputLength));
+}
+
+TEST(ApiTest, BatchParsesLengthDelimitedMessages) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  Divider first(gen, 5);
+  Divider second(gen, 10);
+  std::string input = toBatch({first.buffer, second.buffer});
+  void* output = nullptr;
+  size_t outputLength = 0;
+
+  ASSERT_EQ(0, solveGraphBatchFromBuffer(input.data(), input.size(), &output,
+                                         &outputLength, nullptr));
+  std::vector<proto::SolveResult> results = fromBatch(output, outputLength);
+  destroyGraphBuffer(output);
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(0, results[0].status());
+  EXPECT_EQ(0, results[1].status());
+
+  // An empty batch has no results
+  ASSERT_EQ(0, solveGraphBatchFromBuffer(input.data(), 0, &output,
+                                         &outputLength, nullptr));
+  EXPECT_EQ(0u, fromBatch(output, outputLength).size());
+  destroyGraphBuffer(output);
+
+  // A length that runs past the end of the buffer fails the whole batch
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphBatchFromBuffer(input.data(), input.size() - 1, &output,
+                                      &outputLength, nullptr));
+  std::string unterminated = "\xff";
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            solveGraphBatchFromBuffer(unterminated.data(),
+                                      unterminated.size(), &output,
+                                      &outputLength, nullptr));
+}
+
+TEST(ApiTest, BatchReportsStatusPerCircuit) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  Divider good(gen, 5);
+  Divider floating(gen, 5);
+  std::string a = addVertex(floating.message, gen);
+  std::string b = addVertex(floating.message, gen);
+  addEdge(floating.message, gen, a, b).mutable_resistor()->set_resistance(1);
+  // A bad message only fails its own entry
+  std::string input = toBatch({good.buffer, "\xff\xff\xff",
+                               floating.message.SerializeAsString(),
+                               good.buffer});
+
+  void* output = nullptr;
+  size_t outputLength = 0;
+  ASSERT_EQ(0, solveGraphBatchFromBuffer(input.data(), input.size(), &output,
+                                         &outputLength, nullptr));
+  std::vector<proto::SolveResult> results = fromBatch(output, outputLength);
+  destroyGraphBuffer(output);
+  ASSERT_EQ(4u, results.size());
+  EXPECT_EQ(0, results[0].status());
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      3, results[0].graph().vertices().at(good.out).voltage()));
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT, results[1].status());
+  EXPECT_FALSE(results[1].has_graph());
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_FLOATING_VERTEX, results[2].status());
+  EXPECT_FALSE(results[2].has_graph());
+  EXPECT_EQ(0, results[3].status());
+}
+
+TEST(ApiTest, BatchKeepsOrder) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  std::vector<Divider> dividers;
+  std::vector<std::string> buffers;
+  for (int i = 0; i < 32; i++) {
+    dividers.emplace_back(gen, i);
+    buffers.push_back(dividers.back().buffer);
+  }
+  std::string input = toBatch(buffers);
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  options.batchThreads = 4;
+
+  // Batches from several threads at once, each of which has to get its own
+  // results back in the order of its circuits
+  std::vector<std::thread> threads;
+  std::vector<std::vector<proto::SolveResult>> results(3);
+  for (auto& threadResults : results) {
+    threads.emplace_back([&]() {
+      void* output = nullptr;
+      size_t outputLength = 0;
+      EXPECT_EQ(0, solveGraphBatchFromBuffer(input.data(), input.size(),
+                                             &output, &outputLength,
+                                             &options));
+      threadResults = fromBatch(output, outputLength);
+      destroyGraphBuffer(output);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& threadResults : results) {
+    ASSERT_EQ(dividers.size(), threadResults.size());
+    for (size_t i = 0; i < dividers.size(); i++) {
+      EXPECT_EQ(0, threadResults[i].status());
+      EXPECT_TRUE(IsWithinRelativeTolerance(
+          0.6 * i,
+          threadResults[i].graph().vertices().at(dividers[i].out).voltage()));
+    }
+  }
+}
+
+TEST(ApiTest, DcSweep) {
+  auto gen = getUuidGenerator();
+  Divider divider(gen, 0);
+  void* output = nullptr;
+  size_t outputLength = 0;
+  ASSERT_EQ(0, sweepGraphFromBuffer(divider.buffer.data(),
+                                    divider.buffer.size(),
+                                    divider.source.c_str(), "voltage", 0, 5,
+                                    6, &output, &outputLength, nullptr));
+  proto::DcSweep table;
+  ASSERT_TRUE(table.ParseFromArray(output, static_cast<int>(outputLength)));
+  destroyGraphBuffer(output);
+  ASSERT_EQ(6, table.values_size());
+  int outColumn = static_cast<int>(
+      std::find(table.vertex_ids().begin(), table.vertex_ids().end(),
+                divider.out) -
+      table.vertex_ids().begin());
+  ASSERT_LT(outColumn, table.vertex_ids_size());
+  for (int i = 0; i < table.values_size(); i++) {
+    EXPECT_TRUE(table.solved(i));
+    EXPECT_TRUE(IsWithinRelativeTolerance(i, table.values(i)));
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        0.6 * i, table.voltages(i * table.vertex_ids_size() + outColumn)));
+  }
+
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            sweepGraphFromBuffer(divider.buffer.data(), divider.buffer.size(),
+                                 divider.source.c_str(), "resistance", 0, 5,
+                                 6, &output, &outputLength, nullptr));
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            sweepGraphFromBuffer(divider.buffer.data(), divider.buffer.size(),
+                                 "not an id", "voltage", 0, 5, 6, &output,
+                                 &outputLength, nullptr));
+}
+
+/**
+ * A 1V source driving a 1k resistor into a 1uF capacitor
+ */
+struct LowPass {
+  explicit LowPass(uuids::uuid_random_generator& gen) {
+    std::string ref = addVertex(message, gen, 0);
+    std::string in = addVertex(message, gen);
+    out = addVertex(message, gen);
+    proto::Edge& vs = addEdge(message, gen, ref, in);
+    vs.mutable_voltage_source()->set_voltage(1);
+    source = vs.id();
+    addEdge(message, gen, in, out).mutable_resistor()->set_resistance(1000);
+    addEdge(message, gen, out, ref).mutable_capacitor()->set_capacitance(1e-6);
+    buffer = message.SerializeAsString();
+  }
+
+  proto::CircuitGraph message;
+  std::string buffer;
+  std::string out;
+  std::string source;
+};
+
+TEST(ApiTest, AcSweep) {
+  auto gen = getUuidGenerator();
+  LowPass lowPass(gen);
+  void* output = nullptr;
+  size_t outputLength = 0;
+  ASSERT_EQ(0, acSweepGraphFromBuffer(lowPass.buffer.data(),
+                                      lowPass.buffer.size(),
+                                      lowPass.source.c_str(), 1, 1e5, 6,
+                                      &output, &outputLength, nullptr));
+  proto::AcSweep table;
+  ASSERT_TRUE(table.ParseFromArray(output, static_cast<int>(outputLength)));
+  destroyGraphBuffer(output);
+  ASSERT_EQ(6, table.frequencies_size());
+  int outColumn = static_cast<int>(
+      std::find(table.vertex_ids().begin(), table.vertex_ids().end(),
+                lowPass.out) -
+      table.vertex_ids().begin());
+  ASSERT_LT(outColumn, table.vertex_ids_size());
+  const double cutoff = 1 / (2 * M_PI * 1000 * 1e-6);
+  for (int i = 0; i < table.frequencies_size(); i++) {
+    EXPECT_TRUE(table.solved(i));
+    double ratio = table.frequencies(i) / cutoff;
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        1 / std::sqrt(1 + ratio * ratio),
+        table.voltage_magnitudes(i * table.vertex_ids_size() + outColumn)));
+  }
+}
+
+TEST(ApiTest, Simulate) {
+  auto gen = getUuidGenerator();
+  LowPass lowPass(gen);
+  // The vertices are passed to the callback in ascending order of their ids
+  std::vector<std::string> vertexIds;
+  for (auto& vertex : lowPass.message.vertices()) {
+    vertexIds.push_back(vertex.first);
+  }
+  std::sort(vertexIds.begin(), vertexIds.end(),
+            [](const std::string& a, const std::string& b) {
+              return uuids::uuid::from_string(a).value() <
+                     uuids::uuid::from_string(b).value();
+            });
+  struct Steps {
+    size_t outIndex;
+    size_t count = 0;
+    size_t stopAfter = 0;
+    double lastTime = 0;
+    double lastVoltage = 0;
+  } steps;
+  steps.outIndex =
+      std::find(vertexIds.begin(), vertexIds.end(), lowPass.out) -
+      vertexIds.begin();
+  CircuitSolverTransientCallback callback =
+      [](double time, const double* voltages, const double*, void* userData) {
+        Steps& steps = *static_cast<Steps*>(userData);
+        steps.count++;
+        steps.lastTime = time;
+        steps.lastVoltage = voltages[steps.outIndex];
+        return steps.count == steps.stopAfter ? 1 : 0;
+      };
+
+  ASSERT_EQ(0, simulateGraphFromBuffer(
+                   lowPass.buffer.data(), lowPass.buffer.size(), 5e-3, 1e-4,
+                   CIRCUITSOLVER_INTEGRATION_TRAPEZOIDAL, callback, &steps,
+                   nullptr));
+  EXPECT_NEAR(5e-3, steps.lastTime, 1e-12);
+  EXPECT_TRUE(IsWithinRelativeTolerance(1 - std::exp(-5.0),
+                                        steps.lastVoltage, 1e-2));
+
+  // Returning non-zero from the callback ends the simulation
+  size_t count = steps.count;
+  steps = Steps{steps.outIndex, 0, 3};
+  ASSERT_EQ(0, simulateGraphFromBuffer(
+                   lowPass.buffer.data(), lowPass.buffer.size(), 5e-3, 1e-4,
+                   CIRCUITSOLVER_INTEGRATION_BACKWARD_EULER, callback, &steps,
+                   nullptr));
+  EXPECT_EQ(3u, steps.count);
+  EXPECT_LT(steps.count, count);
+
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_INVALID_INPUT,
+            simulateGraphFromBuffer(lowPass.buffer.data(),
+                                    lowPass.buffer.size(), 5e-3, 1e-4, 2,
+                                    callback, &steps, nullptr));
+
+  // Structural errors are reported as when solving
+  std::string a = addVertex(lowPass.message, gen);
+  std::string b = addVertex(lowPass.message, gen);
+  addEdge(lowPass.message, gen, a, b).mutable_resistor()->set_resistance(1);
+  std::string floating = lowPass.message.SerializeAsString();
+  EXPECT_EQ(CIRCUITSOLVER_ERROR_FLOATING_VERTEX,
+            simulateGraphFromBuffer(floating.data(), floating.size(), 5e-3,
+                                    1e-4, CIRCUITSOLVER_INTEGRATION_TRAPEZOIDAL,
+                                    callback, &steps, nullptr));
+}
+
+TEST(ApiTest, NativeCode) {
+  clearSolutionCache();
+  auto gen = getUuidGenerator();
+  proto::CircuitGraph message;
+  std::string ref = addVertex(message, gen, 0);
+  std::string vcc = addVertex(message, gen, 5);
+  std::string anode = addVertex(message, gen);
+  addEdge(message, gen, vcc, anode).mutable_resistor()->set_resistance(1000);
+  proto::Edge& diode = addEdge(message, gen, anode, ref);
+  diode.mutable_real_diode()->set_i0(1e-14);
+  diode.mutable_real_diode()->set_n(1);
+  diode.mutable_real_diode()->set_vt(25e-3);
+  std::string buffer = message.SerializeAsString();
+
+  CircuitSolverOptions options;
+  options.size = sizeof(options);
+  getDefaultSolverOptions(&options);
+  auto solve = [&]() {
+    void* output = nullptr;
+    size_t outputLength = 0;
+    EXPECT_EQ(0, solveGraphFromBufferWithOptions(buffer.data(), buffer.size(),
+                                                 &output, &outputLength,
+                                                 &options));
+    proto::CircuitGraph solved;
+    EXPECT_TRUE(
+        solved.ParseFromArray(output, static_cast<int>(outputLength)));
+    destroyGraphBuffer(output);
+    return solved.vertices().at(anode).voltage();
+  };
+  double expected = solve();
+
+  namespace fs = std::filesystem;
+  Expression x;
+  if (NativeCode::load({(x * x).compileWithDerivatives()}, "",
+                       ::testing::TempDir() + "apiNativeCodeProbe") ==
+      nullptr) {
+    GTEST_SKIP() << "No C++ compiler to generate code with";
+  }
+  // The code is cached in a directory of its own, to see that it was used
+  fs::path cacheHome = ::testing::TempDir() + "apiNativeCode";
+  fs::remove_all(cacheHome);
+  const char* previous = std::getenv("XDG_CACHE_HOME");
+  std::string previousCacheHome = previous != nullptr ? previous : "";
+  setenv("XDG_CACHE_HOME", cacheHome.c_str(), 1);
+  options.engine = CIRCUITSOLVER_ENGINE_CERES;
+  options.nativeCode = 1;
+  EXPECT_TRUE(IsWithinRelativeTolerance(expected, solve()));
+  if (previous != nullptr) {
+    setenv("XDG_CACHE_HOME", previousCacheHome.c_str(), 1);
+  } else {
+    unsetenv("XDG_CACHE_HOME");
+  }
+  size_t libraries = 0;
+  std::error_code error;
+  for (auto& entry :
+       fs::directory_iterator(cacheHome / "circuitSolver", error)) {
+    libraries += entry.path().extension() == ".so";
+  }
+  EXPECT_GT(libraries, 0u);
+}
@@ -1,10 +1,13 @@
 #include <google/protobuf/util/json_util.h>
 #include <gtest/gtest.h>
+
+#include <algorithm>
 #include <uuid.h>
 
 #include "src/branch.h"
 #include "src/circuitGraph.h"
 #include "src/proto.h"
+#include "src/solutionCache.h"
 #include "utils.h"
 
 TEST(CircuitTest, BuildBasicCircuit) {
@@ -75,6 +78,50 @@ TEST(CircuitTest, RealDiode) {
   EXPECT_TRUE(IsWithinRelativeTolerance(8.006, v2.getVoltage().evaluate()));
   EXPECT_TRUE(IsWithinRelativeTolerance(337.17e-6, d.getCurrent().evaluate()));
 }
+TEST(CircuitTest, RealDiodeStringNewton) {
+  // Each diode drops about 0.7V; the first iterate starts every junction at
+  // its critical voltage, so the limiting has to walk them into place
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 5);
+  std::vector<Vertex> anodes;
+  for (int i = 0; i < 4; i++) {
+    anodes.emplace_back(gen());
+  }
+  Edge r(gen(), Resistor(vcc, anodes[0], 100));
+  std::vector<Edge> diodes;
+  for (int i = 0; i < 4; i++) {
+    const Vertex& cathode = i == 3 ? ref : anodes[i + 1];
+    diodes.emplace_back(gen(), RealDiode(anodes[i], cathode, 1e-14, 1, 25e-3));
+  }
+  EXPECT_TRUE(cg.addVertex(ref));
+  EXPECT_TRUE(cg.addVertex(vcc));
+  for (auto& anode : anodes) {
+    EXPECT_TRUE(cg.addVertex(anode));
+  }
+  EXPECT_TRUE(cg.addEdge(r));
+  for (auto& diode : diodes) {
+    EXPECT_TRUE(cg.addEdge(diode));
+  }
+
+  SolverConfig config;
+  config.engine = SolverEngine::NEWTON;
+  config.maxNewtonIterations = 50;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  double current = r.getCurrent().evaluate();
+  EXPECT_GT(current, 0);
+  for (int i = 0; i < 4; i++) {
+    double cathode = i == 3 ? 0 : anodes[i + 1].getVoltage().evaluate();
+    double drop = anodes[i].getVoltage().evaluate() - cathode;
+    EXPECT_TRUE(IsWithinRelativeTolerance(anodes[0].getVoltage().evaluate() / 4,
+                                          drop));
+    EXPECT_TRUE(
+        IsWithinRelativeTolerance(current, 1e-14 * std::exp(drop / 25e-3)));
+    EXPECT_TRUE(IsWithinRelativeTolerance(current,
+                                          diodes[i].getCurrent().evaluate()));
+  }
+}
 TEST(CircuitTest, IdealDiode) {
   CircuitGraph cg;
   auto gen = getUuidGenerator();
@@ -163,4 +210,934 @@ TEST(CircuitTest, BasicCircuitToProtobuf) {
   // std::cout << output << std::endl;
 }
 
-TEST(CircuitTest, LargeCircuit) {}
+TEST(CircuitTest, LargeCircuit) {
+  // A chain of resistors between 10V and 0V; far too many unknowns to solve
+  // with a dense least squares solver
+  const size_t numResistors = 20000;
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  std::vector<Vertex> chain;
+  chain.reserve(numResistors + 1);
+  chain.emplace_back(gen(), 10);
+  for (size_t i = 1; i < numResistors; i++) {
+    chain.emplace_back(gen());
+  }
+  chain.emplace_back(gen(), 0);
+  for (auto& vertex : chain) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  std::vector<Edge> resistors;
+  resistors.reserve(numResistors);
+  for (size_t i = 0; i < numResistors; i++) {
+    resistors.emplace_back(gen(), Resistor(chain[i], chain[i + 1], 5));
+    EXPECT_TRUE(cg.addEdge(resistors.back()));
+  }
+  ASSERT_TRUE(cg.solveCircuit());
+  for (size_t i = 0; i <= numResistors; i += 1000) {
+    double expected = 10.0 * (numResistors - i) / numResistors;
+    EXPECT_NEAR(expected, chain[i].getVoltage().evaluate(), 1e-9);
+  }
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      10.0 / (5 * numResistors), resistors.front().getCurrent().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      10.0 / (5 * numResistors), resistors.back().getCurrent().evaluate()));
+}
+
+TEST(CircuitTest, IdealDiodeParallelPartitions) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex v2(gen());
+  Vertex v3(gen());
+  Vertex vcc(gen(), 15);
+  Edge d1(gen(), IdealDiode(v1, v2));
+  Edge d2(gen(), IdealDiode(v3, v2));
+  Edge r1(gen(), Resistor(vcc, v1, 2000));
+  Edge r2(gen(), Resistor(v1, ref, 3000));
+  Edge r3(gen(), Resistor(vcc, v2, 3000));
+  Edge r4(gen(), Resistor(v2, ref, 3000));
+  Edge r5(gen(), Resistor(v3, ref, 1000));
+  EXPECT_TRUE(cg.addVertex(ref));
+  EXPECT_TRUE(cg.addVertex(v1));
+  EXPECT_TRUE(cg.addVertex(v2));
+  EXPECT_TRUE(cg.addVertex(v3));
+  EXPECT_TRUE(cg.addVertex(vcc));
+  for (auto edge : {d1, d2, r1, r2, r3, r4, r5}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SolverConfig config;
+  config.partitionThreads = 4;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  // d2 is reverse biased, so the result matches the single diode circuit
+  EXPECT_TRUE(IsWithinRelativeTolerance(25.0 / 3, v1.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(25.0 / 3, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(0, v3.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(1.0 / 1800, d1.getCurrent().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(0, d2.getCurrent().evaluate()));
+}
+
+TEST(CircuitTest, IdealDiodeForwardVoltageParallelPartitions) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex v2(gen());
+  Vertex vcc(gen(), 15);
+  Edge d(gen(), IdealDiode(v1, v2, 0.7));
+  Edge r1(gen(), Resistor(vcc, v1, 2000));
+  Edge r2(gen(), Resistor(v1, ref, 3000));
+  Edge r3(gen(), Resistor(vcc, v2, 3000));
+  Edge r4(gen(), Resistor(v2, ref, 3000));
+  EXPECT_TRUE(cg.addVertex(ref));
+  EXPECT_TRUE(cg.addVertex(v1));
+  EXPECT_TRUE(cg.addVertex(v2));
+  EXPECT_TRUE(cg.addVertex(vcc));
+  for (auto edge : {d, r1, r2, r3, r4}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  config.partitionThreads = 2;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(25.0 / 3, v1.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(25.0 / 3, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(1.0 / 1800, d.getCurrent().evaluate()));
+}
+
+TEST(CircuitTest, DisconnectedSubcircuitsSolvedIndependently) {
+  // Two copies of the ideal diode circuit that only share their known
+  // vertices, so each is solved with its own diode partitions
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 15);
+  EXPECT_TRUE(cg.addVertex(ref));
+  EXPECT_TRUE(cg.addVertex(vcc));
+  // Branches refer to their vertices, so they must not move
+  const std::vector<Vertex> v1s = {Vertex(gen()), Vertex(gen())};
+  const std::vector<Vertex> v2s = {Vertex(gen()), Vertex(gen())};
+  std::vector<Edge> diodes;
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(cg.addVertex(v1s[i]));
+    EXPECT_TRUE(cg.addVertex(v2s[i]));
+    Edge d(gen(), IdealDiode(v1s[i], v2s[i], 0.7));
+    Edge r1(gen(), Resistor(vcc, v1s[i], 2000));
+    Edge r2(gen(), Resistor(v1s[i], ref, 3000));
+    Edge r3(gen(), Resistor(vcc, v2s[i], 3000));
+    Edge r4(gen(), Resistor(v2s[i], ref, 3000));
+    for (auto edge : {d, r1, r2, r3, r4}) {
+      EXPECT_TRUE(cg.addEdge(edge));
+    }
+    diodes.push_back(d);
+  }
+
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  config.partitionThreads = 2;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  for (int i = 0; i < 2; i++) {
+    EXPECT_TRUE(
+        IsWithinRelativeTolerance(25.0 / 3, v1s[i].getVoltage().evaluate()));
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        1.0 / 1800, diodes[i].getCurrent().evaluate()));
+  }
+}
+
+TEST(CircuitTest, TopologyReductionRecoversEveryValue) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  // Two 5V sources in series driving a ladder that reduces to one resistor
+  Vertex a(gen()), b(gen()), c(gen()), d(gen());
+  Edge vs1(gen(), VoltageSource(ref, a, 5));
+  Edge vs2(gen(), VoltageSource(a, b, 5));
+  Edge r1(gen(), Resistor(b, c, 1000));
+  Edge r2(gen(), Resistor(c, d, 1000));
+  Edge r3(gen(), Resistor(d, ref, 2000));
+  Edge r4(gen(), Resistor(ref, d, 2000));
+  // A 3V source behind a resistor, which becomes a current source, feeding a
+  // node with two current sources and a resistor to ground
+  Vertex e(gen()), f(gen());
+  Edge vs3(gen(), VoltageSource(ref, e, 3));
+  Edge r5(gen(), Resistor(e, f, 1000));
+  Edge cs1(gen(), CurrentSource(ref, f, 0.001));
+  Edge cs2(gen(), CurrentSource(ref, f, 0.001));
+  Edge r6(gen(), Resistor(f, ref, 1000));
+  for (auto vertex : {ref, a, b, c, d, e, f}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto edge : {vs1, vs2, r1, r2, r3, r4, vs3, r5, cs1, cs2, r6}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, a.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(10, b.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(20.0 / 3, c.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(10.0 / 3, d.getVoltage().evaluate()));
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(1.0 / 300, vs1.getCurrent().evaluate()));
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(1.0 / 300, vs2.getCurrent().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(1.0 / 600, r3.getCurrent().evaluate()));
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(-1.0 / 600, r4.getCurrent().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(3, e.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(2.5, f.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5e-4, vs3.getCurrent().evaluate()));
+  auto proto = cg.toProto();
+  EXPECT_EQ(7, proto.vertices_size());
+  EXPECT_EQ(11, proto.edges_size());
+  EXPECT_TRUE(IsWithinRelativeTolerance(
+      2.5, proto.edges()
+               .at(uuids::to_string(cs1.getId()))
+               .current_source()
+               .voltage()));
+}
+
+TEST(CircuitTest, VoltageSourcesPinTheirVertices) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex a(gen()), b(gen()), c(gen());
+  Edge vs1(gen(), VoltageSource(ref, a, 5));
+  Edge vs2(gen(), VoltageSource(a, b, 3.3));
+  Edge r1(gen(), Resistor(b, c, 1000));
+  Edge r2(gen(), Resistor(c, ref, 1000));
+  Edge r3(gen(), Resistor(a, c, 2000));
+  for (auto vertex : {ref, a, b, c}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto edge : {vs1, vs2, r1, r2, r3}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, a.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(8.3, b.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(4.32, c.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(3.98e-3, vs2.getCurrent().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(4.32e-3, vs1.getCurrent().evaluate()));
+
+  // Sources in parallel that disagree have no solution
+  CircuitGraph conflicting;
+  Vertex d(gen());
+  Edge vs3(gen(), VoltageSource(ref, d, 5));
+  Edge vs4(gen(), VoltageSource(ref, d, 3));
+  EXPECT_TRUE(conflicting.addVertex(ref));
+  EXPECT_TRUE(conflicting.addVertex(d));
+  EXPECT_TRUE(conflicting.addEdge(vs3));
+  EXPECT_TRUE(conflicting.addEdge(vs4));
+  EXPECT_FALSE(conflicting.solveCircuit(config));
+  EXPECT_FALSE(d.getVoltage().isConstant());
+}
+
+TEST(CircuitTest, SourcesBetweenGivenVoltagesCarryTheirCurrent) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 5);
+  Vertex a(gen()), b(gen());
+  Edge supply(gen(), VoltageSource(ref, vcc, 5));
+  Edge vs(gen(), VoltageSource(vcc, a, 1));
+  Edge r1(gen(), Resistor(a, b, 1000));
+  Edge r2(gen(), Resistor(b, ref, 2000));
+  Edge r3(gen(), Resistor(vcc, ref, 500));
+  for (auto vertex : {ref, vcc, a, b}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto edge : {supply, vs, r1, r2, r3}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+  EXPECT_EQ(StructuralError::NONE, cg.checkStructure());
+
+  ASSERT_TRUE(cg.solveCircuit());
+  EXPECT_TRUE(IsWithinRelativeTolerance(6, a.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(4, b.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(2e-3, vs.getCurrent().evaluate()));
+  // The supply provides the current drawn from vcc by both branches
+  EXPECT_TRUE(supply.getCurrent().isSolved());
+  EXPECT_TRUE(IsWithinRelativeTolerance(12e-3, supply.getCurrent().evaluate()));
+
+  // A source that disagrees with the voltages it joins has no solution
+  CircuitGraph conflicting;
+  Vertex high(gen(), 3);
+  EXPECT_TRUE(conflicting.addVertex(ref));
+  EXPECT_TRUE(conflicting.addVertex(high));
+  EXPECT_TRUE(conflicting.addEdge(Edge(gen(), VoltageSource(ref, high, 5))));
+  EXPECT_TRUE(conflicting.addEdge(Edge(gen(), Resistor(high, ref, 1000))));
+  EXPECT_EQ(StructuralError::NONE, conflicting.checkStructure());
+  EXPECT_FALSE(conflicting.solveCircuit());
+
+  // Sources between given voltages can still form a loop of their own
+  CircuitGraph loop;
+  for (auto vertex : {ref, vcc, high}) {
+    EXPECT_TRUE(loop.addVertex(vertex));
+  }
+  EXPECT_TRUE(loop.addEdge(Edge(gen(), VoltageSource(ref, vcc, 5))));
+  EXPECT_TRUE(loop.addEdge(Edge(gen(), VoltageSource(ref, high, 3))));
+  EXPECT_TRUE(loop.addEdge(Edge(gen(), VoltageSource(high, vcc, 2))));
+  EXPECT_EQ(StructuralError::VOLTAGE_SOURCE_LOOP, loop.checkStructure());
+}
+
+TEST(CircuitTest, HomotopyConvergesWithoutRandomRestarts) {
+  // A string of three diodes driven hard through a small resistor, with too
+  // few iterations for ceres to get there from its starting point
+  auto solveString = [](Homotopy homotopy, unsigned maxIterations,
+                        double& voltage) {
+    CircuitGraph cg;
+    auto gen = getUuidGenerator();
+    Vertex ref(gen(), 0);
+    Vertex vcc(gen(), 20);
+    const std::vector<Vertex> anodes = {Vertex(gen()), Vertex(gen()),
+                                        Vertex(gen())};
+    EXPECT_TRUE(cg.addVertex(ref));
+    EXPECT_TRUE(cg.addVertex(vcc));
+    for (auto& anode : anodes) {
+      EXPECT_TRUE(cg.addVertex(anode));
+    }
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(vcc, anodes[0], 100))));
+    for (size_t i = 0; i < anodes.size(); i++) {
+      const Vertex& cathode = i + 1 < anodes.size() ? anodes[i + 1] : ref;
+      EXPECT_TRUE(
+          cg.addEdge(Edge(gen(), RealDiode(anodes[i], cathode, 1e-14, 1,
+                                           25e-3))));
+    }
+    SolverConfig config;
+    config.engine = SolverEngine::CERES;
+    config.homotopy = homotopy;
+    config.maxIterations = maxIterations;
+    config.maxSolveAttempts = 2;
+    bool solved = cg.solveCircuit(config);
+    voltage = anodes[0].getVoltage().evaluate();
+    return solved;
+  };
+
+  double expected;
+  ASSERT_TRUE(solveString(Homotopy::NONE, 1000, expected));
+  double voltage;
+  EXPECT_FALSE(solveString(Homotopy::NONE, 5, voltage));
+  ASSERT_TRUE(solveString(Homotopy::SOURCE_STEPPING, 5, voltage));
+  EXPECT_TRUE(IsWithinRelativeTolerance(expected, voltage));
+  ASSERT_TRUE(solveString(Homotopy::GMIN_STEPPING, 5, voltage));
+  EXPECT_TRUE(IsWithinRelativeTolerance(expected, voltage));
+}
+
+TEST(CircuitTest, SourceSteppingRampsFoldedSources) {
+  // Diodes driven only by the current a zener diode passes with no bias, with
+  // too few iterations to get there from 0
+  auto solveString = [](Homotopy homotopy, unsigned maxIterations,
+                        double& voltage, unsigned& attempts) {
+    CircuitGraph cg;
+    auto gen = getUuidGenerator();
+    Vertex ref(gen(), 0);
+    const std::vector<Vertex> anodes = {Vertex(gen()), Vertex(gen())};
+    EXPECT_TRUE(cg.addVertex(ref));
+    for (auto& anode : anodes) {
+      EXPECT_TRUE(cg.addVertex(anode));
+    }
+    EXPECT_TRUE(
+        cg.addEdge(Edge(gen(), ZenerDiode(ref, anodes[0], 0.02, 10, 5))));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(anodes[0], ref, 1000))));
+    EXPECT_TRUE(cg.addEdge(
+        Edge(gen(), RealDiode(anodes[0], anodes[1], 1e-14, 1, 25e-3))));
+    EXPECT_TRUE(cg.addEdge(
+        Edge(gen(), RealDiode(anodes[1], ref, 1e-14, 1, 25e-3))));
+    SolverConfig config;
+    config.engine = SolverEngine::CERES;
+    config.homotopy = homotopy;
+    config.maxIterations = maxIterations;
+    config.maxSolveAttempts = 2;
+    bool solved = cg.solveCircuit(config);
+    voltage = anodes[0].getVoltage().evaluate();
+    attempts = cg.getSolveAttempts();
+    return solved;
+  };
+
+  double expected;
+  unsigned attempts;
+  ASSERT_TRUE(solveString(Homotopy::NONE, 1000, expected, attempts));
+  double voltage;
+  EXPECT_FALSE(solveString(Homotopy::NONE, 5, voltage, attempts));
+  // One attempt from 0, the chain of easier circuits, then one from its end
+  ASSERT_TRUE(solveString(Homotopy::SOURCE_STEPPING, 5, voltage, attempts));
+  EXPECT_EQ(2u, attempts);
+  EXPECT_TRUE(IsWithinRelativeTolerance(expected, voltage));
+}
+
+TEST(CircuitTest, CanonicalHashIgnoresConstructionOrder) {
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex vcc(gen(), 15);
+  Edge r1(gen(), Resistor(vcc, v1, 2000));
+  Edge r2(gen(), Resistor(v1, ref, 3000));
+  Edge d(gen(), IdealDiode(v1, ref, 0.7));
+  CircuitGraph forwards;
+  for (auto vertex : {ref, v1, vcc}) {
+    EXPECT_TRUE(forwards.addVertex(vertex));
+  }
+  for (auto edge : {r1, r2, d}) {
+    EXPECT_TRUE(forwards.addEdge(edge));
+  }
+  CircuitGraph backwards;
+  for (auto vertex : {vcc, v1, ref}) {
+    EXPECT_TRUE(backwards.addVertex(vertex));
+  }
+  for (auto edge : {d, r2, r1}) {
+    EXPECT_TRUE(backwards.addEdge(edge));
+  }
+  uint64_t hash = forwards.getCanonicalHash();
+  EXPECT_EQ(hash, backwards.getCanonicalHash());
+
+  // Nor on the ids of its vertices and edges
+  Vertex otherRef(gen(), 0);
+  Vertex otherV1(gen());
+  Vertex otherVcc(gen(), 15);
+  CircuitGraph renamed;
+  for (auto vertex : {otherVcc, otherRef, otherV1}) {
+    EXPECT_TRUE(renamed.addVertex(vertex));
+  }
+  EXPECT_TRUE(renamed.addEdge(Edge(gen(), IdealDiode(otherV1, otherRef, 0.7))));
+  EXPECT_TRUE(renamed.addEdge(Edge(gen(), Resistor(otherV1, otherRef, 3000))));
+  EXPECT_TRUE(renamed.addEdge(Edge(gen(), Resistor(otherVcc, otherV1, 2000))));
+  std::vector<uuids::uuid> vertexIds, edgeIds;
+  EXPECT_EQ(forwards.getCanonicalForm(),
+            renamed.getCanonicalForm(vertexIds, edgeIds));
+  EXPECT_EQ(3u, vertexIds.size());
+  EXPECT_EQ(3u, edgeIds.size());
+
+  // Given values that are not parameters, like the current of a diode
+  CircuitGraph givenCurrent;
+  for (auto vertex : {otherVcc, otherRef, otherV1}) {
+    EXPECT_TRUE(givenCurrent.addVertex(vertex));
+  }
+  EXPECT_TRUE(givenCurrent.addEdge(
+      Edge(gen(), IdealDiode(otherV1, otherRef, 0.7, 1e-3))));
+  EXPECT_TRUE(
+      givenCurrent.addEdge(Edge(gen(), Resistor(otherV1, otherRef, 3000))));
+  EXPECT_TRUE(
+      givenCurrent.addEdge(Edge(gen(), Resistor(otherVcc, otherV1, 2000))));
+  EXPECT_NE(hash, givenCurrent.getCanonicalHash());
+
+  // Solving does not change the circuit, but changing a parameter does
+  ASSERT_TRUE(forwards.solveCircuit());
+  EXPECT_EQ(hash, forwards.getCanonicalHash());
+  EXPECT_TRUE(forwards.setBranchParameter(r2.getId(), "resistance", 4000));
+  EXPECT_NE(hash, forwards.getCanonicalHash());
+}
+
+TEST(CircuitTest, SolutionCacheEvictsLeastRecentlyUsed) {
+  SolutionCache cache(2);
+  cache.insert(1, "a", "solution a");
+  cache.insert(2, "b", "solution b");
+  EXPECT_EQ("solution a", cache.find(1, "a"));
+  // b is now the least recently used
+  cache.insert(3, "c", "solution c");
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_FALSE(cache.find(2, "b").has_value());
+  EXPECT_EQ("solution c", cache.find(3, "c"));
+  // A different key with the same hash is not a hit
+  EXPECT_FALSE(cache.find(1, "d").has_value());
+  EXPECT_EQ(2u, cache.getHits());
+  EXPECT_EQ(2u, cache.getMisses());
+
+  cache.setCapacity(1);
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_TRUE(cache.find(3, "c").has_value());
+  cache.clear();
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(0u, cache.getHits());
+}
+
+TEST(CircuitTest, StructurallySingularCircuitsRejected) {
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 10);
+  Vertex a(gen()), b(gen()), c(gen());
+  CircuitGraph cg;
+  for (auto vertex : {ref, vcc, a, b, c}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(vcc, a, 1000))));
+  EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(a, ref, 1000))));
+  // c is not connected to anything
+  EXPECT_TRUE(cg.addEdge(Edge(gen(), CurrentSource(a, b, 1e-3))));
+  EXPECT_EQ(StructuralError::FLOATING_VERTEX, cg.checkStructure());
+  EXPECT_FALSE(cg.solveCircuit());
+
+  // b is only reached through the current source
+  EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(b, c, 1000))));
+  EXPECT_EQ(StructuralError::CURRENT_SOURCE_CUTSET, cg.checkStructure());
+
+  EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(c, ref, 1000))));
+  EXPECT_EQ(StructuralError::NONE, cg.checkStructure());
+  ASSERT_TRUE(cg.solveCircuit());
+  EXPECT_TRUE(IsWithinRelativeTolerance(4.5, a.getVoltage().evaluate()));
+
+  // The loop closes through the two vertices with given voltages
+  CircuitGraph loop;
+  for (auto vertex : {ref, vcc, a}) {
+    EXPECT_TRUE(loop.addVertex(vertex));
+  }
+  EXPECT_TRUE(loop.addEdge(Edge(gen(), VoltageSource(ref, a, 4))));
+  EXPECT_TRUE(loop.addEdge(Edge(gen(), VoltageSource(a, vcc, 6))));
+  EXPECT_EQ(StructuralError::VOLTAGE_SOURCE_LOOP, loop.checkStructure());
+}
+
+TEST(CircuitTest, TransientStepResponses) {
+  // A source switched on at 0 charges a capacitor through a resistor and
+  // drives current into an inductor through another, both with a time
+  // constant of 1ms
+  for (IntegrationMethod method : {IntegrationMethod::BACKWARD_EULER,
+                                   IntegrationMethod::TRAPEZOIDAL}) {
+    CircuitGraph cg;
+    auto gen = getUuidGenerator();
+    Vertex ref(gen(), 0);
+    Vertex vcc(gen()), a(gen()), b(gen());
+    Edge vs(gen(), VoltageSource(ref, vcc, 5));
+    Edge r1(gen(), Resistor(vcc, a, 1000));
+    Edge c(gen(), Capacitor(a, ref, 1e-6));
+    Edge r2(gen(), Resistor(vcc, b, 10));
+    Edge l(gen(), Inductor(b, ref, 10e-3));
+    for (auto vertex : {ref, vcc, a, b}) {
+      EXPECT_TRUE(cg.addVertex(vertex));
+    }
+    for (auto edge : {vs, r1, c, r2, l}) {
+      EXPECT_TRUE(cg.addEdge(edge));
+    }
+
+    TransientConfig transientConfig;
+    transientConfig.stopTime = 5e-3;
+    transientConfig.maxStep = 1e-4;
+    transientConfig.method = method;
+    size_t steps = 0;
+    double lastTime = 0;
+    ASSERT_TRUE(cg.transient(transientConfig, [&](double time) {
+      EXPECT_GT(time, lastTime);
+      lastTime = time;
+      steps++;
+      double charged = 1 - std::exp(-time / 1e-3);
+      EXPECT_TRUE(IsWithinRelativeTolerance(
+          5 * charged, a.getVoltage().evaluate(), 1e-2));
+      // Everything through the resistor charges the capacitor
+      EXPECT_TRUE(
+          IsWithinRelativeTolerance((5 - a.getVoltage().evaluate()) / 1000,
+                                    c.getCurrent().evaluate()));
+      EXPECT_TRUE(IsWithinRelativeTolerance(0.5 * charged,
+                                            l.getCurrent().evaluate(), 1e-2));
+      return true;
+    }));
+    EXPECT_EQ(5e-3, lastTime);
+    // Runs of steps of the same length reuse the factorisation
+    EXPECT_LT(cg.getFactorizations(), steps / 2);
+  }
+}
+
+TEST(CircuitTest, AcSweepOfFilterAndDiode) {
+  // An RC low-pass filter and a resistor into a forward biased diode, both
+  // driven by the same source
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vin(gen()), out(gen()), anode(gen());
+  Edge vs(gen(), VoltageSource(ref, vin, 1));
+  Edge r1(gen(), Resistor(vin, out, 1000));
+  Edge c(gen(), Capacitor(out, ref, 1e-6));
+  Edge r2(gen(), Resistor(vin, anode, 1000));
+  Edge d(gen(), RealDiode(anode, ref, 1e-14, 1, 25e-3));
+  for (auto vertex : {ref, vin, out, anode}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto edge : {vs, r1, c, r2, d}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SolverConfig config;
+  config.partitionThreads = 2;
+  AcSweepResult result;
+  ASSERT_TRUE(cg.acSweep(vs.getId(), 1, 1e5, 6, result, config));
+  ASSERT_EQ(6u, result.frequencies.size());
+  size_t outIndex = std::find(result.vertexIds.begin(), result.vertexIds.end(),
+                              out.getId()) -
+                    result.vertexIds.begin();
+  size_t anodeIndex = std::find(result.vertexIds.begin(),
+                                result.vertexIds.end(), anode.getId()) -
+                      result.vertexIds.begin();
+  size_t numVertices = result.vertexIds.size();
+  // The graph is left at the operating point, where the diode is a resistance
+  double current = 1e-14 * std::exp(anode.getVoltage().evaluate() / 25e-3);
+  double diodeResistance = 25e-3 / current;
+  const double cutoff = 1 / (2 * M_PI * 1000 * 1e-6);
+  for (size_t i = 0; i < result.frequencies.size(); i++) {
+    EXPECT_TRUE(result.solved[i]);
+    double frequency = result.frequencies[i];
+    EXPECT_TRUE(IsWithinRelativeTolerance(std::pow(10, i), frequency));
+    double ratio = frequency / cutoff;
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        1 / std::sqrt(1 + ratio * ratio),
+        result.voltageMagnitudes[i * numVertices + outIndex]));
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        -std::atan(ratio), result.voltagePhases[i * numVertices + outIndex]));
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        diodeResistance / (1000 + diodeResistance),
+        result.voltageMagnitudes[i * numVertices + anodeIndex]));
+  }
+}
+
+TEST(CircuitTest, BridgeRectifierBankComplementarity) {
+  // Four bridge rectifiers on one source is 16 ideal diodes, which would be
+  // 65536 partitions if each combination of diode states was enumerated
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex a(gen());
+  EXPECT_TRUE(cg.addVertex(ref));
+  EXPECT_TRUE(cg.addVertex(a));
+  Edge vs(gen(), VoltageSource(ref, a, 10));
+  EXPECT_TRUE(cg.addEdge(vs));
+
+  std::vector<std::unique_ptr<Vertex>> outputs;
+  std::vector<Edge> loads;
+  for (int i = 0; i < 4; i++) {
+    Vertex& p = *outputs.emplace_back(std::make_unique<Vertex>(gen()));
+    Vertex& n = *outputs.emplace_back(std::make_unique<Vertex>(gen()));
+    EXPECT_TRUE(cg.addVertex(p));
+    EXPECT_TRUE(cg.addVertex(n));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), IdealDiode(a, p))));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), IdealDiode(ref, p))));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), IdealDiode(n, a))));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), IdealDiode(n, ref))));
+    loads.emplace_back(gen(), Resistor(p, n, 1000.0 * (i + 1)));
+    EXPECT_TRUE(cg.addEdge(loads.back()));
+  }
+
+  ASSERT_TRUE(cg.solveCircuit());
+  double totalCurrent = 0;
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        10, outputs[2 * i]->getVoltage().evaluate()));
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        0, outputs[2 * i + 1]->getVoltage().evaluate()));
+    double expectedCurrent = 10 / (1000.0 * (i + 1));
+    EXPECT_TRUE(IsWithinRelativeTolerance(expectedCurrent,
+                                          loads[i].getCurrent().evaluate()));
+    totalCurrent += expectedCurrent;
+  }
+  EXPECT_TRUE(IsWithinRelativeTolerance(totalCurrent, vs.getCurrent().evaluate()));
+}
+
+TEST(CircuitTest, SolverConfigChoosesLinearSolver) {
+  SolverConfig config;
+  config.numThreads = 4;
+  config.maxIterations = 20;
+  // Small problems are cheapest to factorise densely
+  auto options = getCeresOptions(config, 10, 12, 30);
+  EXPECT_EQ(ceres::DENSE_QR, options.linear_solver_type);
+  EXPECT_EQ(4, options.num_threads);
+  EXPECT_EQ(20, options.max_num_iterations);
+  // A 5000 node circuit has a handful of unknowns in each residual
+  options = getCeresOptions(config, 5000, 6000, 20000);
+  EXPECT_EQ(ceres::SPARSE_NORMAL_CHOLESKY, options.linear_solver_type);
+  // ... unless every residual depends on most of the unknowns
+  options = getCeresOptions(config, 500, 500, 200000);
+  EXPECT_EQ(ceres::DENSE_QR, options.linear_solver_type);
+
+  config.linearSolver = LinearSolver::CGNR;
+  options = getCeresOptions(config, 10, 12, 30);
+  EXPECT_EQ(ceres::CGNR, options.linear_solver_type);
+}
+
+TEST(CircuitTest, WarmStartFromPreviousSolution) {
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 12);
+  Vertex mid(gen());
+  Edge r1(gen(), Resistor(vcc, mid, 1000));
+  Edge r2(gen(), Resistor(mid, ref, 2000));
+  CircuitGraph previous;
+  for (auto& vertex : {ref, vcc, mid}) {
+    EXPECT_TRUE(previous.addVertex(vertex));
+  }
+  EXPECT_TRUE(previous.addEdge(r1));
+  EXPECT_TRUE(previous.addEdge(r2));
+  ASSERT_TRUE(previous.solveCircuit());
+  EXPECT_EQ(0u, previous.getSolveAttempts());
+
+  // The same circuit with its own unknowns, solved with ceres from the
+  // previous solution
+  Vertex mid2(mid.getId());
+  Edge s1(r1.getId(), Resistor(vcc, mid2, 1000));
+  Edge s2(r2.getId(), Resistor(mid2, ref, 2000));
+  CircuitGraph cg;
+  for (auto& vertex : {ref, vcc, mid2}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  EXPECT_TRUE(cg.addEdge(s1));
+  EXPECT_TRUE(cg.addEdge(s2));
+  EXPECT_FALSE(cg.setInitialGuess(vcc, 1));
+  EXPECT_TRUE(cg.setInitialGuess(mid2, -50));
+  cg.warmStart(previous);
+
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  config.seed = 42;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_EQ(1u, cg.getSolveAttempts());
+  EXPECT_TRUE(IsWithinRelativeTolerance(8, mid2.getVoltage().evaluate()));
+}
+
+TEST(CircuitTest, WarmStartNewtonIterations) {
+  // A string of diodes, which takes Newton-Raphson several limited steps from
+  // the critical voltage of each junction
+  auto gen = getUuidGenerator();
+  const uuids::uuid refId = gen(), vccId = gen(), resistorId = gen();
+  std::vector<uuids::uuid> anodeIds, diodeIds;
+  for (int i = 0; i < 4; i++) {
+    anodeIds.push_back(gen());
+    diodeIds.push_back(gen());
+  }
+  // The branches refer to the vertices, so `vertices` has to outlive `cg`
+  auto build = [&](CircuitGraph& cg, std::vector<Vertex>& vertices) {
+    vertices = {Vertex(refId, 0), Vertex(vccId, 5)};
+    for (auto& id : anodeIds) {
+      vertices.emplace_back(id);
+    }
+    for (auto& vertex : vertices) {
+      EXPECT_TRUE(cg.addVertex(vertex));
+    }
+    EXPECT_TRUE(
+        cg.addEdge(Edge(resistorId, Resistor(vertices[1], vertices[2], 100))));
+    for (size_t i = 0; i < 4; i++) {
+      const Vertex& cathode = i == 3 ? vertices[0] : vertices[i + 3];
+      EXPECT_TRUE(cg.addEdge(Edge(
+          diodeIds[i], RealDiode(vertices[i + 2], cathode, 1e-14, 1, 25e-3))));
+    }
+  };
+  SolverConfig config;
+  config.engine = SolverEngine::NEWTON;
+  config.maxNewtonIterations = 50;
+
+  std::vector<Vertex> previousVertices;
+  CircuitGraph previous;
+  build(previous, previousVertices);
+  ASSERT_TRUE(previous.solveCircuit(config));
+  size_t coldIterations = previous.getNewtonIterations();
+  EXPECT_GT(coldIterations, 3u);
+  // Solving again only counts the iterations of the new solve, which starts
+  // from the last solution
+  ASSERT_TRUE(previous.solveCircuit(config));
+  EXPECT_LE(previous.getNewtonIterations(), 2u);
+
+  std::vector<Vertex> vertices;
+  CircuitGraph cg;
+  build(cg, vertices);
+  cg.warmStart(previous);
+  ASSERT_TRUE(cg.solveCircuit(config));
+  // One step from the solution, and one to confirm it has converged
+  EXPECT_LE(cg.getNewtonIterations(), 2u);
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(previousVertices[2].getVoltage().evaluate(),
+                                vertices[2].getVoltage().evaluate()));
+}
+
+TEST(CircuitTest, IncrementalResolveAfterParameterChange) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex v2(gen());
+  Edge vs(gen(), VoltageSource(ref, v1, 10));
+  Edge r1(gen(), Resistor(v1, v2, 1000));
+  Edge r2(gen(), Resistor(v2, ref, 1000));
+  for (auto& vertex : {ref, v1, v2}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto& edge : {vs, r1, r2}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+  ASSERT_TRUE(cg.solveCircuit());
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, v2.getVoltage().evaluate()));
+
+  EXPECT_TRUE(cg.setBranchParameter(r2.getId(), "resistance", 4000));
+  EXPECT_FALSE(v2.getVoltage().isConstant());
+  ASSERT_TRUE(cg.solveCircuit());
+  EXPECT_TRUE(IsWithinRelativeTolerance(8, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(2e-3, vs.getCurrent().evaluate()));
+
+  EXPECT_TRUE(cg.setBranchParameter(vs.getId(), "voltage", 5));
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_EQ(1u, cg.getSolveAttempts());
+  EXPECT_TRUE(IsWithinRelativeTolerance(4, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(1e-3, r1.getCurrent().evaluate()));
+
+  // Only known parameters can be changed
+  EXPECT_FALSE(cg.setBranchParameter(vs.getId(), "current", 1));
+  EXPECT_FALSE(cg.setBranchParameter(r1.getId(), "voltage", 1));
+  EXPECT_FALSE(cg.setBranchParameter(gen(), "resistance", 1));
+}
+
+TEST(CircuitTest, ResolveWithNewtonAfterCeres) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex v2(gen());
+  Edge vs(gen(), VoltageSource(ref, v1, 10));
+  Edge r1(gen(), Resistor(v1, v2, 1000));
+  Edge r2(gen(), Resistor(v2, ref, 1000));
+  for (auto& vertex : {ref, v1, v2}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto& edge : {vs, r1, r2}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+  SolverConfig config;
+  config.engine = SolverEngine::CERES;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, v2.getVoltage().evaluate()));
+
+  // The voltages solved by ceres are unknowns of the Newton-Raphson system,
+  // not given voltages
+  config.engine = SolverEngine::NEWTON;
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(cg.setBranchParameter(r2.getId(), "resistance", 3000));
+  ASSERT_TRUE(cg.solveCircuit(config));
+  EXPECT_TRUE(IsWithinRelativeTolerance(7.5, v2.getVoltage().evaluate()));
+  EXPECT_TRUE(IsWithinRelativeTolerance(2.5e-3, r1.getCurrent().evaluate()));
+}
+
+TEST(CircuitTest, DcSweepOfSourceVoltage) {
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex v1(gen());
+  Vertex v2(gen());
+  Edge vs(gen(), VoltageSource(ref, v1, 0));
+  Edge r1(gen(), Resistor(v1, v2, 3000));
+  Edge d(gen(), RealDiode(v2, ref, 1e-14, 1, 25e-3));
+  for (auto& vertex : {ref, v1, v2}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto& edge : {vs, r1, d}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  SweepResult result;
+  EXPECT_FALSE(cg.dcSweep(vs.getId(), "resistance", 0, 1, 2, result));
+  ASSERT_TRUE(cg.dcSweep(vs.getId(), "voltage", 0, 5, 51, result));
+  ASSERT_EQ(51u, result.values.size());
+  size_t v1Column = std::find(result.vertexIds.begin(), result.vertexIds.end(),
+                              v1.getId()) -
+                    result.vertexIds.begin();
+  size_t v2Column = std::find(result.vertexIds.begin(), result.vertexIds.end(),
+                              v2.getId()) -
+                    result.vertexIds.begin();
+  size_t dColumn =
+      std::find(result.edgeIds.begin(), result.edgeIds.end(), d.getId()) -
+      result.edgeIds.begin();
+  size_t numVertices = result.vertexIds.size();
+  size_t numEdges = result.edgeIds.size();
+  double lastDrop = -1;
+  for (size_t i = 0; i < result.values.size(); i++) {
+    ASSERT_TRUE(result.solved[i]);
+    double source = result.voltages[i * numVertices + v1Column];
+    double drop = result.voltages[i * numVertices + v2Column];
+    double current = result.currents[i * numEdges + dColumn];
+    EXPECT_NEAR(0.1 * i, result.values[i], 1e-12);
+    EXPECT_NEAR(result.values[i], source, 1e-9);
+    // The diode clamps the output and carries the resistor's current
+    EXPECT_GE(drop, lastDrop);
+    EXPECT_LT(drop, 0.7);
+    EXPECT_NEAR((source - drop) / 3000, current, 1e-9);
+    lastDrop = drop;
+  }
+
+  proto::DcSweep table = result.toProto();
+  EXPECT_EQ(51, table.values_size());
+  EXPECT_EQ(51 * static_cast<int>(numVertices), table.voltages_size());
+  EXPECT_EQ(51 * static_cast<int>(numEdges), table.currents_size());
+}
+
+TEST(CircuitTest, DcSweepOfResistance) {
+  // A swept resistor in series with another, starting from 1 Ohm, where the
+  // division by the resistance is folded away, and one directly across a
+  // fixed source, whose current is a known value
+  CircuitGraph cg;
+  auto gen = getUuidGenerator();
+  Vertex ref(gen(), 0);
+  Vertex vcc(gen(), 5);
+  Vertex mid(gen());
+  Edge series(gen(), Resistor(vcc, mid, 1));
+  Edge load(gen(), Resistor(mid, ref, 1000));
+  Edge across(gen(), Resistor(vcc, ref, 1));
+  for (auto& vertex : {ref, vcc, mid}) {
+    EXPECT_TRUE(cg.addVertex(vertex));
+  }
+  for (auto& edge : {series, load, across}) {
+    EXPECT_TRUE(cg.addEdge(edge));
+  }
+
+  for (const Edge* swept : {&series, &across}) {
+    SweepResult result;
+    ASSERT_TRUE(cg.dcSweep(swept->getId(), "resistance", 1, 1000, 4, result));
+    size_t numEdges = result.edgeIds.size();
+    size_t seriesColumn = std::find(result.edgeIds.begin(),
+                                    result.edgeIds.end(), series.getId()) -
+                          result.edgeIds.begin();
+    size_t acrossColumn = std::find(result.edgeIds.begin(),
+                                    result.edgeIds.end(), across.getId()) -
+                          result.edgeIds.begin();
+    for (size_t i = 0; i < result.values.size(); i++) {
+      ASSERT_TRUE(result.solved[i]);
+      double seriesResistance = swept == &series ? result.values[i] : 1;
+      double acrossResistance = swept == &across ? result.values[i] : 1;
+      EXPECT_TRUE(IsWithinRelativeTolerance(
+          5 / (seriesResistance + 1000),
+          result.currents[i * numEdges + seriesColumn]));
+      EXPECT_TRUE(IsWithinRelativeTolerance(
+          5 / acrossResistance, result.currents[i * numEdges + acrossColumn]));
+    }
+    // Leaves the swept resistor as it started
+    ASSERT_TRUE(cg.setBranchParameter(swept->getId(), "resistance", 1));
+  }
+}
+
+TEST(CircuitTest, ArenaExpressionsOutliveGraph) {
+  auto gen = getUuidGenerator();
+  std::vector<Vertex> vertices;
+  {
+    CircuitGraph cg;
+    ExpressionArena::Scope scope(cg.getArena());
+    Vertex ref(gen(), 0);
+    Vertex v1(gen());
+    Vertex vcc(gen(), 10);
+    for (auto& vertex : {ref, v1, vcc}) {
+      EXPECT_TRUE(cg.addVertex(vertex));
+    }
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(vcc, v1, 1000))));
+    EXPECT_TRUE(cg.addEdge(Edge(gen(), Resistor(v1, ref, 1000))));
+    ASSERT_TRUE(cg.solveCircuit());
+    vertices = cg.getVertices();
+  }
+  // The nodes built in the arena of the graph keep it alive
+  std::vector<double> voltages;
+  for (auto& vertex : vertices) {
+    voltages.push_back(vertex.getVoltage().evaluate());
+  }
+  std::sort(voltages.begin(), voltages.end());
+  ASSERT_EQ(3u, voltages.size());
+  EXPECT_EQ(0, voltages[0]);
+  EXPECT_TRUE(IsWithinRelativeTolerance(5, voltages[1]));
+  EXPECT_EQ(10, voltages[2]);
+}
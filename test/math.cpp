@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
+#include <stdlib.h>
+
+#include <cstdlib>
+#include <filesystem>
 
 #include "src/expression.h"
+#include "src/lcpSolver.h"
 #include "utils.h"
 
 TEST(MathTest, BasicEquality) {
@@ -74,3 +79,398 @@ TEST(MathTest, CeresOptimizationLarge) {
   EXPECT_TRUE(IsWithinRelativeTolerance(-2.40797, y.evaluate()));
   EXPECT_TRUE(IsWithinRelativeTolerance(1, z.evaluate()));
 }
+
+TEST(MathTest, CompiledTape) {
+  Expression x, y, w;
+  Expression shared = x * y;
+  Expression e = Expression::makeConditional(x > y, std::exp(shared), -x) +
+                 Expression::makeConditional(w >= 0, shared / (y + 2), y) -
+                 shared * 3;
+  const double xs[] = {0.5, -1, 2};
+  const double ys[] = {0.25, 3, -0.5};
+  for (int i = 0; i < 3; i++) {
+    ExpressionTape tape = e.compile();
+    TapeParameters parameters = getTapeParameters(
+        tape, {{x.getPtrToUnknown(), xs[i]}, {y.getPtrToUnknown(), ys[i]}},
+        -1);
+    double s = xs[i] * ys[i];
+    double expected = (xs[i] > ys[i] ? std::exp(s) : -xs[i]) + ys[i] - s * 3;
+    EXPECT_TRUE(IsWithinRelativeTolerance(
+        expected, tape.evaluate(parameters.blocks.data())));
+  }
+
+  // Solved values are folded into constants, along with the conditions that
+  // depend only on them
+  w.setSolution(1);
+  ExpressionTape tape = e.compile();
+  size_t selects = 0;
+  for (auto& instruction : tape.getInstructions()) {
+    if (instruction.op == ExpressionTape::OpCode::SELECT_GT ||
+        instruction.op == ExpressionTape::OpCode::SELECT_GEQ) {
+      selects++;
+    }
+  }
+  EXPECT_EQ(selects, 1u);
+  // Derivatives through the tape match the analytic ones
+  typedef ceres::Jet<double, 2> Jet;
+  std::vector<Jet> jets;
+  for (double* unknown : tape.getUnknowns()) {
+    if (unknown == x.getPtrToUnknown()) {
+      jets.emplace_back(2.0, 0);
+    } else if (unknown == y.getPtrToUnknown()) {
+      jets.emplace_back(1.0, 1);
+    } else {
+      jets.emplace_back(0.0);
+    }
+  }
+  std::vector<const Jet*> jetBlocks;
+  for (Jet& jet : jets) {
+    jetBlocks.push_back(&jet);
+  }
+  Jet result = tape.evaluate(jetBlocks.data());
+  // e = exp(xy) + xy / (y + 2) - 3xy at x = 2, y = 1
+  EXPECT_TRUE(IsWithinRelativeTolerance(std::exp(2) + 2.0 / 3 - 6, result.a));
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(std::exp(2) + 1.0 / 3 - 3, result.v[0]));
+  EXPECT_TRUE(
+      IsWithinRelativeTolerance(2 * std::exp(2) + 4.0 / 9 - 6, result.v[1]));
+}
+
+TEST(MathTest, ExpressionArena) {
+  auto arena = std::make_shared<ExpressionArena>();
+  Expression x, e;
+  {
+    ExpressionArena::Scope scope(arena);
+    Expression y;
+    e = std::exp(x * 2) - y / 4;
+    {
+      // Inner scopes take over until they close
+      ExpressionArena::Scope heap(nullptr);
+      size_t before = arena->getBytesAllocated();
+      Expression z = x + 1;
+      EXPECT_EQ(arena->getBytesAllocated(), before);
+    }
+    y = 8;
+  }
+  EXPECT_EQ(ExpressionArena::current(), nullptr);
+  EXPECT_GT(arena->getBytesAllocated(), 0);
+  // The nodes keep the arena alive after its last handle is dropped
+  arena.reset();
+  x = 0.5;
+  EXPECT_TRUE(IsWithinRelativeTolerance(std::exp(1) - 2, e.evaluate()));
+}
+
+TEST(MathTest, HashConsing) {
+  Expression a, b;
+  Expression difference = a - b;
+  EXPECT_EQ(difference, a - b);
+  EXPECT_NE(difference, b - a);
+  EXPECT_EQ(std::exp(difference), std::exp(a - b));
+  // The shared subexpressions are compiled once: two loads, a - b, exp, the
+  // product and the sum
+  Expression e = std::exp(a - b) + std::exp(a - b) * (a - b);
+  EXPECT_EQ(e.compile().getInstructions().size(), 6u);
+  // Each arena shares its own nodes, apart from those of the calling thread
+  auto arena = std::make_shared<ExpressionArena>();
+  {
+    ExpressionArena::Scope scope(arena);
+    Expression inArena = a - b;
+    EXPECT_NE(inArena, difference);
+    EXPECT_EQ(inArena, a - b);
+  }
+}
+
+TEST(MathTest, SymbolicDerivatives) {
+  Expression x, y;
+  Expression e =
+      Expression::makeConditional(x > y, std::exp(x / y), x * y - y) / (x + 3);
+  ExpressionTape tape = e.compileWithDerivatives();
+  // x, y and the constraint on the condition
+  ASSERT_EQ(tape.getUnknowns().size(), 3u);
+  ASSERT_EQ(tape.getNumOutputs(), 4u);
+  ExpressionCostFunction analytic(tape);
+  ceres::DynamicAutoDiffCostFunction<ExpressionCostFunctor> automatic(
+      new ExpressionCostFunctor(tape));
+  for (size_t i = 0; i < tape.getUnknowns().size(); i++) {
+    automatic.AddParameterBlock(1);
+  }
+  automatic.SetNumResiduals(1);
+  // Both branches of the conditional, the true one at x = 2, y = 1.5
+  const double points[][2] = {{2, 1.5}, {-1, 0.5}};
+  for (auto& point : points) {
+    TapeParameters parameters = getTapeParameters(
+        tape,
+        {{x.getPtrToUnknown(), point[0]}, {y.getPtrToUnknown(), point[1]}}, 0);
+    size_t numUnknowns = parameters.values.size();
+    double residual, expectedResidual;
+    std::vector<double> jacobian(numUnknowns);
+    std::vector<double> expectedJacobian(numUnknowns);
+    std::vector<double*> jacobians, expectedJacobians;
+    for (size_t i = 0; i < numUnknowns; i++) {
+      jacobians.push_back(&jacobian[i]);
+      expectedJacobians.push_back(&expectedJacobian[i]);
+    }
+    ASSERT_TRUE(analytic.Evaluate(parameters.blocks.data(), &residual,
+                                  jacobians.data()));
+    ASSERT_TRUE(automatic.Evaluate(parameters.blocks.data(), &expectedResidual,
+                                   expectedJacobians.data()));
+    EXPECT_TRUE(IsWithinRelativeTolerance(expectedResidual, residual));
+    for (size_t i = 0; i < numUnknowns; i++) {
+      EXPECT_TRUE(IsWithinRelativeTolerance(expectedJacobian[i], jacobian[i]));
+    }
+  }
+  // Derivatives of other unknowns and of constants vanish
+  Expression z;
+  EXPECT_EQ(e.differentiate(z.getPtrToUnknown()), 0);
+  EXPECT_EQ((x * 2).differentiate(x.getPtrToUnknown()), 2);
+}
+
+TEST(MathTest, MultipleResiduals) {
+  Expression x, y, z;
+  Expression current = std::exp((x - y) / 0.025) * 1e-12;
+  std::vector<Expression> residuals = {current - x / 1000, y / 500 - current,
+                                       z - 1};
+  ExpressionCostFunction::Derivatives derivatives;
+  ExpressionTape tape =
+      Expression::compileWithDerivatives(residuals, derivatives);
+  ASSERT_EQ(tape.getUnknowns().size(), 3u);
+  // z only appears in the last residual
+  ASSERT_EQ(derivatives.size(), 5u);
+  ASSERT_EQ(tape.getNumOutputs(), 8u);
+  // The shared current is evaluated once for both residuals
+  size_t exps = 0;
+  for (auto& instruction : tape.getInstructions()) {
+    exps += instruction.op == ExpressionTape::OpCode::EXP;
+  }
+  EXPECT_EQ(exps, 1u);
+
+  ExpressionCostFunction costFunction(tape, residuals.size(), derivatives);
+  TapeParameters parameters = getTapeParameters(
+      tape,
+      {{x.getPtrToUnknown(), 0.6},
+       {y.getPtrToUnknown(), 0.1},
+       {z.getPtrToUnknown(), 3}},
+      0);
+  const size_t numUnknowns = tape.getUnknowns().size();
+  std::vector<double> values(residuals.size());
+  std::vector<std::vector<double>> jacobian(
+      numUnknowns, std::vector<double>(residuals.size()));
+  std::vector<double*> jacobians;
+  for (auto& column : jacobian) {
+    jacobians.push_back(column.data());
+  }
+  ASSERT_TRUE(costFunction.Evaluate(parameters.blocks.data(), values.data(),
+                                    jacobians.data()));
+  // Each residual and its derivatives match it compiled on its own
+  for (size_t r = 0; r < residuals.size(); r++) {
+    ExpressionTape single = residuals[r].compileWithDerivatives();
+    std::unordered_map<const double*, double> point;
+    for (size_t i = 0; i < numUnknowns; i++) {
+      point[tape.getUnknowns()[i]] = parameters.values[i];
+    }
+    TapeParameters singleParameters = getTapeParameters(single, point, 0);
+    std::vector<double> expected(single.getNumOutputs());
+    single.evaluate(singleParameters.blocks.data(), expected.data(),
+                    expected.size());
+    EXPECT_TRUE(IsWithinRelativeTolerance(expected[0], values[r]));
+    for (size_t i = 0; i < numUnknowns; i++) {
+      double expectedDerivative = 0;
+      for (size_t j = 0; j < single.getUnknowns().size(); j++) {
+        if (single.getUnknowns()[j] == tape.getUnknowns()[i]) {
+          expectedDerivative = expected[j + 1];
+        }
+      }
+      EXPECT_TRUE(
+          IsWithinRelativeTolerance(expectedDerivative, jacobian[i][r]));
+    }
+  }
+}
+
+TEST(MathTest, NativeCode) {
+  Expression x, y;
+  std::vector<ExpressionTape> tapes;
+  Expression diode = std::exp((x - y) / 0.025) * 1e-12 - x / 1000;
+  diode.compileResiduals(tapes);
+  Expression clamp = Expression::makeConditional(x >= y, x - y, y * 2);
+  clamp.compileResiduals(tapes);
+  ExpressionCostFunction::Derivatives derivatives;
+  tapes.push_back(
+      Expression::compileWithDerivatives({diode, clamp}, derivatives));
+  std::shared_ptr<const NativeCode> code =
+      NativeCode::load(tapes, "", ::testing::TempDir() + "nativeCode");
+  if (code == nullptr) {
+    GTEST_SKIP() << "No C++ compiler to generate code with";
+  }
+  // Loading the same structure again reuses the loaded code
+  EXPECT_EQ(NativeCode::load(tapes, "", ::testing::TempDir() + "nativeCode"),
+            code);
+  const double points[][2] = {{0.6, 0.1}, {-0.2, 0.3}};
+  for (auto& point : points) {
+    for (size_t t = 0; t < tapes.size(); t++) {
+      const ExpressionTape& tape = tapes[t];
+      TapeParameters parameters = getTapeParameters(
+          tape,
+          {{x.getPtrToUnknown(), point[0]}, {y.getPtrToUnknown(), point[1]}},
+          0.5);
+      std::vector<double> expected(tape.getNumOutputs());
+      std::vector<double> actual(tape.getNumOutputs());
+      tape.evaluate(parameters.blocks.data(), expected.data(),
+                    expected.size());
+      code->getFunction(t)(parameters.blocks.data(),
+                           tape.getConstants().data(), actual.data(),
+                           static_cast<int>(actual.size()));
+      for (size_t i = 0; i < expected.size(); i++) {
+        EXPECT_DOUBLE_EQ(expected[i], actual[i]);
+      }
+    }
+  }
+
+  // The default cache is refused while other users could write to it
+  namespace fs = std::filesystem;
+  fs::path cacheHome = ::testing::TempDir() + "cacheHome";
+  fs::create_directories(cacheHome / "circuitSolver");
+  fs::permissions(cacheHome / "circuitSolver", fs::perms::all);
+  const char* previous = std::getenv("XDG_CACHE_HOME");
+  std::string previousCacheHome = previous != nullptr ? previous : "";
+  setenv("XDG_CACHE_HOME", cacheHome.c_str(), 1);
+  std::vector<ExpressionTape> productTapes;
+  Expression product = x * y - 3;
+  product.compileResiduals(productTapes);
+  EXPECT_EQ(NativeCode::load(productTapes, "", ""), nullptr);
+  fs::permissions(cacheHome / "circuitSolver", fs::perms::owner_all);
+  EXPECT_NE(NativeCode::load(productTapes, "", ""), nullptr);
+  if (previous != nullptr) {
+    setenv("XDG_CACHE_HOME", previousCacheHome.c_str(), 1);
+  } else {
+    unsetenv("XDG_CACHE_HOME");
+  }
+}
+
+TEST(MathTest, BatchEvaluation) {
+  Expression x, y;
+  Expression diode = std::exp((x - y) / 0.025) * 1e-12 - x / 1000;
+  Expression e = Expression::makeConditional(x >= y, diode, y * 2 - 1);
+  ExpressionTape tape = e.compile();
+  // Not a whole number of blocks, and reaching where e^x overflows
+  const size_t count = 101;
+  std::vector<std::vector<double>> columns(tape.getUnknowns().size());
+  for (size_t j = 0; j < count; j++) {
+    double xj = -20.0 + 0.4 * static_cast<double>(j);
+    TapeParameters row = getTapeParameters(
+        tape, {{x.getPtrToUnknown(), xj}, {y.getPtrToUnknown(), 0.3 - xj / 2}},
+        0.5);
+    for (size_t i = 0; i < columns.size(); i++) {
+      columns[i].push_back(row.values[i]);
+    }
+  }
+  std::vector<const double*> parameters;
+  for (auto& column : columns) {
+    parameters.push_back(column.data());
+  }
+  std::vector<double> outputs(count);
+  tape.evaluateBatch(parameters.data(), count, outputs.data());
+  for (size_t j = 0; j < count; j++) {
+    std::vector<const double*> set;
+    for (auto& column : columns) {
+      set.push_back(&column[j]);
+    }
+    double expected = tape.evaluate(set.data());
+    if (std::isinf(expected)) {
+      EXPECT_EQ(expected, outputs[j]);
+    } else {
+      EXPECT_TRUE(IsWithinRelativeTolerance(expected, outputs[j], 1e-13));
+    }
+  }
+}
+
+TEST(MathTest, Simplification) {
+  Expression x, y, k;
+  // Constants are folded through chains of sums
+  Expression offset = (x + k) + 3;
+  k = 2.0;
+  EXPECT_EQ(5u, offset.compile().getInstructions().size());
+  EXPECT_EQ(3u, offset.simplify().compile().getInstructions().size());
+  EXPECT_TRUE((-(-x)).simplify() == x);
+  EXPECT_TRUE((-(x - y)).simplify() == y - x);
+  EXPECT_TRUE((Expression(0.0) - (x - y)).simplify() == y - x);
+  EXPECT_TRUE((x + y - x).simplify() == y);
+  // Commutative operands are put in one order, so these cancel
+  EXPECT_TRUE((x * y - y * x).simplify() == 0.0);
+  // Repeated division by a constant is one multiplication
+  EXPECT_EQ(3u, (x / 4 / 4).simplify().compile().getInstructions().size());
+  // The current through a resistor divides the voltage across it once
+  Expression resistance = 1000.0;
+  Expression current = (x - y) / resistance;
+  EXPECT_EQ(5u, current.simplify().compile().getInstructions().size());
+
+  Expression e =
+      Expression::makeConditional(x >= y, std::exp((x - y) / 0.025) * 1e-12,
+                                  -(-(y - x) / 2) + (x + 1) * 3 - x * 3);
+  Expression simplified = e.simplify();
+  ExpressionTape original = e.compile();
+  ExpressionTape tape = simplified.compile();
+  EXPECT_LT(tape.getInstructions().size(), original.getInstructions().size());
+  const double points[][2] = {{0.6, 0.1}, {-0.2, 0.3}, {0.4, 0.4}};
+  for (auto& point : points) {
+    auto evaluate = [&](const ExpressionTape& t) {
+      TapeParameters parameters = getTapeParameters(
+          t,
+          {{x.getPtrToUnknown(), point[0]}, {y.getPtrToUnknown(), point[1]}},
+          0.5);
+      return t.evaluate(parameters.blocks.data());
+    };
+    EXPECT_TRUE(IsWithinRelativeTolerance(evaluate(original), evaluate(tape),
+                                          1e-12));
+  }
+
+  // Known values only change the constants, so the code generated for the
+  // result is the same for every value
+  Expression r;
+  Expression scaled = (x - y) / r + (x - y) / 2 - y * r;
+  std::vector<std::string> sources;
+  for (double value : {2.0, 1.0, 0.0}) {
+    r = value;
+    sources.push_back(
+        NativeCode::generateSource({scaled.simplify().compile()}));
+  }
+  EXPECT_EQ(sources[0], sources[1]);
+  EXPECT_EQ(sources[0], sources[2]);
+}
+
+TEST(MathTest, NodeKinds) {
+  Expression x, y;
+  ExpressionNodePtr sum =
+      expressionNode::makeBinary(expressionNode::make<VariableNode>(),
+                                 expressionNode::make<VariableNode>(),
+                                 BinaryOp::ADD);
+  EXPECT_EQ(ExpressionNode::Kind::BINARY, sum->kind);
+  ASSERT_NE(nullptr, expressionNode::as<BinaryOpNode>(sum));
+  EXPECT_EQ(BinaryOp::ADD, expressionNode::as<BinaryOpNode>(sum)->op);
+  EXPECT_EQ(nullptr, expressionNode::as<UnaryOpNode>(sum));
+  EXPECT_EQ(nullptr, expressionNode::as<VariableNode>(sum));
+  ExpressionNodePtr exp = expressionNode::makeUnary(sum, UnaryOp::EXP);
+  EXPECT_EQ(ExpressionNode::Kind::UNARY, exp->kind);
+  EXPECT_EQ(nullptr, expressionNode::as<BinaryOpNode>(exp));
+  EXPECT_EQ(nullptr, expressionNode::as<VariableNode>(ExpressionNodePtr()));
+  // Dispatching on the kind evaluates every type of node
+  Expression e = Expression::makeConditional(x >= y, std::exp(x - y), -y) / 2;
+  x = 1.0;
+  y = 0.5;
+  EXPECT_TRUE(IsWithinRelativeTolerance(std::exp(0.5) / 2, e.evaluate()));
+}
+
+TEST(MathTest, LinearComplementarity) {
+  Eigen::MatrixXd M(3, 3);
+  M << 2, 1, 0, 1, 2, 0, 0, 0, 1;
+  Eigen::VectorXd q(3);
+  q << -5, -6, 1;
+  Eigen::VectorXd z;
+  ASSERT_TRUE(solveLcp(M, q, z));
+  Eigen::VectorXd w = q + M * z;
+  EXPECT_TRUE(IsWithinRelativeTolerance(4.0 / 3, z[0]));
+  EXPECT_TRUE(IsWithinRelativeTolerance(7.0 / 3, z[1]));
+  EXPECT_TRUE(IsWithinRelativeTolerance(0, z[2]));
+  EXPECT_TRUE(IsWithinRelativeTolerance(0, w[0]));
+  EXPECT_TRUE(IsWithinRelativeTolerance(0, w[1]));
+  EXPECT_TRUE(IsWithinRelativeTolerance(1, w[2]));
+}
@@ -54,3 +54,17 @@ uuids::uuid_random_generator getUuidGenerator() {
   uuids::uuid_random_generator gen{generator};
   return gen;
 }
+
+TapeParameters getTapeParameters(
+    const ExpressionTape& tape,
+    const std::unordered_map<const double*, double>& values, double otherwise) {
+  TapeParameters parameters;
+  for (double* unknown : tape.getUnknowns()) {
+    auto it = values.find(unknown);
+    parameters.values.push_back(it != values.end() ? it->second : otherwise);
+  }
+  for (double& value : parameters.values) {
+    parameters.blocks.push_back(&value);
+  }
+  return parameters;
+}
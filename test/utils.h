@@ -2,6 +2,10 @@
 #define TEST_UTILS_H
 #include <gtest/gtest.h>
 
+#include <unordered_map>
+#include <vector>
+
+#include "../src/expressionTape.h"
 #include "../src/proto.h"
 #include "uuid.h"
 
@@ -19,4 +23,22 @@ proto::CircuitGraph GetMessageFromJsonFile(const char* filename);
 
 uuids::uuid_random_generator getUuidGenerator();
 
+/**
+ * Values for the unknowns of an `ExpressionTape`, in the order of its slots.
+ * `blocks` points into `values`, so this must be moved rather than copied
+ */
+struct TapeParameters {
+  std::vector<double> values;
+  std::vector<const double*> blocks;
+};
+
+/**
+ * @param values the value of each unknown by its pointer
+ * @param otherwise the value of the unknowns not in `values`
+ * @return one parameter block of size 1 per unknown of `tape`
+ */
+TapeParameters getTapeParameters(
+    const ExpressionTape& tape,
+    const std::unordered_map<const double*, double>& values, double otherwise);
+
 #endif  // TEST_UTILS_H